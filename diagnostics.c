@@ -0,0 +1,70 @@
+/*
+	Counters to tell apart what went wrong on an adapter in the field.
+
+	Kept by the driver (I2C NACKs and timeouts) and the main loop (disconnects,
+	reconnects, stale reports...), they're sent to the host after the button
+	layout, in the same HID feature report (see main.c). Every counter saturates
+	instead of wrapping, and counting is just a load, an increment and a store.
+
+	The watchdog resets survive the resets themselves (.noinit, not cleared by
+	the startup code), and go back to 0 only on a power-on.
+*/
+
+#ifndef Diagnostics_c
+#define Diagnostics_c
+
+#define DIAGNOSTICS_MAGIC	0x5A // in .noinit next to the counter, "it's not garbage"
+
+// sent as is (little endian, no padding on AVR)
+typedef struct{
+	uint8_t		reset_cause;		// MCUSR at startup (PORF, EXTRF, BORF, WDRF)
+	uint8_t		watchdog_resets;	// since the last power-on
+	uint16_t	i2c_nacks;			// the controller didn't answer its address
+	uint16_t	disconnects;		// controller lost while reading it
+	uint16_t	reconnects;			// controller found again after that
+	uint16_t	stale_reports;		// reports sent without a new sample since the last one
+	uint16_t	enumeration_seconds;	// since the host asked for the report descriptor
+	uint8_t		oversampling;		// SAMPLER_OVERSAMPLING
+	uint8_t		samples_per_report;	// reads that went into the last report
+	uint16_t	i2c_timeouts;		// stuck bus, recovered (see i2c_recover)
+}diagnostics_t;
+
+static diagnostics_t diagnostics;
+
+static uint8_t diagnostics_watchdog_resets __attribute__((section(".noinit")));
+static uint8_t diagnostics_magic __attribute__((section(".noinit")));
+
+static uint16_t diagnostics_second_ticks;	// when the current second started
+
+#define diagnostics_count(counter) \
+	do { if (!++diagnostics.counter) diagnostics.counter--; } while (0)
+
+// first thing on main (before the watchdog is enabled again)
+static void diagnostics_init() {
+	diagnostics.reset_cause = MCUSR;
+	MCUSR = 0;
+
+	if ((diagnostics.reset_cause & (1 << PORF)) || diagnostics_magic != DIAGNOSTICS_MAGIC) {
+		diagnostics_watchdog_resets = 0;
+		diagnostics_magic = DIAGNOSTICS_MAGIC;
+	}
+
+	if ((diagnostics.reset_cause & (1 << WDRF)) && diagnostics_watchdog_resets < 0xFF) diagnostics_watchdog_resets++;
+	diagnostics.watchdog_resets = diagnostics_watchdog_resets;
+}
+
+// the host (re)enumerated the device
+static void diagnostics_enumerated(uint16_t now) {
+	diagnostics.enumeration_seconds = 0;
+	diagnostics_second_ticks = now;
+}
+
+// call it every main loop iteration
+static void diagnostics_update(uint16_t now) {
+	if ((uint16_t)(now - diagnostics_second_ticks) < TICKS_FROM_MS(1000)) return;
+
+	diagnostics_second_ticks += TICKS_FROM_MS(1000);
+	diagnostics_count(enumeration_seconds);
+}
+
+#endif
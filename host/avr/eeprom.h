@@ -0,0 +1,19 @@
+/*
+	Host build: the EEMEM variables are regular variables, always ready.
+*/
+
+#ifndef MOCK_AVR_EEPROM_H
+#define MOCK_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+#define eeprom_is_ready()					1
+#define eeprom_read_byte(p)					(*(const uint8_t *)(p))
+#define eeprom_update_byte(p, value)		(*(uint8_t *)(p) = (value))
+#define eeprom_read_block(dst, src, n)		memcpy((dst), (src), (n))
+#define eeprom_update_block(src, dst, n)	memcpy((dst), (src), (n))
+
+#endif
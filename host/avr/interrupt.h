@@ -0,0 +1,25 @@
+/*
+	Host build: interrupts. The vectors are plain functions called by the mock
+	(host/mock_avr.c) when their flag is set, the interrupt enabled and the I
+	bit of SREG set. No nesting: an interrupt doesn't run inside another one.
+*/
+
+#ifndef MOCK_AVR_INTERRUPT_H
+#define MOCK_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+#define ISR(vector, ...)	void vector(void); void vector(void)
+
+#define TIMER0_COMPA_vect	mock_vector_timer0_compa
+#define TIMER1_OVF_vect		mock_vector_timer1_ovf
+#define USI_OVF_vect		mock_vector_usi_ovf
+
+#define sei()	(SREG |= (1 << SREG_I))
+#define cli()	(SREG &= ~(1 << SREG_I))
+
+#endif
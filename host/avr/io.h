@@ -0,0 +1,122 @@
+/*
+	Host build (see host/mock_avr.c): the ATtiny85 registers the firmware uses.
+
+	Every register is a byte on mock_io_registers, reached through mock_io()
+	so the mock can see the accesses: time goes by a bit on each one (like
+	it would in a busy loop), the timers and the USI catch up and the
+	interrupts run. Only the registers and bits used by the firmware are here.
+*/
+
+#ifndef MOCK_AVR_IO_H
+#define MOCK_AVR_IO_H
+
+#include <stdint.h>
+
+enum {
+	MOCK_PORTB, MOCK_DDRB, MOCK_PINB,
+	MOCK_USIDR, MOCK_USISR, MOCK_USICR, MOCK_USIBR,
+	MOCK_TCCR0A, MOCK_TCCR0B, MOCK_TCNT0, MOCK_OCR0A, MOCK_OCR0B,
+	MOCK_TIMSK, MOCK_TIFR,
+	MOCK_TCCR1, MOCK_TCNT1, MOCK_OCR1A, MOCK_OCR1B, MOCK_OCR1C, MOCK_GTCCR,
+	MOCK_MCUSR, MOCK_WDTCR, MOCK_SREG,
+	MOCK_PCMSK, MOCK_GIMSK, MOCK_GIFR, MOCK_OSCCAL, MOCK_GPIOR0,
+	MOCK_IO_REGISTERS
+};
+
+volatile uint8_t *mock_io(uint8_t reg);
+
+#define PORTB	(*mock_io(MOCK_PORTB))
+#define DDRB	(*mock_io(MOCK_DDRB))
+#define PINB	(*mock_io(MOCK_PINB))
+#define USIDR	(*mock_io(MOCK_USIDR))
+#define USISR	(*mock_io(MOCK_USISR))
+#define USICR	(*mock_io(MOCK_USICR))
+#define USIBR	(*mock_io(MOCK_USIBR))
+#define TCCR0A	(*mock_io(MOCK_TCCR0A))
+#define TCCR0B	(*mock_io(MOCK_TCCR0B))
+#define TCNT0	(*mock_io(MOCK_TCNT0))
+#define OCR0A	(*mock_io(MOCK_OCR0A))
+#define OCR0B	(*mock_io(MOCK_OCR0B))
+#define TIMSK	(*mock_io(MOCK_TIMSK))
+#define TIFR	(*mock_io(MOCK_TIFR))
+#define TCCR1	(*mock_io(MOCK_TCCR1))
+#define TCNT1	(*mock_io(MOCK_TCNT1))
+#define OCR1A	(*mock_io(MOCK_OCR1A))
+#define OCR1B	(*mock_io(MOCK_OCR1B))
+#define OCR1C	(*mock_io(MOCK_OCR1C))
+#define GTCCR	(*mock_io(MOCK_GTCCR))
+#define MCUSR	(*mock_io(MOCK_MCUSR))
+#define WDTCR	(*mock_io(MOCK_WDTCR))
+#define SREG	(*mock_io(MOCK_SREG))
+#define PCMSK	(*mock_io(MOCK_PCMSK))
+#define GIMSK	(*mock_io(MOCK_GIMSK))
+#define GIFR	(*mock_io(MOCK_GIFR))
+#define OSCCAL	(*mock_io(MOCK_OSCCAL))
+#define GPIOR0	(*mock_io(MOCK_GPIOR0))
+
+#define _BV(bit)	(1 << (bit))
+
+// PORTB / DDRB / PINB
+#define PB0		0
+#define PB1		1
+#define PB2		2
+#define PB3		3
+#define PB4		4
+#define PB5		5
+
+// USISR
+#define USISIF	7
+#define USIOIF	6
+#define USIPF	5
+#define USIDC	4
+#define USICNT0	0
+
+// USICR
+#define USISIE	7
+#define USIOIE	6
+#define USIWM1	5
+#define USIWM0	4
+#define USICS1	3
+#define USICS0	2
+#define USICLK	1
+#define USITC	0
+
+// TCCR0A / TCCR0B
+#define WGM01	1
+#define WGM00	0
+#define WGM02	3
+#define CS02	2
+#define CS01	1
+#define CS00	0
+
+// TIMSK / TIFR
+#define OCIE1A	6
+#define OCIE1B	5
+#define OCIE0A	4
+#define OCIE0B	3
+#define TOIE1	2
+#define TOIE0	1
+#define OCF1A	6
+#define OCF1B	5
+#define OCF0A	4
+#define OCF0B	3
+#define TOV1	2
+#define TOV0	1
+
+// TCCR1
+#define CTC1	7
+#define PWM1A	6
+#define CS13	3
+#define CS12	2
+#define CS11	1
+#define CS10	0
+
+// MCUSR
+#define WDRF	3
+#define BORF	2
+#define EXTRF	1
+#define PORF	0
+
+#define SREG_I	7
+
+#endif
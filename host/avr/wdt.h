@@ -0,0 +1,14 @@
+/*
+	Host build: no watchdog.
+*/
+
+#ifndef MOCK_AVR_WDT_H
+#define MOCK_AVR_WDT_H
+
+#define WDTO_1S				6
+
+#define wdt_reset()
+#define wdt_enable(timeout)
+#define wdt_disable()
+
+#endif
@@ -0,0 +1,400 @@
+/*
+	Host build benchmarks (make host): the driver, the I2C layer and the
+	report mapping compiled natively against the simulated registers of
+	host/mock_avr.c.
+
+	Two kinds of numbers:
+
+	* host ns: wall clock on this machine, for the pure computation (the
+	  button mapping), only useful to compare two versions of the same code.
+
+	* AVR cycles / us: simulated time at F_CPU (register accesses, delays and
+	  the bus, not the instructions in between, see mock_avr.h), for
+	  everything that waits on the bus.
+
+	The first ones run with nothing attached to the bus, so every address is
+	NACKed (that's the cost of the presence checks while there's no
+	controller). The rest with a simulated controller (host/mock_controller.c):
+	the connection and a read for each kind of controller and its quirks,
+	a scripted hot-plug and a few bus failures.
+
+	With a file name (bench trace.vcd) everything on the bus goes to a VCD
+	trace too, with the function being run as the phase (see mock_avr.h and
+	vcd_analyze.c).
+
+	What the driver makes of every case is checked too (the buttons read,
+	the controller type, the recovery...): a wrong one is marked as WRONG and
+	the exit status is 1.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "mock_avr.h"
+#include "mock_controller.h"
+
+typedef unsigned char uchar; // usbdrv.h
+
+// the report is always drained right away
+#define usbInterruptIsReady()	1
+
+#include "nesminicontrollerdrv.c"
+#include "sampler.c"
+
+static double bench_host_ns() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static uint16_t bench_failures;
+
+// "ok" or "WRONG", counting the wrong ones
+static const char *bench_check(uint8_t ok) {
+	if (!ok) bench_failures++;
+	return ok ? "ok" : "WRONG";
+}
+
+static void bench_print_cycles(const char *name, uint64_t cycles) {
+	printf("%-40s %10llu cycles %10.1f us\n", name, (unsigned long long)cycles, MOCK_CYCLES_TO_US(cycles));
+}
+
+// fresh adapter: registers at their reset values, then what main does before the loop
+static void bench_reset(uint8_t speed) {
+	mock_reset();
+	diagnostics_init();
+	snes_init();
+	i2c_set_speed(speed);
+	sei();
+}
+
+static void bench_map_buttons() {
+	snes_report_t report;
+	uint32_t sum = 0;
+
+	bench_reset(I2C_SPEED_STANDARD); // default layout
+
+	double start = bench_host_ns();
+
+	for (uint8_t round = 0; round < 100; round++) {
+		for (uint32_t buttons = 0; buttons < 0x10000; buttons++) {
+			snes_map_buttons(buttons, &report);
+			sum += report.commonButtonMask + report.snesButtonMask;
+		}
+	}
+
+	double ns = (bench_host_ns() - start) / (100.0 * 0x10000);
+	printf("%-40s %10.2f host ns (checksum %08X)\n", "snes_map_buttons", ns, sum);
+}
+
+static void bench_blocking(const char *name, uint8_t speed) {
+	char line[64];
+	uint64_t start;
+
+	bench_reset(speed);
+
+	start = mock_cycles;
+	mock_trace_phase("i2c_start");
+	i2c_start();
+	snprintf(line, sizeof(line), "%s: start", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	start = mock_cycles;
+	mock_trace_phase("i2c_write_byte");
+	i2c_write_byte(NES_I2C_ADDRESS_WRITE);
+	snprintf(line, sizeof(line), "%s: address + ack bit", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	start = mock_cycles;
+	mock_trace_phase("i2c_stop");
+	i2c_stop();
+	snprintf(line, sizeof(line), "%s: stop", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	start = mock_cycles;
+	mock_trace_phase("snes_detect");
+	snes_detect();
+	snprintf(line, sizeof(line), "%s: snes_detect", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	snes_controller_state state = { 0 };
+	start = mock_cycles;
+	mock_trace_phase("snes_get_state");
+	snes_get_state(&state);
+	mock_trace_phase(NULL);
+	snprintf(line, sizeof(line), "%s: snes_get_state (nothing attached)", name);
+	bench_print_cycles(line, mock_cycles - start);
+}
+
+static void bench_async(const char *name, uint8_t speed) {
+	static const uint8_t pointer[] = { 0x00 };
+	uint8_t buffer[SNES_READ_LENGTH];
+	char line[64];
+
+	bench_reset(speed);
+
+	uint64_t start = mock_cycles;
+	mock_trace_phase("i2c_async_transfer");
+	i2c_async_transfer(NES_I2C_ADDRESS_WRITE, pointer, sizeof(pointer), buffer, sizeof(buffer));
+	uint64_t queued = mock_cycles;
+	while (i2c_async_busy()) mock_advance(MOCK_ACCESS_CYCLES); // no register access, time has to go by anyway
+	mock_trace_phase(NULL);
+
+	snprintf(line, sizeof(line), "%s async: queue a transfer", name);
+	bench_print_cycles(line, queued - start);
+	snprintf(line, sizeof(line), "%s async: address NACKed (%s)", name, bench_check(i2c_async_status() == I2C_ASYNC_NACK));
+	bench_print_cycles(line, mock_cycles - start);
+}
+
+// the connection manager on an empty bus for a while: how many presence
+// checks, and how much of the time goes into them
+static void bench_connection_manager() {
+	snes_controller_state state = { 0 };
+	uint64_t busy = 0;
+	uint16_t checks = 0;
+
+	bench_reset(I2C_SPEED_STANDARD);
+	snes_lost(&state);
+
+	while (mock_cycles < 2 * (uint64_t)F_CPU) {
+		uint16_t before = state.detect_ticks;
+		uint64_t start = mock_cycles;
+
+		mock_trace_phase("snes_update_connection");
+		snes_update_connection(&state, ticks_now());
+
+		if (state.detect_ticks != before) {
+			busy += mock_cycles - start;
+			checks++;
+		}
+
+		mock_trace_phase("usbPoll");
+		mock_advance(F_CPU / 10000); // the rest of the main loop (usbPoll...), 100us
+	}
+	mock_trace_phase(NULL);
+
+	printf("%-40s %10u checks, %.3f%% of the time, last interval %.0f ms\n", "empty bus, 2 seconds", checks,
+		busy * 100.0 / mock_cycles, state.detect_interval * (double)TICKS_PRESCALER * 1000 / F_CPU);
+}
+
+static mock_controller_t bench_controller;
+
+static const char *bench_type_names[] = { "SNES Mini", "NES Mini" }; // SNES_TYPE_*
+
+// one background read (snes_poll_state, the way main does it), returns the cycles
+// from the first step to the last one
+static uint64_t bench_poll(snes_controller_state *state) {
+	uint64_t start = mock_cycles;
+
+	(*state).step = SNES_STEP_IDLE;
+	do {
+		mock_trace_phase("snes_poll_state");
+		snes_poll_state(state);
+		mock_trace_phase("usbPoll");
+		mock_advance(F_CPU / 100000); // the rest of the main loop, 10us
+	} while ((*state).step != SNES_STEP_DONE && (*state).connected);
+	mock_trace_phase(NULL);
+
+	return mock_cycles - start;
+}
+
+// what the driver makes of a controller: the connection, the modes it picks
+// and the cost of a read with them
+static void bench_controller_read(const char *name, uint8_t type, uint32_t read_delay_us, uint8_t repeated_start, uint32_t stretch_us) {
+	snes_controller_state state = { 0 };
+	uint16_t pressed = NES_BUTTON_UP | NES_BUTTON_A | (type == MOCK_CONTROLLER_SNES_MINI ? NES_BUTTON_X : 0);
+	char line[64];
+	uint64_t start;
+
+	bench_reset(I2C_SPEED_STANDARD);
+
+	mock_controller_init(&bench_controller, type);
+	bench_controller.buttons = pressed;
+	bench_controller.read_delay_us = read_delay_us;
+	bench_controller.repeated_start = repeated_start;
+	bench_controller.stretch_us = stretch_us;
+	mock_i2c_attach(&bench_controller.device);
+
+	start = mock_cycles;
+	mock_trace_phase("snes_connect");
+	snes_connect(&state);
+	snprintf(line, sizeof(line), "%s: snes_connect", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	printf("%-40s %s, %s, %s, %s\n", "", state.connected ? bench_type_names[state.type] : "not connected",
+		i2c_speed ? "400kHz" : "100kHz", state.repeated_start ? "repeated start" : "stop + start",
+		state.direct_read ? "direct read" : "full read");
+
+	start = mock_cycles;
+	mock_trace_phase("snes_get_state");
+	snes_get_state(&state);
+	snprintf(line, sizeof(line), "%s: snes_get_state", name);
+	bench_print_cycles(line, mock_cycles - start);
+
+	uint64_t cycles = bench_poll(&state);
+	snprintf(line, sizeof(line), "%s: background read", name);
+	bench_print_cycles(line, cycles);
+
+	printf("%-40s buttons %04X (%s), %u early bytes\n", "", state.buttons,
+		bench_check(state.connected && state.buttons == pressed), bench_controller.early_reads);
+}
+
+// a SNES Mini keeps its init through a watchdog reset of the adapter (it's not
+// powered off), and then it answers like a NES Mini: what the driver takes it for
+static void bench_watchdog_reset() {
+	snes_controller_state state = { 0 };
+
+	bench_reset(I2C_SPEED_STANDARD);
+
+	mock_controller_init(&bench_controller, MOCK_CONTROLLER_SNES_MINI);
+	mock_i2c_attach(&bench_controller.device);
+
+	mock_trace_phase("snes_connect");
+	snes_connect(&state);
+
+	// what main does after the reset (the controller and snes_mini_seen stay)
+	mock_reset();
+	MCUSR = (1 << WDRF);
+	diagnostics_init();
+	snes_init();
+
+	snes_connect(&state);
+	mock_trace_phase(NULL);
+
+	printf("%-40s %s (%s)\n", "SNES Mini after a watchdog reset", state.connected ? bench_type_names[state.type] : "not connected",
+		bench_check(state.connected && state.type == SNES_TYPE_SNES_MINI));
+}
+
+// the main loop (without USB) for a while, with the controller following the
+// script: when the buttons are seen, when it's found missing and found again
+static void bench_hot_plug() {
+	static const mock_controller_event_t script[] = {
+		{ 50000, 1, NES_BUTTON_A },
+		{ 100000, 1, NES_BUTTON_A | NES_BUTTON_X },
+		{ 150000, 1, 0 },
+		{ 200000, 0, 0 },
+		{ 700000, 1, NES_BUTTON_B },
+	};
+	snes_controller_state state = { 0 };
+	uint16_t seen = 0;
+	uint8_t connected = 0;
+
+	bench_reset(I2C_SPEED_STANDARD);
+
+	mock_controller_init(&bench_controller, MOCK_CONTROLLER_SNES_MINI);
+	mock_controller_script(&bench_controller, script, sizeof(script) / sizeof(script[0]));
+	mock_i2c_attach(&bench_controller.device);
+
+	mock_trace_phase("snes_connect");
+	snes_connect(&state);
+
+	while (mock_cycles < (uint64_t)F_CPU) {
+		uint16_t now = ticks_now();
+
+		mock_trace_phase("snes_update_connection");
+		if (!state.connected) snes_update_connection(&state, now);
+
+		mock_trace_phase("snes_poll_state");
+		if (state.connected) {
+			snes_poll_state(&state);
+			if (state.step == SNES_STEP_DONE && state.buttons != seen) {
+				seen = state.buttons;
+				printf("%-40s %10.1f ms  buttons %04X\n", "hot-plug: new buttons", MOCK_CYCLES_TO_US(mock_cycles) / 1000, seen);
+			}
+		}
+
+		if (state.connected != connected) {
+			connected = state.connected;
+			printf("%-40s %10.1f ms  %s\n", "hot-plug: controller", MOCK_CYCLES_TO_US(mock_cycles) / 1000, connected ? "connected" : "lost");
+		}
+
+		mock_trace_phase("usbPoll");
+		mock_advance(F_CPU / 10000); // usbPoll and the rest, 100us
+	}
+	mock_trace_phase(NULL);
+
+	printf("%-40s %10u transactions, %u NACKs\n", "hot-plug: totals", bench_controller.transactions, diagnostics.i2c_nacks);
+	printf("%-40s %s, buttons %04X (%s)\n", "hot-plug: at the end", connected ? "connected" : "not connected", seen,
+		bench_check(connected && seen == NES_BUTTON_B));
+}
+
+// something going wrong while the controller is being read, for 100ms: how long
+// until the buttons are read right again, and what the driver counted
+static void bench_failure(const char *name, uint8_t stuck_pulses, uint32_t stretch_us) {
+	snes_controller_state state = { 0 };
+	uint8_t recovered = 0;
+
+	bench_reset(I2C_SPEED_STANDARD);
+
+	mock_controller_init(&bench_controller, MOCK_CONTROLLER_NES_MINI);
+	bench_controller.buttons = NES_BUTTON_START;
+	mock_i2c_attach(&bench_controller.device);
+
+	mock_trace_phase("snes_connect");
+	snes_connect(&state);
+
+	diagnostics_t before = diagnostics;
+	uint64_t start = mock_cycles;
+
+	bench_controller.stretch_us = stretch_us;
+	if (stuck_pulses) mock_controller_stuck(&bench_controller, stuck_pulses);
+
+	while (!recovered && mock_cycles - start < F_CPU) {
+		if (mock_cycles - start >= F_CPU / 10) bench_controller.stretch_us = 0;
+
+		mock_trace_phase("snes_update_connection");
+		if (!state.connected) snes_update_connection(&state, ticks_now());
+
+		mock_trace_phase("snes_poll_state");
+		if (state.connected) {
+			snes_poll_state(&state);
+			recovered = state.step == SNES_STEP_DONE && state.buttons == NES_BUTTON_START;
+		}
+
+		mock_trace_phase("usbPoll");
+		mock_advance(F_CPU / 10000); // usbPoll and the rest, 100us
+	}
+	mock_trace_phase(NULL);
+
+	printf("%-40s %10.1f ms  %s (%s), %u NACKs, %u timeouts\n", name, MOCK_CYCLES_TO_US(mock_cycles - start) / 1000,
+		recovered ? "read again" : "not read again", bench_check(recovered), diagnostics.i2c_nacks - before.i2c_nacks,
+		diagnostics.i2c_timeouts - before.i2c_timeouts);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && !mock_trace_open(argv[1])) {
+		fprintf(stderr, "can't write %s\n", argv[1]);
+		return 1;
+	}
+
+	printf("F_CPU %lu, %d cycles per register access\n\n", (unsigned long)F_CPU, MOCK_ACCESS_CYCLES);
+
+	bench_map_buttons();
+	bench_blocking("100kHz", I2C_SPEED_STANDARD);
+	bench_blocking("400kHz", I2C_SPEED_FAST);
+	bench_async("100kHz", I2C_SPEED_STANDARD);
+	bench_async("400kHz", I2C_SPEED_FAST);
+	bench_connection_manager();
+
+	bench_controller_read("NES Mini", MOCK_CONTROLLER_NES_MINI, 0, 1, 0);
+	bench_controller_read("SNES Mini", MOCK_CONTROLLER_SNES_MINI, 0, 1, 0);
+	bench_controller_read("SNES Mini, 1ms read delay", MOCK_CONTROLLER_SNES_MINI, 1000, 1, 0);
+	bench_controller_read("SNES Mini, no repeated start", MOCK_CONTROLLER_SNES_MINI, 0, 0, 0);
+	bench_controller_read("SNES Mini, 20us clock stretching", MOCK_CONTROLLER_SNES_MINI, 0, 1, 20);
+	bench_watchdog_reset();
+	bench_hot_plug();
+	bench_failure("SDA stuck for 5 clocks", 5, 0);
+	bench_failure("2ms clock stretching", 0, 2000);
+
+	mock_trace_close();
+
+	printf("\n%u wrong\n", bench_failures);
+	return bench_failures ? 1 : 0;
+}
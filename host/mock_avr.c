@@ -0,0 +1,432 @@
+/*
+	Host build: simulated ATtiny85 peripherals (see mock_avr.h).
+
+	The firmware reads and writes the registers through mock_io(), which only
+	hands out a pointer: the writes are found on the next access (or delay),
+	comparing the registers against what the mock left on them. That's why
+	some registers are kept with a marker that a write always changes:
+
+	* USISR: USISIF (never set here) is set by every write the firmware does
+	  (the flags are cleared by writing 1), so bit 7 = "written".
+	* TIFR: bit 0 is reserved, the mock keeps it set and a write (1 to clear
+	  a flag, never bit 0) clears it.
+	* USICR: USITC reads 0, so a 1 there is a strobe.
+	* TCNT0 / TCNT1: different from the last value published = written.
+*/
+
+#include <avr/io.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_avr.h"
+
+uint64_t mock_cycles;
+
+static volatile uint8_t mock_io_registers[MOCK_IO_REGISTERS];
+#define mock_register(name)	mock_io_registers[MOCK_##name]
+
+static uint8_t mock_usisr_flags;
+static uint8_t mock_usi_counter;
+static uint8_t mock_usi_latch;		// USI output latch (MSB of USIDR, transparent while SCL is low)
+static uint8_t mock_tifr_flags;
+static uint8_t mock_tcnt0;
+static uint8_t mock_tcnt1;
+static uint8_t mock_published_tcnt0;	// what the firmware saw last (different now = written)
+static uint8_t mock_published_tcnt1;
+static uint16_t mock_timer1_prescaler;	// cycles since the last Timer1 count
+
+static uint8_t mock_line_scl = 1;
+static uint8_t mock_line_sda = 1;
+
+static uint8_t mock_in_interrupt;
+static mock_i2c_device_t *mock_device;
+
+// VCD trace: one identifier per signal, only the changes are written
+#define MOCK_TRACE_PHASES	64
+
+static FILE *mock_trace_file;
+static uint64_t mock_trace_base;	// trace time at the last mock_reset
+static uint64_t mock_trace_time;	// last timestamp written
+static uint8_t mock_trace_scl, mock_trace_sda, mock_trace_counter, mock_trace_current;
+static const char *mock_trace_names[MOCK_TRACE_PHASES] = { "none" };
+static uint8_t mock_trace_phases = 1;
+
+// defined by the firmware modules included by the host program (or not)
+void mock_vector_timer0_compa(void) __attribute__((weak));
+void mock_vector_timer1_ovf(void) __attribute__((weak));
+void mock_vector_usi_ovf(void) __attribute__((weak));
+
+#define MOCK_USI_TWO_WIRE()	((mock_register(USICR) & (1 << USIWM1)) != 0)
+
+static void mock_trace_timestamp() {
+	uint64_t now = mock_trace_base + mock_cycles;
+
+	if (now == mock_trace_time) return;
+
+	fprintf(mock_trace_file, "#%llu\n", (unsigned long long)now);
+	mock_trace_time = now;
+}
+
+static void mock_trace_binary(uint8_t value, char id) {
+	fputc('b', mock_trace_file);
+	for (int8_t bit = 7; bit >= 0; bit--) {
+		if ((value >> bit) || !bit) fputc((value >> bit) & 1 ? '1' : '0', mock_trace_file);
+	}
+	fprintf(mock_trace_file, " %c\n", id);
+}
+
+// writes whatever changed since the last time
+static void mock_trace_sample() {
+	if (!mock_trace_file) return;
+
+	if (mock_line_scl != mock_trace_scl) {
+		mock_trace_timestamp();
+		fprintf(mock_trace_file, "%u!\n", mock_line_scl);
+		mock_trace_scl = mock_line_scl;
+	}
+
+	if (mock_line_sda != mock_trace_sda) {
+		mock_trace_timestamp();
+		fprintf(mock_trace_file, "%u\"\n", mock_line_sda);
+		mock_trace_sda = mock_line_sda;
+	}
+
+	if (mock_usi_counter != mock_trace_counter) {
+		mock_trace_timestamp();
+		mock_trace_binary(mock_usi_counter, '#');
+		mock_trace_counter = mock_usi_counter;
+	}
+}
+
+// bus lines from both sides (wired-AND with pull-ups). The device may react to
+// the change and change its side too, so it goes on until nothing moves
+static void mock_update_bus() {
+	for (uint8_t round = 0; round < 8; round++) {
+		uint8_t ddr = mock_register(DDRB), port = mock_register(PORTB);
+
+		// (outside of the two-wire mode nothing clocks it, so it follows USIDR)
+		if (!mock_line_scl || !MOCK_USI_TWO_WIRE()) mock_usi_latch = mock_register(USIDR) >> 7;
+
+		uint8_t scl_low = ((ddr & (1 << MOCK_PIN_SCL)) && !(port & (1 << MOCK_PIN_SCL))) ||
+			(mock_device && mock_device->scl_low);
+		uint8_t sda_low = ((ddr & (1 << MOCK_PIN_SDA)) && (!(port & (1 << MOCK_PIN_SDA)) || (MOCK_USI_TWO_WIRE() && !mock_usi_latch))) ||
+			(mock_device && mock_device->sda_low);
+
+		if (scl_low == !mock_line_scl && sda_low == !mock_line_sda) break;
+
+		uint8_t rising = mock_line_scl == 0 && !scl_low;
+
+		mock_line_scl = !scl_low;
+		mock_line_sda = !sda_low;
+		mock_trace_sample(); // (before the device reacts, it comes after in the trace too)
+
+		// USIDR samples SDA on the rising edge (USICS1:0 = 10, "external, positive edge")
+		if (rising && MOCK_USI_TWO_WIRE()) mock_register(USIDR) = (mock_register(USIDR) << 1) | mock_line_sda;
+
+		if (mock_device && mock_device->update) mock_device->update(mock_device, mock_line_scl, mock_line_sda);
+	}
+
+	mock_trace_sample();
+
+	uint8_t pins = mock_register(PORTB) & ~((1 << MOCK_PIN_SCL) | (1 << MOCK_PIN_SDA));
+	mock_register(PINB) = pins | (mock_line_scl << MOCK_PIN_SCL) | (mock_line_sda << MOCK_PIN_SDA);
+}
+
+// USITC: SCL port bit toggled, one count (both edges are counted)
+static void mock_usi_strobe() {
+	mock_register(PORTB) ^= (1 << MOCK_PIN_SCL);
+
+	mock_usi_counter = (mock_usi_counter + 1) & 0x0F;
+	if (!mock_usi_counter) mock_usisr_flags |= (1 << USIOIF);
+
+	mock_update_bus();
+}
+
+// what the firmware wrote since the last access
+static void mock_collect_writes() {
+	uint8_t usisr = mock_register(USISR);
+	if (usisr & (1 << USISIF)) {
+		mock_usisr_flags &= ~(usisr & ((1 << USISIF) | (1 << USIOIF) | (1 << USIPF)));
+		mock_usi_counter = usisr & 0x0F;
+	}
+
+	uint8_t tifr = mock_register(TIFR);
+	if (!(tifr & 0x01)) mock_tifr_flags &= ~tifr;
+
+	if (mock_register(TCNT0) != mock_published_tcnt0) mock_tcnt0 = mock_register(TCNT0);
+	if (mock_register(TCNT1) != mock_published_tcnt1) {
+		mock_tcnt1 = mock_register(TCNT1);
+		mock_timer1_prescaler = 0;
+	}
+
+	while (mock_register(USICR) & (1 << USITC)) {
+		mock_register(USICR) &= ~(1 << USITC);
+		mock_usi_strobe();
+	}
+
+	mock_update_bus();
+}
+
+// what the firmware reads
+static void mock_publish() {
+	mock_register(USISR) = mock_usisr_flags | mock_usi_counter;
+	mock_register(TIFR) = mock_tifr_flags | 0x01;
+	mock_register(TCNT0) = mock_published_tcnt0 = mock_tcnt0;
+	mock_register(TCNT1) = mock_published_tcnt1 = mock_tcnt1;
+}
+
+static void mock_run_vector(void (*vector)(void)) {
+	mock_publish();
+
+	mock_in_interrupt = 1;
+	mock_register(SREG) &= ~(1 << SREG_I);
+	mock_cycles += 4; // call
+
+	vector();
+
+	mock_collect_writes();
+	mock_cycles += 4; // reti
+	mock_register(SREG) |= (1 << SREG_I);
+	mock_in_interrupt = 0;
+
+	mock_publish();
+}
+
+static void mock_interrupts() {
+	if (mock_in_interrupt) return;
+
+	// a vector that doesn't clear its reason would run forever, so some limit
+	for (uint8_t x = 0; x < 16 && (mock_register(SREG) & (1 << SREG_I)); x++) {
+		uint8_t timsk = mock_register(TIMSK);
+
+		if ((mock_tifr_flags & (1 << OCF0A)) && (timsk & (1 << OCIE0A)) && mock_vector_timer0_compa) {
+			mock_tifr_flags &= ~(1 << OCF0A);
+			mock_run_vector(mock_vector_timer0_compa);
+		} else if ((mock_tifr_flags & (1 << TOV1)) && (timsk & (1 << TOIE1)) && mock_vector_timer1_ovf) {
+			mock_tifr_flags &= ~(1 << TOV1);
+			mock_run_vector(mock_vector_timer1_ovf);
+		} else if ((mock_usisr_flags & (1 << USIOIF)) && (mock_register(USICR) & (1 << USIOIE)) && mock_vector_usi_ovf) {
+			mock_run_vector(mock_vector_usi_ovf); // USIOIF stays, the vector masks it
+		} else {
+			break;
+		}
+	}
+}
+
+void mock_advance(uint32_t cycles) {
+	while (cycles) {
+		uint32_t step = cycles;
+
+		// Timer0, CTC on OCR0A without prescaler (the only mode used)
+		uint8_t timer0 = (mock_register(TCCR0B) & 0x07) == (1 << CS00);
+		if (timer0) {
+			uint32_t to_match = (mock_tcnt0 <= mock_register(OCR0A)) ?
+				(uint32_t)(mock_register(OCR0A) - mock_tcnt0) + 1 : (uint32_t)(256 - mock_tcnt0) + mock_register(OCR0A) + 1;
+			if (to_match < step) step = to_match;
+		}
+
+		// Timer1, CK / 2^(CS13:0 - 1)
+		uint8_t timer1 = mock_register(TCCR1) & 0x0F;
+		uint16_t prescaler = timer1 ? (1 << (timer1 - 1)) : 0;
+		if (timer1 && prescaler - mock_timer1_prescaler < step) step = prescaler - mock_timer1_prescaler;
+
+		// the device may want to do something in between
+		if (mock_device && mock_device->wake_cycles > mock_cycles && mock_device->wake_cycles - mock_cycles < step) {
+			step = mock_device->wake_cycles - mock_cycles;
+		}
+
+		mock_cycles += step;
+		cycles -= step;
+
+		if (timer0) {
+			if ((uint8_t)(mock_tcnt0 + step - 1) == mock_register(OCR0A)) {
+				mock_tcnt0 = 0;
+				mock_tifr_flags |= (1 << OCF0A);
+			} else {
+				mock_tcnt0 += step;
+			}
+		}
+
+		if (timer1) {
+			mock_timer1_prescaler += step;
+			if (mock_timer1_prescaler >= prescaler) {
+				mock_timer1_prescaler = 0;
+				if (!++mock_tcnt1) mock_tifr_flags |= (1 << TOV1);
+			}
+		}
+
+		if (mock_device && mock_device->wake_cycles && mock_device->wake_cycles <= mock_cycles) {
+			mock_device->wake_cycles = 0;
+			if (mock_device->update) mock_device->update(mock_device, mock_line_scl, mock_line_sda);
+			mock_update_bus();
+		}
+
+		mock_interrupts();
+	}
+}
+
+volatile uint8_t *mock_io(uint8_t reg) {
+	mock_collect_writes();
+	mock_advance(MOCK_ACCESS_CYCLES);
+	mock_collect_writes();
+	mock_publish();
+
+	return &mock_io_registers[reg];
+}
+
+void mock_delay_us(double us) {
+	mock_collect_writes();
+	double cycles = us * (F_CPU / 1000000.0);
+	uint32_t whole = (uint32_t)cycles;
+
+	mock_advance(whole < cycles ? whole + 1 : whole);
+	mock_collect_writes();
+	mock_publish();
+}
+
+uint8_t mock_io_read(uint8_t reg) {
+	mock_publish();
+	return mock_io_registers[reg];
+}
+
+void mock_io_write(uint8_t reg, uint8_t value) {
+	switch (reg) {
+		case MOCK_USISR:
+			mock_usisr_flags &= ~(value & ((1 << USISIF) | (1 << USIOIF) | (1 << USIPF)));
+			mock_usi_counter = value & 0x0F;
+			break;
+
+		case MOCK_TIFR: mock_tifr_flags &= ~value; break;
+		case MOCK_TCNT0: mock_tcnt0 = value; break;
+
+		case MOCK_TCNT1:
+			mock_tcnt1 = value;
+			mock_timer1_prescaler = 0;
+			break;
+
+		case MOCK_USICR:
+			mock_register(USICR) = value & ~(1 << USITC);
+			if (value & (1 << USITC)) mock_usi_strobe();
+			break;
+
+		default: mock_io_registers[reg] = value; break;
+	}
+
+	mock_update_bus();
+	mock_publish();
+}
+
+// (the ATtiny85 vector numbers)
+uint8_t mock_interrupt_pending(void) {
+	uint8_t timsk = mock_register(TIMSK);
+
+	if ((mock_tifr_flags & (1 << TOV1)) && (timsk & (1 << TOIE1))) return MOCK_VECTOR_TIMER1_OVF;
+	if ((mock_tifr_flags & (1 << OCF0A)) && (timsk & (1 << OCIE0A))) return MOCK_VECTOR_TIMER0_COMPA;
+	if ((mock_usisr_flags & (1 << USIOIF)) && (mock_register(USICR) & (1 << USIOIE))) return MOCK_VECTOR_USI_OVF;
+
+	return 0;
+}
+
+void mock_interrupt_taken(uint8_t vector) {
+	if (vector == MOCK_VECTOR_TIMER1_OVF) mock_tifr_flags &= ~(1 << TOV1);
+	else if (vector == MOCK_VECTOR_TIMER0_COMPA) mock_tifr_flags &= ~(1 << OCF0A);
+	// (USIOIF stays, the vector clears it)
+}
+
+void mock_reset(void) {
+	mock_trace_base += mock_cycles;
+
+	for (uint8_t x = 0; x < MOCK_IO_REGISTERS; x++) mock_io_registers[x] = 0;
+
+	mock_register(MCUSR) = (1 << PORF);
+
+	mock_cycles = 0;
+	mock_usisr_flags = mock_usi_counter = 0;
+	mock_tifr_flags = 0;
+	mock_tcnt0 = mock_tcnt1 = 0;
+	mock_published_tcnt0 = mock_published_tcnt1 = 0;
+	mock_timer1_prescaler = 0;
+	mock_in_interrupt = 0;
+	mock_usi_latch = 0;
+	mock_line_scl = mock_line_sda = 1;
+
+	mock_update_bus();
+	mock_publish();
+}
+
+void mock_i2c_attach(mock_i2c_device_t *device) {
+	mock_device = device;
+	mock_bus_changed();
+}
+
+void mock_bus_changed(void) {
+	mock_update_bus();
+	mock_publish();
+}
+
+uint8_t mock_bus_scl(void) {
+	return mock_line_scl;
+}
+
+uint8_t mock_bus_sda(void) {
+	return mock_line_sda;
+}
+
+uint8_t mock_trace_open(const char *path) {
+	if (!(mock_trace_file = fopen(path, "w"))) return 0;
+
+	fprintf(mock_trace_file,
+		"$comment time unit: CPU cycles, F_CPU %lu $end\n"
+		"$scope module attiny85 $end\n"
+		"$var wire 1 ! scl $end\n"
+		"$var wire 1 \" sda $end\n"
+		"$var wire 4 # usi_counter $end\n"
+		"$var wire 8 $ phase $end\n"
+		"$upscope $end\n"
+		"$enddefinitions $end\n",
+		(unsigned long)F_CPU);
+
+	mock_trace_time = mock_trace_base + mock_cycles;
+	fprintf(mock_trace_file, "#%llu\n$dumpvars\n%u!\n%u\"\n", (unsigned long long)mock_trace_time, mock_line_scl, mock_line_sda);
+	mock_trace_binary(mock_usi_counter, '#');
+	mock_trace_binary(mock_trace_current, '$');
+	fprintf(mock_trace_file, "$end\n");
+
+	mock_trace_scl = mock_line_scl;
+	mock_trace_sda = mock_line_sda;
+	mock_trace_counter = mock_usi_counter;
+
+	return 1;
+}
+
+void mock_trace_close(void) {
+	if (!mock_trace_file) return;
+
+	fclose(mock_trace_file);
+	mock_trace_file = NULL;
+}
+
+// the phases are numbered as they show up, the names go in a comment
+// right before their first use (GTKWave ignores it, vcd_analyze reads it)
+void mock_trace_phase(const char *name) {
+	uint8_t phase = 0;
+
+	if (!mock_trace_file) return;
+
+	if (name) {
+		for (phase = 1; phase < mock_trace_phases && strcmp(mock_trace_names[phase], name); phase++);
+
+		if (phase == mock_trace_phases) {
+			if (phase == MOCK_TRACE_PHASES) return;
+			mock_trace_names[mock_trace_phases++] = name;
+			fprintf(mock_trace_file, "$comment phase %u %s $end\n", phase, name);
+		}
+	}
+
+	if (phase == mock_trace_current) return;
+
+	mock_trace_timestamp();
+	mock_trace_binary(phase, '$');
+	mock_trace_current = phase;
+}
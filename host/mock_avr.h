@@ -0,0 +1,96 @@
+/*
+	Host build: simulated ATtiny85 peripherals for the firmware modules (the
+	driver, the I2C layer, the sampler...) compiled natively, see host/avr/io.h.
+
+	What's simulated, in CPU cycles at F_CPU:
+
+	* Time: every register access takes MOCK_ACCESS_CYCLES, _delay_us / _delay_ms
+	  take what they say. There's no instruction timing (plain C code between
+	  two accesses is free), so the numbers are a lower bound for the code and
+	  exact for the bus.
+
+	* Timer0 (CTC on OCR0A, no prescaler: the I2C clock) and Timer1 (free
+	  running with its prescaler: the ticks), with their flags and interrupts.
+
+	* The USI in two-wire mode: USITC toggles SCL and clocks the 4 bit counter,
+	  USIDR shifts SDA in on every rising SCL edge and its MSB drives SDA
+	  through the output latch (transparent while SCL is low). Start and stop
+	  detection (USISIF, USIPF) are not simulated.
+
+	* The I2C bus: open drain SDA and SCL with pull-ups, the primary side from
+	  PORTB / DDRB / the USI and the device side from the attached
+	  mock_i2c_device_t (nothing attached = every address is NACKed).
+
+	Not simulated: USB, the watchdog, the EEPROM timing, nested interrupts
+	(host/sim_bench.c has them, for the whole firmware image).
+
+	Everything on the bus can be written to a VCD trace (mock_trace_open, for
+	GTKWave or host/vcd_analyze.c): SCL, SDA, the USI counter and a phase
+	marker set by the host program. Time is in CPU cycles, and it keeps going
+	across mock_reset.
+*/
+
+#ifndef MOCK_AVR_H
+#define MOCK_AVR_H
+
+#include <stdint.h>
+
+#define MOCK_ACCESS_CYCLES		2
+
+#define MOCK_PIN_SDA			0 // PB0
+#define MOCK_PIN_SCL			2 // PB2
+
+#define MOCK_CYCLES_TO_US(cycles)	((cycles) * 1000000.0 / F_CPU)
+
+extern uint64_t mock_cycles; // since mock_reset
+
+typedef struct mock_i2c_device mock_i2c_device_t;
+
+struct mock_i2c_device {
+	// called every time the bus lines change, and at wake_cycles (if not 0)
+	void		(*update)(mock_i2c_device_t *device, uint8_t scl, uint8_t sda);
+	uint8_t		sda_low;		// 1 = the device pulls SDA low
+	uint8_t		scl_low;		// 1 = the device holds SCL low (clock stretching)
+	uint64_t	wake_cycles;	// when update has to be called again, 0 = not needed
+};
+
+// power-on state, simulated time back to 0 (the attached device stays)
+void mock_reset(void);
+
+// lets time go by (no register access involved), running the timers and interrupts
+void mock_advance(uint32_t cycles);
+
+// NULL = nothing attached. Call mock_bus_changed after changing sda_low /
+// scl_low outside of update (from a test script, for instance)
+void mock_i2c_attach(mock_i2c_device_t *device);
+void mock_bus_changed(void);
+
+// current levels of the bus lines
+uint8_t mock_bus_scl(void);
+uint8_t mock_bus_sda(void);
+
+// for a CPU model running the real firmware (host/sim_bench.c) instead of the
+// firmware modules: the registers read and written right away (MOCK_* of
+// avr/io.h, no time goes by, the model calls mock_advance), and the interrupts
+// it has to run instead of the C vectors
+#define MOCK_VECTOR_TIMER1_OVF		4
+#define MOCK_VECTOR_TIMER0_COMPA	10
+#define MOCK_VECTOR_USI_OVF			14
+
+uint8_t mock_io_read(uint8_t reg);
+void mock_io_write(uint8_t reg, uint8_t value);
+
+// pending and enabled (the I bit is up to the model), highest priority first
+// (the lowest vector number, 0 = none). Taken: its flag cleared, like on entry
+uint8_t mock_interrupt_pending(void);
+void mock_interrupt_taken(uint8_t vector);
+
+// VCD trace from now on (0 if the file can't be created), until mock_trace_close
+uint8_t mock_trace_open(const char *path);
+void mock_trace_close(void);
+
+// what the firmware is doing from now on, any name (NULL = nothing in particular).
+// The name is kept as is, not copied (a literal, for instance)
+void mock_trace_phase(const char *name);
+
+#endif
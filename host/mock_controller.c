@@ -0,0 +1,264 @@
+/*
+	Host build: NES Mini / SNES Mini controller model (see mock_controller.h).
+
+	A bit level I2C device driven by the bus line changes: start and stop
+	conditions while SCL is high, bits in on the rising edges of SCL, own
+	bits (ack, data) out on the falling ones.
+*/
+
+#include <string.h>
+
+#include "mock_controller.h"
+
+#define MOCK_CONTROLLER_BUTTONS_ALL		0xF67B // every NES_BUTTON_*
+#define MOCK_CONTROLLER_BUTTONS_SNES	0x2228 // X, Y, L, R
+
+#define MOCK_CONTROLLER_INIT_REGISTER	0xF0
+#define MOCK_CONTROLLER_INIT_VALUE		0x55
+#define MOCK_CONTROLLER_ID_REGISTER		0xFA
+
+#define MOCK_US_TO_CYCLES(us)			((uint64_t)(us) * (F_CPU / 1000) / 1000)
+
+// where the bits go
+#define MOCK_BUS_IDLE		0 // not addressed (or not plugged): wait for a start
+#define MOCK_BUS_RECEIVE	1 // address or data byte from the primary
+#define MOCK_BUS_ACK		2 // acknowledging it
+#define MOCK_BUS_SEND		3 // data byte to the primary
+#define MOCK_BUS_SEND_ACK	4 // its ack / nack
+
+static const uint8_t mock_controller_id[] = { 0x01, 0x00, 0xA4, 0x20, 0x01, 0x01 };
+static const uint8_t mock_controller_stick[] = { 0x5F, 0xDF, 0x8F, 0x00 }; // centered, no triggers
+
+static void mock_controller_power_on(mock_controller_t *controller) {
+	memset(controller->registers, 0, sizeof(controller->registers));
+	memcpy(&controller->registers[MOCK_CONTROLLER_ID_REGISTER], mock_controller_id, sizeof(mock_controller_id));
+
+	controller->initialized = 0;
+	controller->pointer = 0;
+	controller->ready_cycles = 0;
+	controller->bus_state = MOCK_BUS_IDLE;
+	controller->in_transaction = 0;
+	controller->device.sda_low = controller->device.scl_low = 0;
+	controller->device.wake_cycles = 0;
+}
+
+static void mock_controller_set_plugged(mock_controller_t *controller, uint8_t plugged) {
+	if (plugged == controller->plugged) return;
+
+	controller->plugged = plugged;
+	mock_controller_power_on(controller); // unplugged: everything gone. Plugged: fresh start
+}
+
+static void mock_controller_run_script(mock_controller_t *controller) {
+	while (controller->script_next < controller->script_length &&
+			MOCK_US_TO_CYCLES(controller->script[controller->script_next].at_us) <= mock_cycles) {
+		const mock_controller_event_t *event = &controller->script[controller->script_next++];
+
+		mock_controller_set_plugged(controller, event->plugged);
+		controller->buttons = event->buttons;
+	}
+}
+
+static uint8_t mock_controller_read_register(mock_controller_t *controller, uint8_t reg) {
+	uint16_t buttons = controller->buttons & MOCK_CONTROLLER_BUTTONS_ALL;
+
+	if (mock_cycles < controller->ready_cycles) {
+		controller->early_reads++;
+		return controller->not_ready_value;
+	}
+
+	if (reg < 6 && controller->type == MOCK_CONTROLLER_SNES_MINI && !controller->initialized) return 0x00;
+
+	if (controller->type == MOCK_CONTROLLER_NES_MINI) buttons &= ~MOCK_CONTROLLER_BUTTONS_SNES;
+
+	if (reg < 4) return mock_controller_stick[reg];
+	if (reg == 4) return ~(buttons >> 8);
+	if (reg == 5) return ~buttons;
+
+	return controller->registers[reg];
+}
+
+static void mock_controller_write_register(mock_controller_t *controller, uint8_t reg, uint8_t value) {
+	if (reg >= MOCK_CONTROLLER_ID_REGISTER) return; // read only (0xFB too, the init just writes it)
+
+	controller->registers[reg] = value;
+	if (reg == MOCK_CONTROLLER_INIT_REGISTER && value == MOCK_CONTROLLER_INIT_VALUE) controller->initialized = 1;
+}
+
+// a whole byte from the primary (address or data), returns 1 to ack it
+static uint8_t mock_controller_received(mock_controller_t *controller, uint8_t byte) {
+	if (controller->receiving_address) {
+		controller->receiving_address = 0;
+
+		if ((byte >> 1) != MOCK_CONTROLLER_ADDRESS) return 0;
+
+		if (!controller->plugged || (controller->in_transaction > 1 && !controller->repeated_start)) {
+			controller->nacked++;
+			return 0;
+		}
+
+		controller->transactions++;
+		controller->reading = byte & 0x01;
+		controller->first_byte = !controller->reading;
+		return 1;
+	}
+
+	if (controller->first_byte) {
+		// the data behind the new pointer takes read_delay_us to show up
+		controller->pointer = byte;
+		controller->first_byte = 0;
+		controller->ready_cycles = mock_cycles + MOCK_US_TO_CYCLES(controller->read_delay_us);
+	} else {
+		mock_controller_write_register(controller, controller->pointer++, byte);
+	}
+
+	controller->bytes_written++;
+	return 1;
+}
+
+static void mock_controller_load_byte(mock_controller_t *controller) {
+	controller->shift = mock_controller_read_register(controller, controller->pointer++);
+	controller->bytes_read++;
+	controller->bit = 0;
+	controller->device.sda_low = !(controller->shift & 0x80);
+}
+
+// after the ack bit: SCL held low for a while (released by the wake up)
+static void mock_controller_stretch(mock_controller_t *controller) {
+	if (!controller->stretch_us) return;
+
+	controller->device.scl_low = 1;
+	controller->device.wake_cycles = mock_cycles + MOCK_US_TO_CYCLES(controller->stretch_us);
+	controller->stretched_cycles += MOCK_US_TO_CYCLES(controller->stretch_us);
+}
+
+static void mock_controller_falling(mock_controller_t *controller) {
+	switch (controller->bus_state) {
+		case MOCK_BUS_RECEIVE:
+			if (controller->bit < 8) break;
+
+			if (mock_controller_received(controller, controller->shift)) {
+				controller->bus_state = MOCK_BUS_ACK;
+				controller->device.sda_low = 1;
+			} else {
+				controller->bus_state = MOCK_BUS_IDLE; // not for us, or can't answer
+			}
+			break;
+
+		case MOCK_BUS_ACK:
+			controller->device.sda_low = 0;
+
+			if (controller->reading) {
+				controller->bus_state = MOCK_BUS_SEND;
+				mock_controller_load_byte(controller);
+			} else {
+				controller->bus_state = MOCK_BUS_RECEIVE;
+				controller->bit = 0;
+				controller->shift = 0;
+			}
+
+			mock_controller_stretch(controller);
+			break;
+
+		case MOCK_BUS_SEND:
+			if (++controller->bit < 8) {
+				controller->device.sda_low = !(controller->shift & (0x80 >> controller->bit));
+			} else {
+				controller->device.sda_low = 0;
+				controller->bus_state = MOCK_BUS_SEND_ACK;
+			}
+			break;
+
+		case MOCK_BUS_SEND_ACK:
+			if (controller->primary_ack) {
+				controller->bus_state = MOCK_BUS_SEND;
+				mock_controller_load_byte(controller);
+			} else {
+				controller->bus_state = MOCK_BUS_IDLE; // nack: that was the last one
+			}
+			break;
+	}
+}
+
+static void mock_controller_update(mock_i2c_device_t *device, uint8_t scl, uint8_t sda) {
+	mock_controller_t *controller = (mock_controller_t *)device;
+	uint8_t rising = scl && !controller->scl, falling = !scl && controller->scl;
+	uint8_t start = scl && controller->scl && controller->sda && !sda;
+	uint8_t stop = scl && controller->scl && !controller->sda && sda;
+
+	controller->scl = scl;
+	controller->sda = sda;
+
+	// clock stretching over
+	if (device->scl_low && device->wake_cycles == 0) device->scl_low = 0;
+
+	if (controller->stuck_sda) {
+		device->sda_low = 1;
+		if (falling && controller->stuck_sda != 0xFF && !--controller->stuck_sda) {
+			device->sda_low = 0;
+			controller->bus_state = MOCK_BUS_IDLE;
+		}
+		return;
+	}
+
+	if (start) {
+		mock_controller_run_script(controller);
+
+		if (controller->in_transaction < 0xFF) controller->in_transaction++;
+		controller->bus_state = MOCK_BUS_RECEIVE; // (unplugged, it just doesn't ack)
+		controller->bit = 0;
+		controller->shift = 0;
+		controller->first_byte = 0;
+		controller->receiving_address = 1;
+		device->sda_low = 0;
+		return;
+	}
+
+	if (stop) {
+		controller->in_transaction = 0;
+		controller->bus_state = MOCK_BUS_IDLE;
+		device->sda_low = 0;
+		return;
+	}
+
+	if (rising) {
+		if (controller->bus_state == MOCK_BUS_RECEIVE) {
+			controller->shift = (controller->shift << 1) | sda;
+			controller->bit++;
+		} else if (controller->bus_state == MOCK_BUS_SEND_ACK) {
+			controller->primary_ack = !sda;
+		}
+	}
+
+	if (falling) mock_controller_falling(controller);
+}
+
+void mock_controller_init(mock_controller_t *controller, uint8_t type) {
+	memset(controller, 0, sizeof(*controller));
+
+	controller->device.update = mock_controller_update;
+	controller->type = type;
+	controller->plugged = 1;
+	controller->not_ready_value = 0xFF;
+	controller->repeated_start = 1;
+	controller->scl = controller->sda = 1;
+
+	mock_controller_power_on(controller);
+}
+
+void mock_controller_script(mock_controller_t *controller, const mock_controller_event_t *events, uint16_t length) {
+	controller->script = events;
+	controller->script_length = length;
+	controller->script_next = 0;
+}
+
+void mock_controller_plug(mock_controller_t *controller, uint8_t plugged) {
+	mock_controller_set_plugged(controller, plugged);
+	mock_bus_changed();
+}
+
+void mock_controller_stuck(mock_controller_t *controller, uint8_t pulses) {
+	controller->stuck_sda = pulses;
+	controller->device.sda_low = (pulses != 0);
+	mock_bus_changed();
+}
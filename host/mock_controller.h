@@ -0,0 +1,103 @@
+/*
+	Host build: a NES Mini / SNES Mini controller on the simulated I2C bus
+	(attach it with mock_i2c_attach(&controller.device), see mock_avr.h).
+
+	What it does, as seen from the bus:
+
+	* Answers the address 0x52 (both directions) while plugged, NACKs it
+	  otherwise (nothing drives the bus then).
+	* The first byte written is the register pointer, the next ones are
+	  written from there on. 0x55 to 0xF0 is the init (the 0x00 to 0xFB that
+	  usually follows it is accepted and does nothing, like on the real ones).
+	* Reads start at the pointer and auto-increment: 0x00-0x03 fixed (stick
+	  bytes on a Classic Controller), 0x04-0x05 the buttons, inverted (0 =
+	  pressed, NES_BUTTON_* layout), 0xFA-0xFF the ID (01 00 A4 20 01 01).
+	  A SNES Mini reads 0x00 on 0x00-0x05 until it gets the init, a NES Mini
+	  doesn't need it and never shows the SNES only buttons.
+	* read_delay_us: how long after the pointer is written the data behind it
+	  is ready. Reads before that return not_ready_value.
+	* stretch_us: SCL held low after every ack bit it sends, for that long.
+	* repeated_start: 0 = a repeated start is not understood, the address
+	  after it is NACKed.
+	* stuck_sda: SDA held low no matter what (a device stuck in the middle
+	  of a byte) for that many more SCL pulses, 0xFF = forever.
+
+	The buttons and the plug state follow a script of timed events (in us of
+	simulated time), applied on the first bus activity after their time.
+	Unplugging clears the init, like a real power loss.
+*/
+
+#ifndef MOCK_CONTROLLER_H
+#define MOCK_CONTROLLER_H
+
+#include <stdint.h>
+
+#include "mock_avr.h"
+
+#define MOCK_CONTROLLER_ADDRESS		0x52
+
+#define MOCK_CONTROLLER_NES_MINI	0
+#define MOCK_CONTROLLER_SNES_MINI	1
+
+typedef struct {
+	uint32_t	at_us;		// since mock_reset
+	uint8_t		plugged;
+	uint16_t	buttons;	// NES_BUTTON_* bits, 1 = pressed
+} mock_controller_event_t;
+
+typedef struct {
+	mock_i2c_device_t	device; // first: the callbacks get this one
+
+	// configuration (change it any time)
+	uint8_t		type;				// MOCK_CONTROLLER_*
+	uint8_t		plugged;
+	uint16_t	buttons;
+	uint32_t	read_delay_us;
+	uint8_t		not_ready_value;
+	uint32_t	stretch_us;
+	uint8_t		repeated_start;
+	uint8_t		stuck_sda;			// SCL pulses until SDA is released, 0xFF = never
+
+	const mock_controller_event_t	*script;
+	uint16_t	script_length;
+	uint16_t	script_next;
+
+	// state
+	uint8_t		initialized;
+	uint8_t		pointer;
+	uint8_t		registers[256];
+	uint64_t	ready_cycles;		// when the data behind the pointer is ready
+
+	uint8_t		bus_state;
+	uint8_t		bit;
+	uint8_t		shift;
+	uint8_t		receiving_address;	// next byte received is the address
+	uint8_t		reading;			// read address acknowledged
+	uint8_t		first_byte;			// next byte written is the pointer
+	uint8_t		in_transaction;		// between a start and a stop
+	uint8_t		primary_ack;		// the primary wants another byte
+	uint8_t		scl;
+	uint8_t		sda;
+
+	// statistics
+	uint32_t	transactions;		// addressed to it (ACKed)
+	uint32_t	nacked;				// addressed to it, NACKed (unplugged, repeated start...)
+	uint32_t	bytes_written;
+	uint32_t	bytes_read;
+	uint32_t	early_reads;		// bytes read before read_delay_us
+	uint64_t	stretched_cycles;
+} mock_controller_t;
+
+// plugged, nothing pressed, default timing (no delay, no stretching, repeated
+// starts accepted), no script
+void mock_controller_init(mock_controller_t *controller, uint8_t type);
+
+void mock_controller_script(mock_controller_t *controller, const mock_controller_event_t *events, uint16_t length);
+
+// plugs / unplugs it now (outside of the script)
+void mock_controller_plug(mock_controller_t *controller, uint8_t plugged);
+
+// SDA stuck low right now, for that many SCL pulses (0xFF = forever, 0 = released)
+void mock_controller_stuck(mock_controller_t *controller, uint8_t pulses);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+	Host build: ATtiny85 core (see sim_avr.h).
+
+	The opcodes are decoded by their fixed bits, from the most specific ones
+	to the least, following the "AVR Instruction Set Manual". The cycles are
+	the ones of the classic cores (AVRe): 2 for every load / store, 3 for
+	LPM, 2 / 3 / 4 for RJMP / RCALL / RET...
+*/
+
+#include <string.h>
+
+#include "sim_avr.h"
+
+#define R(n)			(avr->data[(n)])
+#define SREG			(avr->data[SIM_AVR_SREG])
+#define FLAG(bit)		((SREG >> (bit)) & 1)
+
+#define REG_X			26
+#define REG_Y			28
+#define REG_Z			30
+
+// the fields of the opcode
+#define OP_D5(op)		(((op) >> 4) & 0x1F)
+#define OP_R5(op)		((((op) >> 5) & 0x10) | ((op) & 0x0F))
+#define OP_D4(op)		(16 + (((op) >> 4) & 0x0F))
+#define OP_K8(op)		((((op) >> 4) & 0xF0) | ((op) & 0x0F))
+#define OP_A5(op)		(((op) >> 3) & 0x1F)
+#define OP_A6(op)		((((op) >> 5) & 0x30) | ((op) & 0x0F))
+#define OP_BIT(op)		((op) & 0x07)
+#define OP_Q(op)		((((op) >> 8) & 0x20) | (((op) >> 7) & 0x18) | ((op) & 0x07))
+
+static void sim_avr_flags(sim_avr_t *avr, uint8_t mask, uint8_t flags) {
+	SREG = (SREG & ~mask) | (flags & mask);
+}
+
+// N, Z and S from the result (V already set)
+static uint8_t sim_avr_nzs(sim_avr_t *avr, uint8_t result, uint8_t v) {
+	uint8_t n = result >> 7;
+
+	return (n << SIM_AVR_FLAG_N) | ((result == 0) << SIM_AVR_FLAG_Z) | (v << SIM_AVR_FLAG_V) | ((n ^ v) << SIM_AVR_FLAG_S);
+}
+
+static uint8_t sim_avr_add(sim_avr_t *avr, uint8_t d, uint8_t r, uint8_t carry) {
+	uint8_t result = d + r + carry;
+	uint8_t c = (d & r) | (r & ~result) | (~result & d);
+	uint8_t v = ((d & r & ~result) | (~d & ~r & result)) >> 7;
+
+	sim_avr_flags(avr, 0x3F, sim_avr_nzs(avr, result, v) | (((c >> 3) & 1) << SIM_AVR_FLAG_H) | ((c >> 7) << SIM_AVR_FLAG_C));
+	return result;
+}
+
+// SUB / CP (keep_z = 0) and SBC / CPC (keep_z = 1: Z only stays set if it was)
+static uint8_t sim_avr_sub(sim_avr_t *avr, uint8_t d, uint8_t r, uint8_t carry, uint8_t keep_z) {
+	uint8_t result = d - r - carry;
+	uint8_t c = (~d & r) | (r & result) | (result & ~d);
+	uint8_t v = ((d & ~r & ~result) | (~d & r & result)) >> 7;
+	uint8_t flags = sim_avr_nzs(avr, result, v) | (((c >> 3) & 1) << SIM_AVR_FLAG_H) | ((c >> 7) << SIM_AVR_FLAG_C);
+
+	if (keep_z && !FLAG(SIM_AVR_FLAG_Z)) flags &= ~(1 << SIM_AVR_FLAG_Z);
+
+	sim_avr_flags(avr, 0x3F, flags);
+	return result;
+}
+
+static uint8_t sim_avr_logic(sim_avr_t *avr, uint8_t result) {
+	sim_avr_flags(avr, (1 << SIM_AVR_FLAG_S) | (1 << SIM_AVR_FLAG_V) | (1 << SIM_AVR_FLAG_N) | (1 << SIM_AVR_FLAG_Z), sim_avr_nzs(avr, result, 0));
+	return result;
+}
+
+// ASR / LSR / ROR: C from bit 0, V = N ^ C
+static uint8_t sim_avr_shift(sim_avr_t *avr, uint8_t d, uint8_t result) {
+	uint8_t c = d & 1, n = result >> 7;
+
+	sim_avr_flags(avr, 0x1F, sim_avr_nzs(avr, result, n ^ c) | c);
+	return result;
+}
+
+static uint16_t sim_avr_word(sim_avr_t *avr, uint8_t reg) {
+	return R(reg) | (R(reg + 1) << 8);
+}
+
+static void sim_avr_set_word(sim_avr_t *avr, uint8_t reg, uint16_t value) {
+	R(reg) = value;
+	R(reg + 1) = value >> 8;
+}
+
+uint16_t sim_avr_sp(const sim_avr_t *avr) {
+	return avr->data[SIM_AVR_SPL] | (avr->data[SIM_AVR_SPH] << 8);
+}
+
+static void sim_avr_set_sp(sim_avr_t *avr, uint16_t sp) {
+	avr->data[SIM_AVR_SPL] = sp;
+	avr->data[SIM_AVR_SPH] = sp >> 8;
+}
+
+static uint8_t sim_avr_read(sim_avr_t *avr, uint16_t address) {
+	if (address < 0x20 || (address >= SIM_AVR_SPL && address < SIM_AVR_RAM_END)) return avr->data[address];
+	if (address < SIM_AVR_RAM_START) return avr->io_read(avr, address - 0x20);
+
+	avr->event = SIM_AVR_EVENT_BAD_DATA;
+	avr->event_address = address;
+	return 0;
+}
+
+static void sim_avr_write(sim_avr_t *avr, uint16_t address, uint8_t value) {
+	if (address < 0x20 || (address >= SIM_AVR_SPL && address < SIM_AVR_RAM_END)) {
+		avr->data[address] = value;
+	} else if (address < SIM_AVR_RAM_START) {
+		avr->io_write(avr, address - 0x20, value);
+	} else {
+		avr->event = SIM_AVR_EVENT_BAD_DATA;
+		avr->event_address = address;
+	}
+}
+
+static uint8_t sim_avr_io_read(sim_avr_t *avr, uint8_t io) {
+	return sim_avr_read(avr, io + 0x20);
+}
+
+static void sim_avr_io_write(sim_avr_t *avr, uint8_t io, uint8_t value) {
+	sim_avr_write(avr, io + 0x20, value);
+}
+
+static void sim_avr_push(sim_avr_t *avr, uint8_t value) {
+	uint16_t sp = sim_avr_sp(avr);
+
+	sim_avr_write(avr, sp, value);
+	sim_avr_set_sp(avr, sp - 1);
+}
+
+static uint8_t sim_avr_pop(sim_avr_t *avr) {
+	uint16_t sp = sim_avr_sp(avr) + 1;
+
+	sim_avr_set_sp(avr, sp);
+	return sim_avr_read(avr, sp);
+}
+
+// return address: low byte first, so it ends up on the higher address
+static void sim_avr_push_pc(sim_avr_t *avr, uint16_t pc) {
+	sim_avr_push(avr, pc);
+	sim_avr_push(avr, pc >> 8);
+}
+
+static uint16_t sim_avr_pop_pc(sim_avr_t *avr) {
+	uint16_t pc = sim_avr_pop(avr) << 8;
+
+	return (pc | sim_avr_pop(avr)) & (SIM_AVR_FLASH_WORDS - 1);
+}
+
+static uint16_t sim_avr_fetch(sim_avr_t *avr, uint16_t pc) {
+	return avr->flash[pc & (SIM_AVR_FLASH_WORDS - 1)];
+}
+
+// LDS, STS, JMP and CALL take two words (for the skips)
+static uint8_t sim_avr_two_words(uint16_t op) {
+	return (op & 0xFC0F) == 0x9000 || (op & 0xFE0C) == 0x940C;
+}
+
+// CPSE, SBRC, SBRS, SBIC, SBIS: the next instruction skipped (1 or 2 more cycles)
+static uint8_t sim_avr_skip(sim_avr_t *avr, uint8_t skip) {
+	if (!skip) return 1;
+
+	uint8_t words = sim_avr_two_words(sim_avr_fetch(avr, avr->pc)) ? 2 : 1;
+	avr->pc += words;
+	return 1 + words;
+}
+
+static uint8_t sim_avr_branch(sim_avr_t *avr, uint16_t op, uint8_t taken) {
+	if (!taken) return 1;
+
+	int8_t offset = (int8_t)((op >> 3) << 1) >> 1; // 7 bits, signed
+	avr->pc += offset;
+	return 2;
+}
+
+// LD / ST through X, Y or Z: mode 0 = unchanged, 1 = post-increment, 2 = pre-decrement
+static uint16_t sim_avr_pointer(sim_avr_t *avr, uint8_t reg, uint8_t mode) {
+	uint16_t pointer = sim_avr_word(avr, reg);
+
+	if (mode == 1) sim_avr_set_word(avr, reg, pointer + 1);
+	else if (mode == 2) sim_avr_set_word(avr, reg, --pointer);
+
+	return pointer;
+}
+
+static uint8_t sim_avr_invalid(sim_avr_t *avr) {
+	avr->pc--;
+	avr->event = SIM_AVR_EVENT_INVALID;
+	return 1;
+}
+
+// 1001 000d dddd xxxx (loads) and 1001 001r rrrr xxxx (stores)
+static uint8_t sim_avr_load_store(sim_avr_t *avr, uint16_t op) {
+	uint8_t d = OP_D5(op), store = (op >> 9) & 1;
+	uint16_t address;
+
+	switch (op & 0x0F) {
+		case 0x0: // LDS / STS
+			address = sim_avr_fetch(avr, avr->pc++);
+			if (store) sim_avr_write(avr, address, R(d));
+			else R(d) = sim_avr_read(avr, address);
+			return 2;
+
+		case 0x1: address = sim_avr_pointer(avr, REG_Z, 1); break;
+		case 0x2: address = sim_avr_pointer(avr, REG_Z, 2); break;
+		case 0x9: address = sim_avr_pointer(avr, REG_Y, 1); break;
+		case 0xA: address = sim_avr_pointer(avr, REG_Y, 2); break;
+		case 0xC: address = sim_avr_pointer(avr, REG_X, 0); break;
+		case 0xD: address = sim_avr_pointer(avr, REG_X, 1); break;
+		case 0xE: address = sim_avr_pointer(avr, REG_X, 2); break;
+
+		case 0x4: // LPM Rd, Z / LPM Rd, Z+
+		case 0x5:
+			if (store) return sim_avr_invalid(avr);
+			address = sim_avr_pointer(avr, REG_Z, op & 1);
+			R(d) = sim_avr_fetch(avr, address >> 1) >> ((address & 1) * 8);
+			return 3;
+
+		case 0xF: // POP / PUSH
+			if (store) sim_avr_push(avr, R(d));
+			else R(d) = sim_avr_pop(avr);
+			return 2;
+
+		default: // ELPM, XCH, LAS, LAC, LAT (not on this one)
+			return sim_avr_invalid(avr);
+	}
+
+	if (store) sim_avr_write(avr, address, R(d));
+	else R(d) = sim_avr_read(avr, address);
+	return 2;
+}
+
+// 1001 010x xxxx xxxx: one operand, SREG bits, returns, jumps and calls
+static uint8_t sim_avr_single(sim_avr_t *avr, uint16_t op) {
+	uint8_t d = OP_D5(op), value = R(d);
+
+	switch (op) {
+		case 0x9508: // RET
+			avr->pc = sim_avr_pop_pc(avr);
+			avr->event = SIM_AVR_EVENT_RET;
+			return 4;
+
+		case 0x9518: // RETI
+			avr->pc = sim_avr_pop_pc(avr);
+			SREG |= (1 << SIM_AVR_FLAG_I);
+			avr->interrupt_shadow = 1;
+			avr->event = SIM_AVR_EVENT_RETI;
+			return 4;
+
+		case 0x9588: avr->event = SIM_AVR_EVENT_SLEEP; return 1;
+		case 0x9598: avr->event = SIM_AVR_EVENT_BREAK; return 1;
+		case 0x95A8: avr->event = SIM_AVR_EVENT_WDR; return 1;
+
+		case 0x95C8: // LPM (R0, Z)
+			R(0) = sim_avr_fetch(avr, sim_avr_word(avr, REG_Z) >> 1) >> ((R(REG_Z) & 1) * 8);
+			return 3;
+
+		case 0x95E8: // SPM (not simulated: the firmware doesn't write its flash)
+			return 1;
+
+		case 0x9409: // IJMP
+			avr->pc = sim_avr_word(avr, REG_Z);
+			return 2;
+
+		case 0x9509: // ICALL
+			sim_avr_push_pc(avr, avr->pc);
+			avr->pc = sim_avr_word(avr, REG_Z);
+			avr->event = SIM_AVR_EVENT_CALL;
+			avr->event_address = avr->pc;
+			return 3;
+	}
+
+	// BSET / BCLR (SEx / CLx)
+	if ((op & 0xFF0F) == 0x9408) {
+		uint8_t bit = (op >> 4) & 0x07;
+
+		if (op & 0x0080) {
+			SREG &= ~(1 << bit);
+		} else {
+			if (bit == SIM_AVR_FLAG_I && !FLAG(SIM_AVR_FLAG_I)) avr->interrupt_shadow = 1; // SEI: the next one runs first
+			SREG |= (1 << bit);
+		}
+		return 1;
+	}
+
+	// JMP / CALL (22 bit address, only 12 of them here)
+	if ((op & 0xFE0C) == 0x940C) {
+		uint16_t target = sim_avr_fetch(avr, avr->pc++);
+
+		if (op & 0x0002) {
+			sim_avr_push_pc(avr, avr->pc);
+			avr->pc = target;
+			avr->event = SIM_AVR_EVENT_CALL;
+			avr->event_address = target;
+			return 4;
+		}
+
+		avr->pc = target;
+		return 3;
+	}
+
+	switch (op & 0x0F) {
+		case 0x0: // COM
+			R(d) = ~value;
+			sim_avr_flags(avr, 0x1F, sim_avr_nzs(avr, R(d), 0) | (1 << SIM_AVR_FLAG_C));
+			return 1;
+
+		case 0x1: // NEG
+			R(d) = sim_avr_sub(avr, 0, value, 0, 0);
+			return 1;
+
+		case 0x2: // SWAP
+			R(d) = (value << 4) | (value >> 4);
+			return 1;
+
+		case 0x3: // INC
+			R(d) = value + 1;
+			sim_avr_flags(avr, 0x1E, sim_avr_nzs(avr, R(d), R(d) == 0x80));
+			return 1;
+
+		case 0x5: R(d) = sim_avr_shift(avr, value, (value >> 1) | (value & 0x80)); return 1; // ASR
+		case 0x6: R(d) = sim_avr_shift(avr, value, value >> 1); return 1; // LSR
+		case 0x7: R(d) = sim_avr_shift(avr, value, (value >> 1) | (FLAG(SIM_AVR_FLAG_C) << 7)); return 1; // ROR
+
+		case 0xA: // DEC
+			R(d) = value - 1;
+			sim_avr_flags(avr, 0x1E, sim_avr_nzs(avr, R(d), R(d) == 0x7F));
+			return 1;
+	}
+
+	return sim_avr_invalid(avr);
+}
+
+// ADIW / SBIW on R24, R26, R28, R30
+static uint8_t sim_avr_word_immediate(sim_avr_t *avr, uint16_t op) {
+	uint8_t reg = 24 + ((op >> 3) & 0x06);
+	uint8_t k = ((op >> 2) & 0x30) | (op & 0x0F);
+	uint16_t value = sim_avr_word(avr, reg), result;
+	uint8_t v, c;
+
+	if (op & 0x0100) {
+		result = value - k;
+		v = ((value & ~result) >> 15) & 1;
+		c = ((result & ~value) >> 15) & 1;
+	} else {
+		result = value + k;
+		v = ((~value & result) >> 15) & 1;
+		c = ((~result & value) >> 15) & 1;
+	}
+
+	sim_avr_set_word(avr, reg, result);
+
+	uint8_t n = result >> 15;
+	sim_avr_flags(avr, 0x1F, (n << SIM_AVR_FLAG_N) | ((result == 0) << SIM_AVR_FLAG_Z) | (v << SIM_AVR_FLAG_V) | ((n ^ v) << SIM_AVR_FLAG_S) | c);
+	return 2;
+}
+
+// 1001 10xx AAAA Abbb: CBI, SBIC, SBI, SBIS (I/O 0x00 - 0x1F)
+static uint8_t sim_avr_io_bit(sim_avr_t *avr, uint16_t op) {
+	uint8_t io = OP_A5(op), mask = 1 << OP_BIT(op);
+	uint8_t value = sim_avr_io_read(avr, io);
+
+	switch ((op >> 8) & 0x03) {
+		case 0: sim_avr_io_write(avr, io, value & ~mask); return 2;
+		case 2: sim_avr_io_write(avr, io, value | mask); return 2;
+		case 1: return sim_avr_skip(avr, !(value & mask));
+		default: return sim_avr_skip(avr, value & mask);
+	}
+}
+
+void sim_avr_reset(sim_avr_t *avr) {
+	memset(avr->data, 0, SIM_AVR_RAM_START);
+	sim_avr_set_sp(avr, SIM_AVR_RAM_END - 1);
+
+	avr->pc = 0;
+	avr->interrupt_shadow = 0;
+	avr->event = SIM_AVR_EVENT_NONE;
+}
+
+uint8_t sim_avr_step(sim_avr_t *avr) {
+	avr->event = SIM_AVR_EVENT_NONE;
+
+	// interrupts: the return address on the stack, I cleared, pc to the vector (one word each)
+	if (FLAG(SIM_AVR_FLAG_I) && !avr->interrupt_shadow) {
+		uint8_t vector = avr->interrupt(avr);
+
+		if (vector) {
+			sim_avr_push_pc(avr, avr->pc);
+			SREG &= ~(1 << SIM_AVR_FLAG_I);
+			avr->pc = vector;
+			avr->event = SIM_AVR_EVENT_INTERRUPT;
+			avr->event_address = vector;
+			return 4;
+		}
+	}
+	avr->interrupt_shadow = 0;
+
+	uint16_t op = sim_avr_fetch(avr, avr->pc++);
+	avr->pc &= SIM_AVR_FLASH_WORDS - 1;
+
+	uint8_t d = OP_D5(op), r = OP_R5(op);
+
+	switch (op >> 12) {
+		case 0x0:
+			if (op == 0x0000) return 1; // NOP
+
+			switch ((op >> 10) & 0x03) {
+				case 0:
+					if ((op & 0xFF00) == 0x0100) { // MOVW
+						R(((op >> 4) & 0x0F) * 2) = R((op & 0x0F) * 2);
+						R(((op >> 4) & 0x0F) * 2 + 1) = R((op & 0x0F) * 2 + 1);
+						return 1;
+					}
+					return sim_avr_invalid(avr); // MULS, MULSU, FMUL... (no multiplier)
+
+				case 1: sim_avr_sub(avr, R(d), R(r), FLAG(SIM_AVR_FLAG_C), 1); return 1; // CPC
+				case 2: R(d) = sim_avr_sub(avr, R(d), R(r), FLAG(SIM_AVR_FLAG_C), 1); return 1; // SBC
+				default: R(d) = sim_avr_add(avr, R(d), R(r), 0); return 1; // ADD
+			}
+
+		case 0x1:
+			switch ((op >> 10) & 0x03) {
+				case 0: return sim_avr_skip(avr, R(d) == R(r)); // CPSE
+				case 1: sim_avr_sub(avr, R(d), R(r), 0, 0); return 1; // CP
+				case 2: R(d) = sim_avr_sub(avr, R(d), R(r), 0, 0); return 1; // SUB
+				default: R(d) = sim_avr_add(avr, R(d), R(r), FLAG(SIM_AVR_FLAG_C)); return 1; // ADC
+			}
+
+		case 0x2:
+			switch ((op >> 10) & 0x03) {
+				case 0: R(d) = sim_avr_logic(avr, R(d) & R(r)); return 1; // AND
+				case 1: R(d) = sim_avr_logic(avr, R(d) ^ R(r)); return 1; // EOR
+				case 2: R(d) = sim_avr_logic(avr, R(d) | R(r)); return 1; // OR
+				default: R(d) = R(r); return 1; // MOV
+			}
+
+		case 0x3: sim_avr_sub(avr, R(OP_D4(op)), OP_K8(op), 0, 0); return 1; // CPI
+		case 0x4: R(OP_D4(op)) = sim_avr_sub(avr, R(OP_D4(op)), OP_K8(op), FLAG(SIM_AVR_FLAG_C), 1); return 1; // SBCI
+		case 0x5: R(OP_D4(op)) = sim_avr_sub(avr, R(OP_D4(op)), OP_K8(op), 0, 0); return 1; // SUBI
+		case 0x6: R(OP_D4(op)) = sim_avr_logic(avr, R(OP_D4(op)) | OP_K8(op)); return 1; // ORI
+		case 0x7: R(OP_D4(op)) = sim_avr_logic(avr, R(OP_D4(op)) & OP_K8(op)); return 1; // ANDI
+
+		case 0x8:
+		case 0xA: { // LDD / STD through Y or Z (LD / ST with q = 0 too)
+			uint16_t address = sim_avr_word(avr, (op & 0x0008) ? REG_Y : REG_Z) + OP_Q(op);
+
+			if (op & 0x0200) sim_avr_write(avr, address, R(d));
+			else R(d) = sim_avr_read(avr, address);
+			return 2;
+		}
+
+		case 0x9:
+			switch ((op >> 8) & 0x0F) {
+				case 0x0: case 0x1: case 0x2: case 0x3: return sim_avr_load_store(avr, op);
+				case 0x4: case 0x5: return sim_avr_single(avr, op);
+				case 0x6: case 0x7: return sim_avr_word_immediate(avr, op);
+				case 0x8: case 0x9: case 0xA: case 0xB: return sim_avr_io_bit(avr, op);
+				default: return sim_avr_invalid(avr); // MUL
+			}
+
+		case 0xB: // IN / OUT
+			if (op & 0x0800) sim_avr_io_write(avr, OP_A6(op), R(d));
+			else R(d) = sim_avr_io_read(avr, OP_A6(op));
+			return 1;
+
+		case 0xC: // RJMP
+			avr->pc = (avr->pc + ((int16_t)(op << 4) >> 4)) & (SIM_AVR_FLASH_WORDS - 1);
+			return 2;
+
+		case 0xD: // RCALL
+			sim_avr_push_pc(avr, avr->pc);
+			avr->pc = (avr->pc + ((int16_t)(op << 4) >> 4)) & (SIM_AVR_FLASH_WORDS - 1);
+			avr->event = SIM_AVR_EVENT_CALL;
+			avr->event_address = avr->pc;
+			return 3;
+
+		case 0xE: R(OP_D4(op)) = OP_K8(op); return 1; // LDI
+
+		default: // 0xF: branches, BLD / BST, SBRC / SBRS
+			switch ((op >> 9) & 0x07) {
+				case 0: case 1: return sim_avr_branch(avr, op, FLAG(OP_BIT(op))); // BRBS
+				case 2: case 3: return sim_avr_branch(avr, op, !FLAG(OP_BIT(op))); // BRBC
+
+				case 4: // BLD
+					R(d) = (R(d) & ~(1 << OP_BIT(op))) | (FLAG(SIM_AVR_FLAG_T) << OP_BIT(op));
+					return 1;
+
+				case 5: // BST
+					sim_avr_flags(avr, 1 << SIM_AVR_FLAG_T, ((R(d) >> OP_BIT(op)) & 1) << SIM_AVR_FLAG_T);
+					return 1;
+
+				case 6: return sim_avr_skip(avr, !(R(d) & (1 << OP_BIT(op)))); // SBRC
+				default: return sim_avr_skip(avr, R(d) & (1 << OP_BIT(op))); // SBRS
+			}
+	}
+}
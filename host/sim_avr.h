@@ -0,0 +1,86 @@
+/*
+	Host build: instruction level ATtiny85 core (the AVR25 instruction set, no
+	MUL), for running the real firmware image (main.elf) cycle by cycle, see
+	host/sim_bench.c.
+
+	Only the CPU: the registers, SREG, the stack pointer, the flash and the
+	SRAM. Everything else in the I/O space (0x00 - 0x3F, or 0x20 - 0x5F in
+	the data space) goes through io_read / io_write, and the interrupts come
+	from interrupt(), so the peripherals can live somewhere else (the ones of
+	host/mock_avr.c, for instance).
+
+	Each sim_avr_step runs one instruction (or the entry of one interrupt)
+	and returns how many cycles it took, from the instruction timing tables
+	of the datasheet. What happened that the caller may want to know about
+	(a call, a return, an interrupt, a WDR...) is left on event.
+*/
+
+#ifndef SIM_AVR_H
+#define SIM_AVR_H
+
+#include <stdint.h>
+
+#define SIM_AVR_FLASH_WORDS		4096	// 8KB
+#define SIM_AVR_RAM_START		0x60
+#define SIM_AVR_RAM_END			0x260	// 512 bytes, first address out of it
+#define SIM_AVR_EEPROM_SIZE		512
+
+// data space addresses of the ones the core keeps
+#define SIM_AVR_SPL				0x5D
+#define SIM_AVR_SPH				0x5E
+#define SIM_AVR_SREG			0x5F
+
+// SREG bits
+#define SIM_AVR_FLAG_C		0
+#define SIM_AVR_FLAG_Z		1
+#define SIM_AVR_FLAG_N		2
+#define SIM_AVR_FLAG_V		3
+#define SIM_AVR_FLAG_S		4
+#define SIM_AVR_FLAG_H		5
+#define SIM_AVR_FLAG_T		6
+#define SIM_AVR_FLAG_I		7
+
+// event: what the last step did (besides the usual)
+#define SIM_AVR_EVENT_NONE		0
+#define SIM_AVR_EVENT_CALL		1 // event_address: the function (word address)
+#define SIM_AVR_EVENT_RET		2
+#define SIM_AVR_EVENT_RETI		3
+#define SIM_AVR_EVENT_INTERRUPT	4 // event_address: the vector number
+#define SIM_AVR_EVENT_WDR		5
+#define SIM_AVR_EVENT_SLEEP		6
+#define SIM_AVR_EVENT_BREAK		7
+#define SIM_AVR_EVENT_INVALID	8 // unknown opcode (not run, pc still on it)
+#define SIM_AVR_EVENT_BAD_DATA	9 // data access out of the SRAM, event_address: the address
+
+typedef struct sim_avr sim_avr_t;
+
+struct sim_avr {
+	uint16_t	flash[SIM_AVR_FLASH_WORDS];
+	uint8_t		data[SIM_AVR_RAM_END];	// registers, SPL / SPH / SREG and the SRAM (the rest of the I/O space is not here)
+
+	uint16_t	pc;						// in words
+	uint8_t		interrupt_shadow;		// one more instruction before an interrupt (after SEI and RETI)
+
+	uint8_t		event;
+	uint16_t	event_address;
+
+	// I/O addresses (0x00 - 0x3F), everything but SPL, SPH and SREG
+	uint8_t		(*io_read)(sim_avr_t *avr, uint8_t address);
+	void		(*io_write)(sim_avr_t *avr, uint8_t address, uint8_t value);
+
+	// the pending interrupt to run (it's only called with the I bit set), its
+	// flag cleared like on entry. 0 = none, otherwise the vector number
+	uint8_t		(*interrupt)(sim_avr_t *avr);
+
+	void		*context;				// for the callbacks
+};
+
+// reset: pc to 0, registers, SREG and SP cleared (the flash and the SRAM stay)
+void sim_avr_reset(sim_avr_t *avr);
+
+// runs one instruction or enters an interrupt, returns the cycles taken
+uint8_t sim_avr_step(sim_avr_t *avr);
+
+uint16_t sim_avr_sp(const sim_avr_t *avr);
+
+#endif
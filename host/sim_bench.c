@@ -0,0 +1,768 @@
+/*
+	Instruction level benchmark of the real firmware (make bench-sim): main.elf
+	run on the ATtiny85 core of sim_avr.c, with the peripherals of mock_avr.c
+	(Timer0, Timer1, the USI and the I2C bus), a SNES Mini on the bus
+	(mock_controller.c), a USB host on D+ / D- (sim_usb.c) and, here, the
+	pin change interrupt, the watchdog and the EEPROM.
+
+	Every instruction is counted, so the numbers (cycles at F_CPU) are the ones
+	of the device, as long as the peripherals behave like the real ones:
+
+	* the main loop, from one usbPoll call to the next one
+	* every function called (by its symbol in main.elf): calls, cycles per
+	  call (min / mean / max, callees included, interrupts not) and the
+	  share of the total time. Whatever got inlined counts for the function
+	  it ended up in
+	* the interrupt vectors, the same way (their nested interrupts not counted)
+	* USB: when the host got the device enumerated, the polls, reports,
+	  NAKs and errors, and how long the device takes to answer (bits from
+	  the end of the host packet)
+	* the button latency: from each change of the scripted buttons to the
+	  first report that shows it
+	* the deepest the stack got, and the EEPROM writes
+
+		./host/sim_bench [-s seconds] [-n] [-a] [-t trace.vcd] main.elf
+
+	-s simulated time (3 by default), -n a NES Mini instead, -a every function
+	(not only the 20 most expensive ones), -t VCD trace of the I2C bus with
+	the function running as the phase (see mock_avr.h).
+
+	Exits with 1 when something went wrong: an unknown instruction, a data
+	access outside of the SRAM, a watchdog reset or no enumeration at all.
+
+	Not run against a real main.elf yet (it was written without avr-gcc at
+	hand), so everything above is untested on the firmware itself: only the
+	core and the USB host are, by make sim-test. Take its first numbers with
+	that in mind.
+*/
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avr/io.h>
+
+#include "mock_avr.h"
+#include "mock_controller.h"
+#include "sim_avr.h"
+#include "sim_usb.h"
+
+// I/O addresses (not the data space ones) of what's simulated here
+#define IO_EECR				0x1C
+#define IO_EEDR				0x1D
+#define IO_EEARL			0x1E
+#define IO_EEARH			0x1F
+#define IO_WDTCR			0x21
+#define IO_PCMSK			0x15
+#define IO_PINB				0x16
+#define IO_GIFR				0x3A
+#define IO_GIMSK			0x3B
+
+#define PCIF				5	// GIFR / GIMSK (PCIE)
+#define EERIE				3
+#define EEMPE				2
+#define EEPE				1
+#define EERE				0
+#define WDIF				7
+#define WDIE				6
+#define WDE					3
+
+#define VECTOR_PCINT0		2
+#define VECTOR_EE_RDY		6
+#define VECTOR_WDT			12
+
+// USB pins (usbconfig.h): D- on PB3, D+ on PB1
+#define USB_DMINUS			3
+#define USB_DPLUS			1
+#define USB_MASK			((1 << USB_DMINUS) | (1 << USB_DPLUS))
+
+#define SIM_FUNCTIONS		1024
+#define SIM_FRAMES			64
+#define SIM_LEVELS			8		// nested interrupts
+#define SIM_TOP_FUNCTIONS	20
+
+#define SIM_MS_TO_CYCLES(ms)	((uint64_t)(ms) * (F_CPU / 1000))
+
+typedef struct {
+	char		*name;
+	uint16_t	address;			// words
+	uint8_t		function;			// a real function (or a plain label)
+	uint8_t		vector;				// reached from this vector (0 = not an interrupt)
+	uint32_t	calls;
+	uint64_t	cycles;
+	uint64_t	min;
+	uint64_t	max;
+} sim_function_t;
+
+typedef struct {
+	sim_function_t	*function;
+	uint16_t	sp;					// right after the return address went in
+	uint64_t	start;
+	uint8_t		interrupt;
+	uint8_t		level;				// interrupts under it, itself included
+	uint64_t	nested;				// level_cycles[level + 1] at the start
+} sim_frame_t;
+
+typedef struct {
+	uint64_t	count;
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+} sim_stats_t;
+
+static sim_avr_t sim_avr;
+static sim_usb_t sim_usb;
+static mock_controller_t sim_controller;
+
+static uint8_t sim_io[64];			// what's not on mock_avr.c
+
+static uint8_t sim_eeprom[SIM_AVR_EEPROM_SIZE];
+static uint64_t sim_eeprom_busy_until;
+static uint64_t sim_eeprom_unlocked_until;	// EEMPE: 4 cycles
+static uint32_t sim_eeprom_writes;
+
+static uint64_t sim_watchdog_last;	// last WDR (or enable)
+static uint32_t sim_watchdog_resets;
+
+static uint8_t sim_stall;			// extra cycles of the current instruction (EEPROM read)
+static uint8_t sim_pins;			// PINB after the last instruction (pin changes)
+
+static sim_function_t *sim_functions[SIM_FUNCTIONS]; // sorted by address
+static uint16_t sim_function_count;
+static sim_function_t *sim_usb_poll;
+
+static sim_frame_t sim_frames[SIM_FRAMES];
+static uint8_t sim_depth;
+static uint8_t sim_level;
+static uint64_t sim_level_cycles[SIM_LEVELS + 2];
+
+static sim_stats_t sim_loop;
+static uint64_t sim_loop_last;
+static uint16_t sim_sp_min = 0xFFFF;
+static uint64_t sim_instructions;
+static uint32_t sim_bad_data;
+static uint16_t sim_bad_data_address, sim_bad_data_pc;
+
+static void sim_stats_add(sim_stats_t *stats, uint64_t value) {
+	if (!stats->count++ || value < stats->min) stats->min = value;
+	if (value > stats->max) stats->max = value;
+	stats->total += value;
+}
+
+// --- functions, from the symbols ---
+
+static sim_function_t *sim_function_find(uint16_t address) {
+	int lower = 0, upper = sim_function_count - 1;
+
+	while (lower <= upper) {
+		int middle = (lower + upper) / 2;
+
+		if (sim_functions[middle]->address == address) return sim_functions[middle];
+		if (sim_functions[middle]->address < address) lower = middle + 1;
+		else upper = middle - 1;
+	}
+
+	return NULL;
+}
+
+// (a real function wins over a label on the same address)
+static sim_function_t *sim_function_add(const char *name, uint16_t address, uint8_t function) {
+	sim_function_t *entry = sim_function_find(address);
+
+	if (entry) {
+		if (function && !entry->function) {
+			free(entry->name);
+			entry->name = strdup(name);
+			entry->function = 1;
+		}
+		return entry;
+	}
+
+	if (sim_function_count == SIM_FUNCTIONS) return NULL;
+
+	entry = calloc(1, sizeof(*entry));
+	entry->name = strdup(name);
+	entry->address = address;
+	entry->function = function;
+
+	uint16_t x = sim_function_count++;
+	for (; x && sim_functions[x - 1]->address > address; x--) sim_functions[x] = sim_functions[x - 1];
+	sim_functions[x] = entry;
+
+	return entry;
+}
+
+// called without a symbol: named by its address
+static sim_function_t *sim_function_at(uint16_t address) {
+	sim_function_t *entry = sim_function_find(address);
+	char name[16];
+
+	if (entry) return entry;
+
+	snprintf(name, sizeof(name), "0x%04X", address * 2);
+	return sim_function_add(name, address, 0);
+}
+
+// --- main.elf ---
+
+static uint8_t sim_load(const char *path) {
+	FILE *file = fopen(path, "rb");
+	long size;
+	uint8_t *image;
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	image = malloc(size);
+	if (fread(image, 1, size, file) != (size_t)size) size = 0;
+	fclose(file);
+
+	Elf32_Ehdr *header = (Elf32_Ehdr *)image;
+
+	if (size < (long)sizeof(*header) || memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+		header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_machine != EM_AVR) {
+		fprintf(stderr, "%s: not an AVR ELF file\n", path);
+		free(image);
+		return 0;
+	}
+
+	// flash at the load addresses (.data included, the startup code copies it),
+	// EEPROM at 0x810000
+	for (uint16_t x = 0; x < header->e_phnum; x++) {
+		Elf32_Phdr *segment = (Elf32_Phdr *)(image + header->e_phoff + x * header->e_phentsize);
+		uint8_t *bytes = image + segment->p_offset;
+
+		if (segment->p_type != PT_LOAD || !segment->p_filesz) continue;
+
+		if (segment->p_paddr + segment->p_filesz <= SIM_AVR_FLASH_WORDS * 2) {
+			for (uint32_t byte = 0; byte < segment->p_filesz; byte++) {
+				uint32_t address = segment->p_paddr + byte;
+				uint16_t *word = &sim_avr.flash[address / 2];
+
+				*word = (address & 1) ? (*word & 0x00FF) | (bytes[byte] << 8) : (*word & 0xFF00) | bytes[byte];
+			}
+		} else if (segment->p_paddr >= 0x810000 && segment->p_paddr + segment->p_filesz <= 0x810000 + SIM_AVR_EEPROM_SIZE) {
+			memcpy(&sim_eeprom[segment->p_paddr - 0x810000], bytes, segment->p_filesz);
+		}
+	}
+
+	// code symbols: the functions (and the asm labels of usbdrvasm.S)
+	for (uint16_t x = 0; x < header->e_shnum; x++) {
+		Elf32_Shdr *section = (Elf32_Shdr *)(image + header->e_shoff + x * header->e_shentsize);
+
+		if (section->sh_type != SHT_SYMTAB) continue;
+
+		Elf32_Shdr *strings = (Elf32_Shdr *)(image + header->e_shoff + section->sh_link * header->e_shentsize);
+		Elf32_Sym *symbols = (Elf32_Sym *)(image + section->sh_offset);
+
+		for (uint32_t y = 0; y < section->sh_size / sizeof(Elf32_Sym); y++) {
+			Elf32_Sym *symbol = &symbols[y];
+			uint8_t type = ELF32_ST_TYPE(symbol->st_info);
+			const char *name = (const char *)image + strings->sh_offset + symbol->st_name;
+
+			if ((type != STT_FUNC && type != STT_NOTYPE) || !name[0] || name[0] == '.') continue;
+			if (symbol->st_shndx == SHN_UNDEF || symbol->st_shndx >= SHN_LORESERVE) continue;
+			if (symbol->st_value >= SIM_AVR_FLASH_WORDS * 2 || (symbol->st_value & 1)) continue;
+
+			Elf32_Shdr *owner = (Elf32_Shdr *)(image + header->e_shoff + symbol->st_shndx * header->e_shentsize);
+			if (!(owner->sh_flags & SHF_EXECINSTR)) continue;
+
+			sim_function_add(name, symbol->st_value / 2, type == STT_FUNC);
+		}
+	}
+
+	free(image);
+
+	sim_usb_poll = NULL;
+	for (uint16_t x = 0; x < sim_function_count; x++) {
+		if (!strcmp(sim_functions[x]->name, "usbPoll")) sim_usb_poll = sim_functions[x];
+	}
+
+	return 1;
+}
+
+// --- the peripherals that are not on mock_avr.c ---
+
+static uint8_t sim_mock_register(uint8_t io) {
+	switch (io) {
+		case 0x18: return MOCK_PORTB;
+		case 0x17: return MOCK_DDRB;
+		case 0x16: return MOCK_PINB;
+		case 0x0F: return MOCK_USIDR;
+		case 0x0E: return MOCK_USISR;
+		case 0x0D: return MOCK_USICR;
+		case 0x10: return MOCK_USIBR;
+		case 0x2A: return MOCK_TCCR0A;
+		case 0x33: return MOCK_TCCR0B;
+		case 0x32: return MOCK_TCNT0;
+		case 0x29: return MOCK_OCR0A;
+		case 0x28: return MOCK_OCR0B;
+		case 0x39: return MOCK_TIMSK;
+		case 0x38: return MOCK_TIFR;
+		case 0x30: return MOCK_TCCR1;
+		case 0x2F: return MOCK_TCNT1;
+		case 0x2E: return MOCK_OCR1A;
+		case 0x2B: return MOCK_OCR1B;
+		case 0x2D: return MOCK_OCR1C;
+		case 0x2C: return MOCK_GTCCR;
+		case 0x34: return MOCK_MCUSR;
+	}
+
+	return MOCK_IO_REGISTERS;
+}
+
+// PINB: the bus lines from mock_avr.c, D+ / D- from whoever drives them
+static uint8_t sim_read_pins() {
+	uint8_t ddr = mock_io_read(MOCK_DDRB), port = mock_io_read(MOCK_PORTB);
+	uint8_t lines = sim_usb_lines(&sim_usb, mock_cycles);
+	uint8_t host = ((lines & SIM_USB_J) ? (1 << USB_DMINUS) : 0) | ((lines & SIM_USB_K) ? (1 << USB_DPLUS) : 0);
+
+	return (mock_io_read(MOCK_PINB) & ~USB_MASK) | (((ddr & port) | (~ddr & host)) & USB_MASK);
+}
+
+// what the device drives on D+ / D-, for the host (bit 0: D-, bit 1: D+)
+static void sim_usb_pins_changed() {
+	uint8_t ddr = mock_io_read(MOCK_DDRB), port = mock_io_read(MOCK_PORTB);
+
+	sim_usb_device(&sim_usb, mock_cycles,
+		((ddr >> USB_DMINUS) & 1) | (((ddr >> USB_DPLUS) & 1) << 1),
+		((port >> USB_DMINUS) & 1) | (((port >> USB_DPLUS) & 1) << 1));
+}
+
+static uint8_t sim_eeprom_busy() {
+	return mock_cycles < sim_eeprom_busy_until;
+}
+
+static uint64_t sim_watchdog_timeout() {
+	uint8_t wdtcr = sim_io[IO_WDTCR];
+	uint8_t prescaler = (wdtcr & 0x07) | ((wdtcr >> 2) & 0x08); // WDP3 is bit 5
+
+	return (2048ULL << prescaler) * F_CPU / 128000; // the 128kHz oscillator
+}
+
+static uint8_t sim_io_read(sim_avr_t *avr, uint8_t io) {
+	uint8_t reg = sim_mock_register(io);
+
+	if (io == IO_PINB) return sim_read_pins();
+	if (reg != MOCK_IO_REGISTERS) return mock_io_read(reg);
+
+	if (io == IO_EECR) {
+		return (sim_io[IO_EECR] & ~((1 << EEMPE) | (1 << EEPE) | (1 << EERE))) |
+			(mock_cycles < sim_eeprom_unlocked_until ? (1 << EEMPE) : 0) | (sim_eeprom_busy() ? (1 << EEPE) : 0);
+	}
+
+	return sim_io[io];
+}
+
+static void sim_eeprom_control(uint8_t value) {
+	uint16_t address = (sim_io[IO_EEARL] | (sim_io[IO_EEARH] << 8)) & (SIM_AVR_EEPROM_SIZE - 1);
+
+	if (value & (1 << EERE)) {
+		sim_io[IO_EEDR] = sim_eeprom[address];
+		sim_stall += 4; // the CPU is halted for 4 cycles
+	}
+
+	if ((value & (1 << EEMPE)) && !(value & (1 << EEPE))) sim_eeprom_unlocked_until = mock_cycles + 4;
+
+	// EEPM1:0 = 00 erase and write (3.4ms), 01 erase only, 10 write only (1.8ms)
+	if ((value & (1 << EEPE)) && mock_cycles < sim_eeprom_unlocked_until && !sim_eeprom_busy()) {
+		uint8_t mode = (value >> 4) & 0x03;
+
+		if (mode == 0) sim_eeprom[address] = sim_io[IO_EEDR];
+		else if (mode == 1) sim_eeprom[address] = 0xFF;
+		else sim_eeprom[address] &= sim_io[IO_EEDR];
+
+		sim_eeprom_busy_until = mock_cycles + (mode == 0 ? SIM_MS_TO_CYCLES(34) / 10 : SIM_MS_TO_CYCLES(18) / 10);
+		sim_eeprom_unlocked_until = 0;
+		sim_eeprom_writes++;
+	}
+
+	sim_io[IO_EECR] = value & ~((1 << EEMPE) | (1 << EEPE) | (1 << EERE));
+}
+
+static void sim_io_write(sim_avr_t *avr, uint8_t io, uint8_t value) {
+	uint8_t reg = sim_mock_register(io);
+
+	switch (io) {
+		case IO_PINB: // writing 1 toggles the PORTB bit
+			mock_io_write(MOCK_PORTB, mock_io_read(MOCK_PORTB) ^ value);
+			sim_usb_pins_changed();
+			return;
+
+		case IO_GIFR:
+			sim_io[IO_GIFR] &= ~value; // 1 clears
+			return;
+
+		case IO_EECR:
+			sim_eeprom_control(value);
+			return;
+
+		case IO_WDTCR:
+			if ((value & ((1 << WDE) | (1 << WDIE))) && !(sim_io[IO_WDTCR] & ((1 << WDE) | (1 << WDIE)))) sim_watchdog_last = mock_cycles;
+			sim_io[IO_WDTCR] = (value & ~(1 << WDIF)) | (sim_io[IO_WDTCR] & ~value & (1 << WDIF));
+			return;
+	}
+
+	if (reg == MOCK_IO_REGISTERS) {
+		sim_io[io] = value;
+		return;
+	}
+
+	mock_io_write(reg, value);
+	if (reg == MOCK_PORTB || reg == MOCK_DDRB) sim_usb_pins_changed();
+}
+
+// highest priority first (the lowest vector number)
+static uint8_t sim_interrupt(sim_avr_t *avr) {
+	uint8_t vector = mock_interrupt_pending();
+
+	if ((sim_io[IO_GIMSK] & (1 << PCIF)) && (sim_io[IO_GIFR] & (1 << PCIF))) {
+		sim_io[IO_GIFR] &= ~(1 << PCIF);
+		return VECTOR_PCINT0;
+	}
+
+	if ((!vector || vector > VECTOR_EE_RDY) && (sim_io[IO_EECR] & (1 << EERIE)) && !sim_eeprom_busy()) return VECTOR_EE_RDY;
+
+	if ((!vector || vector > VECTOR_WDT) && (sim_io[IO_WDTCR] & (1 << WDIE)) && (sim_io[IO_WDTCR] & (1 << WDIF))) {
+		sim_io[IO_WDTCR] &= ~(1 << WDIF);
+		if (sim_io[IO_WDTCR] & (1 << WDE)) sim_io[IO_WDTCR] &= ~(1 << WDIE); // the next timeout resets
+		return VECTOR_WDT;
+	}
+
+	if (vector) mock_interrupt_taken(vector);
+	return vector;
+}
+
+// a reset (the watchdog): registers back to their initial values, the SRAM stays
+static void sim_reset(uint8_t cause) {
+	sim_avr_reset(&sim_avr);
+
+	for (uint8_t reg = 0; reg < MOCK_IO_REGISTERS; reg++) {
+		if (reg == MOCK_PINB || reg == MOCK_MCUSR) continue;
+		mock_io_write(reg, reg == MOCK_USISR ? 0xE0 : (reg == MOCK_TIFR ? 0xFF : 0));
+	}
+	mock_io_write(MOCK_MCUSR, mock_io_read(MOCK_MCUSR) | cause);
+
+	memset(sim_io, 0, sizeof(sim_io));
+	if (cause & (1 << WDRF)) sim_io[IO_WDTCR] = (1 << WDE); // forced on after a watchdog reset
+	sim_watchdog_last = mock_cycles;
+
+	sim_depth = sim_level = 0;
+	sim_loop_last = 0;
+	sim_pins = sim_read_pins();
+	sim_usb_pins_changed();
+}
+
+static void sim_watchdog() {
+	uint8_t wdtcr = sim_io[IO_WDTCR];
+
+	if (!(wdtcr & ((1 << WDE) | (1 << WDIE))) || mock_cycles - sim_watchdog_last < sim_watchdog_timeout()) return;
+
+	sim_watchdog_last = mock_cycles;
+
+	if (wdtcr & (1 << WDIE)) {
+		sim_io[IO_WDTCR] |= (1 << WDIF);
+		return;
+	}
+
+	sim_watchdog_resets++;
+	fprintf(stderr, "%.1f ms: watchdog reset (pc 0x%04X)\n", MOCK_CYCLES_TO_US(mock_cycles) / 1000, sim_avr.pc * 2);
+	sim_reset(1 << WDRF);
+}
+
+// --- who's running ---
+
+static void sim_trace_phase() {
+	mock_trace_phase(sim_depth ? sim_frames[sim_depth - 1].function->name : NULL);
+}
+
+static void sim_frame_push(sim_function_t *function, uint64_t start, uint8_t interrupt) {
+	if (!function || sim_depth == SIM_FRAMES) return;
+
+	sim_frame_t *frame = &sim_frames[sim_depth++];
+
+	frame->function = function;
+	frame->sp = sim_avr_sp(&sim_avr);
+	frame->start = start;
+	frame->interrupt = interrupt;
+	frame->level = sim_level;
+	frame->nested = sim_level_cycles[sim_level + 1];
+
+	sim_trace_phase();
+}
+
+// everything under the stack pointer returned
+static void sim_frame_pop() {
+	uint16_t sp = sim_avr_sp(&sim_avr);
+
+	while (sim_depth && sim_frames[sim_depth - 1].sp < sp) {
+		sim_frame_t *frame = &sim_frames[--sim_depth];
+		sim_function_t *function = frame->function;
+		uint64_t cycles = mock_cycles - frame->start - (sim_level_cycles[frame->level + 1] - frame->nested);
+
+		if (!function->calls++ || cycles < function->min) function->min = cycles;
+		if (cycles > function->max) function->max = cycles;
+		function->cycles += cycles;
+
+		if (frame->interrupt && sim_level) sim_level--;
+	}
+
+	sim_trace_phase();
+}
+
+// the function behind a vector (its RJMP / JMP)
+static sim_function_t *sim_vector_function(uint8_t vector) {
+	uint16_t op = sim_avr.flash[vector], target = vector;
+
+	if ((op & 0xF000) == 0xC000) target = vector + 1 + ((int16_t)(op << 4) >> 4);
+	else if ((op & 0xFE0E) == 0x940C) target = sim_avr.flash[vector + 1];
+
+	sim_function_t *function = sim_function_at(target & (SIM_AVR_FLASH_WORDS - 1));
+	if (function && !function->vector) function->vector = vector;
+
+	return function;
+}
+
+static uint8_t sim_run(uint64_t cycles) {
+	uint64_t end = mock_cycles + cycles;
+
+	while (mock_cycles < end) {
+		uint64_t start = mock_cycles;
+		uint8_t taken = sim_avr_step(&sim_avr) + sim_stall;
+		uint8_t event = sim_avr.event;
+
+		sim_stall = 0;
+		sim_instructions++;
+
+		if (event == SIM_AVR_EVENT_INTERRUPT) {
+			if (sim_level < SIM_LEVELS) sim_level++;
+			sim_frame_push(sim_vector_function(sim_avr.event_address), start, 1);
+		}
+
+		for (uint8_t level = 1; level <= sim_level; level++) sim_level_cycles[level] += taken;
+
+		mock_advance(taken);
+
+		switch (event) {
+			case SIM_AVR_EVENT_CALL: {
+				sim_function_t *function = sim_function_at(sim_avr.event_address);
+
+				if (function == sim_usb_poll) {
+					if (sim_loop_last) sim_stats_add(&sim_loop, start - sim_loop_last);
+					sim_loop_last = start;
+				}
+				sim_frame_push(function, start, 0);
+				break;
+			}
+
+			case SIM_AVR_EVENT_RET:
+			case SIM_AVR_EVENT_RETI:
+				sim_frame_pop();
+				break;
+
+			case SIM_AVR_EVENT_WDR:
+				sim_watchdog_last = mock_cycles;
+				break;
+
+			case SIM_AVR_EVENT_BREAK:
+			case SIM_AVR_EVENT_INVALID:
+				fprintf(stderr, "%.1f ms: %s 0x%04X at 0x%04X\n", MOCK_CYCLES_TO_US(mock_cycles) / 1000,
+					event == SIM_AVR_EVENT_BREAK ? "BREAK" : "unknown opcode", sim_avr.flash[sim_avr.pc], sim_avr.pc * 2);
+				return 0;
+
+			case SIM_AVR_EVENT_BAD_DATA:
+				if (!sim_bad_data++) {
+					sim_bad_data_address = sim_avr.event_address;
+					sim_bad_data_pc = sim_avr.pc;
+				}
+				break;
+		}
+
+		uint16_t sp = sim_avr_sp(&sim_avr);
+		if (sp < sim_sp_min) sim_sp_min = sp;
+
+		// pin changes (PCMSK), whoever made them
+		uint8_t pins = sim_read_pins();
+		if ((pins ^ sim_pins) & sim_io[IO_PCMSK]) sim_io[IO_GIFR] |= (1 << PCIF);
+		sim_pins = pins;
+
+		sim_watchdog();
+		sim_usb_update(&sim_usb, mock_cycles);
+	}
+
+	return 1;
+}
+
+// --- report ---
+
+static int sim_function_compare(const void *a, const void *b) {
+	const sim_function_t *first = *(const sim_function_t **)a, *second = *(const sim_function_t **)b;
+
+	return first->cycles < second->cycles ? 1 : (first->cycles > second->cycles ? -1 : 0);
+}
+
+static void sim_print_functions(uint64_t total, uint8_t all) {
+	sim_function_t *sorted[SIM_FUNCTIONS];
+	uint16_t count = 0, shown = 0;
+
+	for (uint16_t x = 0; x < sim_function_count; x++) {
+		if (sim_functions[x]->calls) sorted[count++] = sim_functions[x];
+	}
+	qsort(sorted, count, sizeof(sorted[0]), sim_function_compare);
+
+	printf("\n%-32s %10s %10s %10s %10s %8s\n", "function (cycles per call)", "calls", "min", "mean", "max", "time");
+	for (uint16_t x = 0; x < count && (all || shown < SIM_TOP_FUNCTIONS); x++) {
+		sim_function_t *function = sorted[x];
+		char name[48];
+
+		if (function->vector) {
+			snprintf(name, sizeof(name), "%s (vector %u)", function->name, function->vector);
+		} else {
+			snprintf(name, sizeof(name), "%s", function->name);
+		}
+
+		printf("%-32s %10u %10llu %10llu %10llu %7.2f%%\n", name, function->calls, (unsigned long long)function->min,
+			(unsigned long long)(function->cycles / function->calls), (unsigned long long)function->max,
+			total ? function->cycles * 100.0 / total : 0);
+		shown++;
+	}
+}
+
+static void sim_print_latency(const mock_controller_event_t *script, uint8_t length) {
+	sim_stats_t latency = { 0 };
+	uint16_t buttons = 0;
+
+	for (uint8_t x = 0; x < length; x++) {
+		uint64_t at = (uint64_t)script[x].at_us * (F_CPU / 1000000.0);
+
+		if (script[x].buttons == buttons) continue;
+		buttons = script[x].buttons;
+
+		for (uint8_t y = 0; y < sim_usb.change_count; y++) {
+			if (sim_usb.changes[y].at >= at) {
+				sim_stats_add(&latency, sim_usb.changes[y].at - at);
+				break;
+			}
+		}
+	}
+
+	if (!latency.count) {
+		printf("%-40s none seen\n", "buttons to report");
+		return;
+	}
+
+	printf("%-40s %llu changes, min %.2f ms, mean %.2f ms, max %.2f ms\n", "buttons to report", (unsigned long long)latency.count,
+		MOCK_CYCLES_TO_US(latency.min) / 1000, MOCK_CYCLES_TO_US(latency.total / latency.count) / 1000,
+		MOCK_CYCLES_TO_US(latency.max) / 1000);
+}
+
+static double sim_host_seconds() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	// after the enumeration (~0.5s): a few presses, long enough for any polling profile
+	static const mock_controller_event_t script[] = {
+		{ 1000000, 1, 0x0010 },	// A
+		{ 1250000, 1, 0x0050 },	// A + B
+		{ 1500000, 1, 0x0000 },
+		{ 1750000, 1, 0x0400 },	// START
+		{ 2000000, 1, 0x0000 },
+		{ 2250000, 1, 0x8001 },	// UP + RIGHT
+		{ 2500000, 1, 0x0000 },
+	};
+	const char *path = NULL, *trace = NULL;
+	double seconds = 3;
+	uint8_t type = MOCK_CONTROLLER_SNES_MINI, all = 0;
+
+	for (int x = 1; x < argc; x++) {
+		if (!strcmp(argv[x], "-s") && x + 1 < argc) seconds = atof(argv[++x]);
+		else if (!strcmp(argv[x], "-t") && x + 1 < argc) trace = argv[++x];
+		else if (!strcmp(argv[x], "-n")) type = MOCK_CONTROLLER_NES_MINI;
+		else if (!strcmp(argv[x], "-a")) all = 1;
+		else if (argv[x][0] != '-') path = argv[x];
+		else {
+			path = NULL; // unknown option
+			break;
+		}
+	}
+
+	if (!path || seconds <= 0) {
+		fprintf(stderr, "usage: %s [-s seconds] [-n] [-a] [-t trace.vcd] main.elf\n", argv[0]);
+		return 2;
+	}
+
+	if (trace && !mock_trace_open(trace)) {
+		fprintf(stderr, "can't write %s\n", trace);
+		return 2;
+	}
+
+	memset(sim_eeprom, 0xFF, sizeof(sim_eeprom)); // erased (then whatever main.elf brings)
+	if (!sim_load(path)) return 2;
+
+	sim_avr.io_read = sim_io_read;
+	sim_avr.io_write = sim_io_write;
+	sim_avr.interrupt = sim_interrupt;
+
+	mock_reset();
+	mock_controller_init(&sim_controller, type);
+	mock_controller_script(&sim_controller, script, sizeof(script) / sizeof(script[0]));
+	mock_i2c_attach(&sim_controller.device);
+	sim_usb_init(&sim_usb);
+	sim_reset(0); // (MCUSR: PORF from mock_reset)
+
+	double host_start = sim_host_seconds();
+	uint8_t ok = sim_run((uint64_t)(seconds * F_CPU));
+	double host_seconds = sim_host_seconds() - host_start;
+	uint64_t total = mock_cycles;
+
+	mock_trace_close();
+
+	printf("%s: %.1f ms simulated, %llu cycles, %llu instructions (%.1f s on this machine)\n\n", path,
+		MOCK_CYCLES_TO_US(total) / 1000, (unsigned long long)total, (unsigned long long)sim_instructions, host_seconds);
+
+	if (sim_loop.count) {
+		printf("%-40s %10llu times, min %llu, mean %llu, max %llu cycles (max %.1f us)\n", "main loop (usbPoll to usbPoll)",
+			(unsigned long long)sim_loop.count, (unsigned long long)sim_loop.min, (unsigned long long)(sim_loop.total / sim_loop.count),
+			(unsigned long long)sim_loop.max, MOCK_CYCLES_TO_US(sim_loop.max));
+	} else {
+		printf("%-40s never called\n", "main loop (usbPoll to usbPoll)");
+	}
+
+	if (sim_usb.configured_at) {
+		printf("%-40s %.1f ms (reset at %.1f ms), polls every %u ms\n", "USB: enumerated at", MOCK_CYCLES_TO_US(sim_usb.configured_at) / 1000,
+			MOCK_CYCLES_TO_US(sim_usb.attached_at) / 1000, sim_usb.interval);
+	} else {
+		printf("%-40s no\n", "USB: enumerated");
+	}
+
+	printf("%-40s %u polls, %u reports, %u transactions, %u NAKs, %u errors, %u disconnects\n", "USB: traffic", sim_usb.polls,
+		sim_usb.reports, sim_usb.transactions, sim_usb.naks, sim_usb.errors, sim_usb.detaches);
+	if (sim_usb.turnaround_max) {
+		printf("%-40s %u - %u bits after the end of the host packet\n", "USB: device answers", sim_usb.turnaround_min, sim_usb.turnaround_max);
+	}
+
+	sim_print_latency(script, sizeof(script) / sizeof(script[0]));
+
+	printf("%-40s 0x%04X, %u bytes from the end of the SRAM\n", "stack: deepest", sim_sp_min, SIM_AVR_RAM_END - 1 - sim_sp_min);
+	printf("%-40s %u writes, %u watchdog resets\n", "EEPROM / watchdog", sim_eeprom_writes, sim_watchdog_resets);
+
+	if (sim_bad_data) {
+		printf("%-40s %u, first 0x%04X at 0x%04X\n", "accesses outside of the SRAM", sim_bad_data, sim_bad_data_address, sim_bad_data_pc * 2);
+	}
+
+	sim_print_functions(total, all);
+
+	return (ok && !sim_bad_data && !sim_watchdog_resets && sim_usb.configured_at) ? 0 : 1;
+}
@@ -0,0 +1,489 @@
+/*
+	Tests of the pieces make bench-sim is made of (make sim-test), the way
+	host/test.c does it for the driver: every failed check is printed, and
+	the exit status is 1 if there was any. No avr-gcc needed, so they run
+	where main.elf can't be built.
+
+	* The ATtiny85 core (sim_avr.c) on small hand-assembled programs: the
+	  results, the flags, the cycles of every instruction kind, the skips,
+	  calls and returns, the stack, the I/O space and the interrupt entry.
+	* The USB host (sim_usb.c): CRC5 / CRC16 against known values, a token
+	  as it goes on the lines, and loopbacks of data packets (what the host
+	  encodes, fed back as the device side, decodes to the same bytes,
+	  stuffed bits included, and a bad CRC is caught).
+	* The cycles of the button mapping (snes_map_buttons), the table lookup
+	  and the original if-chain, hand-assembled (not the avr-gcc output,
+	  there's no avr-gcc here: the usual code for a table index and a 16 bit
+	  load, an SBRC + ORI per button) and checked against the mapping for all
+	  the 65536 button bitmasks. Printed, they're the numbers on the README
+	  until make bench-sim can report the compiled ones.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_usb.c" // the encoder and the decoder are static
+
+static uint32_t test_checks;
+static uint32_t test_failures;
+
+#define test_check(condition, ...) do { \
+	test_checks++; \
+	if (!(condition)) { \
+		test_failures++; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+// the opcodes used here (AVR Instruction Set Manual)
+#define OP_NOP				0x0000
+#define OP_LDI(d, k)		(0xE000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_SUBI(d, k)		(0x5000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_CPI(d, k)		(0x3000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_RR(base, d, r)	((base) | (((r) & 0x10) << 5) | ((d) << 4) | ((r) & 0x0F))
+#define OP_ADD(d, r)		OP_RR(0x0C00, d, r)
+#define OP_ADC(d, r)		OP_RR(0x1C00, d, r)
+#define OP_MOVW(d, r)		(0x0100 | (((d) / 2) << 4) | ((r) / 2))
+#define OP_DEC(d)			(0x940A | ((d) << 4))
+#define OP_BRNE(k)			(0xF401 | (((k) & 0x7F) << 3))
+#define OP_RJMP(k)			(0xC000 | ((k) & 0x0FFF))
+#define OP_RCALL(k)			(0xD000 | ((k) & 0x0FFF))
+#define OP_RET				0x9508
+#define OP_RETI				0x9518
+#define OP_SEI				0x9478
+#define OP_PUSH(r)			(0x920F | ((r) << 4))
+#define OP_POP(d)			(0x900F | ((d) << 4))
+#define OP_LDS(d)			(0x9000 | ((d) << 4)) // + the address
+#define OP_STS(r)			(0x9200 | ((r) << 4)) // + the address
+#define OP_LPM_ZP(d)		(0x9005 | ((d) << 4))
+#define OP_ADIW(d, k)		(0x9600 | (((k) & 0x30) << 2) | ((((d) - 24) / 2) << 4) | ((k) & 0x0F))
+#define OP_SBIW(d, k)		(0x9700 | (((k) & 0x30) << 2) | ((((d) - 24) / 2) << 4) | ((k) & 0x0F))
+#define OP_SBI(a, b)		(0x9A00 | ((a) << 3) | (b))
+#define OP_SBIS(a, b)		(0x9B00 | ((a) << 3) | (b))
+#define OP_IN(d, a)			(0xB000 | (((a) & 0x30) << 5) | ((d) << 4) | ((a) & 0x0F))
+#define OP_OUT(a, r)		(0xB800 | (((a) & 0x30) << 5) | ((r) << 4) | ((a) & 0x0F))
+#define OP_MUL(d, r)		OP_RR(0x9C00, d, r) // no multiplier on this one
+#define OP_MOV(d, r)		OP_RR(0x2C00, d, r)
+#define OP_OR(d, r)			OP_RR(0x2800, d, r)
+#define OP_SWAP(d)			(0x9402 | ((d) << 4))
+#define OP_ANDI(d, k)		(0x7000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_SBCI(d, k)		(0x4000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_ORI(d, k)		(0x6000 | (((k) & 0xF0) << 4) | (((d) - 16) << 4) | ((k) & 0x0F))
+#define OP_SBRC(r, b)		(0xFC00 | ((r) << 4) | (b))
+#define OP_LDD_Z(d, q)		(0x8000 | (((q) & 0x20) << 8) | (((q) & 0x18) << 7) | ((d) << 4) | ((q) & 0x07))
+
+static sim_avr_t test_avr;
+static uint8_t test_io[0x40];
+static uint8_t test_pending_vector;
+
+static uint8_t test_io_read(sim_avr_t *avr, uint8_t address) {
+	return test_io[address];
+}
+
+static void test_io_write(sim_avr_t *avr, uint8_t address, uint8_t value) {
+	test_io[address] = value;
+}
+
+static uint8_t test_interrupt(sim_avr_t *avr) {
+	uint8_t vector = test_pending_vector;
+
+	test_pending_vector = 0;
+	return vector;
+}
+
+// the program at 0, everything else cleared
+static void test_load(const uint16_t *program, uint16_t words) {
+	memset(&test_avr, 0, sizeof(test_avr));
+	memset(test_io, 0, sizeof(test_io));
+	memcpy(test_avr.flash, program, words * sizeof(uint16_t));
+
+	test_avr.io_read = test_io_read;
+	test_avr.io_write = test_io_write;
+	test_avr.interrupt = test_interrupt;
+	test_pending_vector = 0;
+
+	sim_avr_reset(&test_avr);
+}
+
+// runs n instructions, returns their cycles
+static uint32_t test_run(uint16_t n) {
+	uint32_t cycles = 0;
+
+	while (n--) cycles += sim_avr_step(&test_avr);
+	return cycles;
+}
+
+#define test_flag(flag) ((test_avr.data[SIM_AVR_SREG] >> (flag)) & 1)
+
+static void test_arithmetic() {
+	static const uint16_t program[] = {
+		OP_LDI(16, 0xF0), OP_LDI(17, 0x20),
+		OP_ADD(16, 17),		// 0x10, carry
+		OP_ADC(16, 17),		// 0x31 (0x10 + 0x20 + 1)
+		OP_SUBI(16, 0x31),	// 0, zero
+		OP_CPI(16, 0x01),	// 0 - 1: carry, negative
+		OP_MOVW(24, 16),	// r25:r24 = r17:r16
+		OP_LDI(24, 0xFF),
+		OP_ADIW(24, 1),		// 0x20FF + 1
+		OP_SBIW(24, 2),
+	};
+
+	test_load(program, sizeof(program) / 2);
+
+	test_run(3);
+	test_check(test_avr.data[16] == 0x10 && test_flag(SIM_AVR_FLAG_C) && !test_flag(SIM_AVR_FLAG_Z), "ADD: %02X, SREG %02X", test_avr.data[16], test_avr.data[SIM_AVR_SREG]);
+
+	test_run(1);
+	test_check(test_avr.data[16] == 0x31 && !test_flag(SIM_AVR_FLAG_C), "ADC: %02X, SREG %02X", test_avr.data[16], test_avr.data[SIM_AVR_SREG]);
+
+	test_run(1);
+	test_check(test_avr.data[16] == 0 && test_flag(SIM_AVR_FLAG_Z), "SUBI: %02X, SREG %02X", test_avr.data[16], test_avr.data[SIM_AVR_SREG]);
+
+	test_run(1);
+	test_check(test_flag(SIM_AVR_FLAG_C) && test_flag(SIM_AVR_FLAG_N) && !test_flag(SIM_AVR_FLAG_Z), "CPI: SREG %02X", test_avr.data[SIM_AVR_SREG]);
+
+	test_run(2);
+	test_check(test_avr.data[24] == 0xFF && test_avr.data[25] == 0x20, "MOVW + LDI: %02X%02X", test_avr.data[25], test_avr.data[24]);
+
+	uint32_t cycles = test_run(1);
+	test_check(test_avr.data[24] == 0x00 && test_avr.data[25] == 0x21 && cycles == 2, "ADIW: %02X%02X, %u cycles", test_avr.data[25], test_avr.data[24], cycles);
+
+	test_run(1);
+	test_check(test_avr.data[24] == 0xFE && test_avr.data[25] == 0x20, "SBIW: %02X%02X", test_avr.data[25], test_avr.data[24]);
+}
+
+// a counted loop: 1 + (1 + 2) * 2 + (1 + 1) cycles
+static void test_loop() {
+	static const uint16_t program[] = {
+		OP_LDI(16, 3),
+		OP_DEC(16),
+		OP_BRNE(-2),
+		OP_NOP,
+	};
+
+	test_load(program, sizeof(program) / 2);
+
+	uint32_t cycles = test_run(7);
+	test_check(test_avr.data[16] == 0 && test_avr.pc == 3, "loop: r16 %u, pc %u", test_avr.data[16], test_avr.pc);
+	test_check(cycles == 9, "loop: %u cycles, 9 expected", cycles);
+}
+
+static void test_calls() {
+	static const uint16_t program[] = {
+		OP_RCALL(2),		// 0: to 3
+		OP_NOP,				// 1: back here
+		OP_RJMP(-1),		// 2
+		OP_LDI(16, 0xAB),	// 3
+		OP_PUSH(16),
+		OP_POP(17),
+		OP_RET,
+	};
+	uint16_t sp = SIM_AVR_RAM_END - 1;
+
+	test_load(program, sizeof(program) / 2);
+
+	uint32_t cycles = test_run(1);
+	test_check(test_avr.pc == 3 && cycles == 3 && test_avr.event == SIM_AVR_EVENT_CALL && test_avr.event_address == 3,
+		"RCALL: pc %u, %u cycles, event %u", test_avr.pc, cycles, test_avr.event);
+	test_check(sim_avr_sp(&test_avr) == sp - 2 && test_avr.data[sp] == 1 && test_avr.data[sp - 1] == 0,
+		"RCALL: SP %04X, return address %02X %02X", sim_avr_sp(&test_avr), test_avr.data[sp - 1], test_avr.data[sp]);
+
+	cycles = test_run(3);
+	test_check(test_avr.data[17] == 0xAB && sim_avr_sp(&test_avr) == sp - 2 && cycles == 5, "PUSH + POP: r17 %02X, SP %04X, %u cycles",
+		test_avr.data[17], sim_avr_sp(&test_avr), cycles);
+
+	cycles = test_run(1);
+	test_check(test_avr.pc == 1 && sim_avr_sp(&test_avr) == sp && cycles == 4 && test_avr.event == SIM_AVR_EVENT_RET,
+		"RET: pc %u, SP %04X, %u cycles", test_avr.pc, sim_avr_sp(&test_avr), cycles);
+}
+
+// the data space: SRAM (LDS / STS), the I/O space through the callbacks (IN /
+// OUT / SBI / SBIS, the skip over a two word instruction) and LPM
+static void test_memory() {
+	static const uint16_t program[] = {
+		OP_LDI(16, 0x5A),
+		OP_STS(16), 0x0100,
+		OP_LDS(18), 0x0100,
+		OP_OUT(0x18, 16),	// PORTB
+		OP_SBI(0x18, 0),
+		OP_IN(19, 0x18),
+		OP_SBIS(0x18, 0),
+		OP_LDS(20), 0x0100,	// skipped, two words
+		OP_LDI(30, 0x40), OP_LDI(31, 0x00),	// Z = byte 0x40, word 0x20
+		OP_LPM_ZP(21),
+		OP_LPM_ZP(22),
+		OP_LDS(23), 0x0300,	// out of the SRAM
+	};
+
+	test_load(program, sizeof(program) / 2);
+	test_avr.flash[0x20] = 0x1234;
+
+	uint32_t cycles = test_run(3);
+	test_check(test_avr.data[18] == 0x5A && test_avr.data[0x100] == 0x5A && test_avr.pc == 5 && cycles == 5,
+		"STS + LDS: r18 %02X, pc %u, %u cycles", test_avr.data[18], test_avr.pc, cycles);
+
+	cycles = test_run(3);
+	test_check(test_io[0x18] == 0x5B && test_avr.data[19] == 0x5B && cycles == 4, "OUT + SBI + IN: PORTB %02X, r19 %02X, %u cycles",
+		test_io[0x18], test_avr.data[19], cycles);
+
+	cycles = test_run(1);
+	test_check(test_avr.pc == 11 && cycles == 3, "SBIS over LDS: pc %u, %u cycles", test_avr.pc, cycles);
+
+	cycles = test_run(4);
+	test_check(test_avr.data[21] == 0x34 && test_avr.data[22] == 0x12 && test_avr.data[30] == 0x42 && cycles == 8,
+		"LPM Z+: %02X %02X, Z %02X, %u cycles", test_avr.data[21], test_avr.data[22], test_avr.data[30], cycles);
+
+	test_run(1);
+	test_check(test_avr.event == SIM_AVR_EVENT_BAD_DATA && test_avr.event_address == 0x300, "LDS out of the SRAM: event %u, address %04X",
+		test_avr.event, test_avr.event_address);
+}
+
+// SEI lets one more instruction run, then the vector (4 cycles, I cleared),
+// RETI back with I set. An unknown opcode is not run
+static void test_interrupts() {
+	static const uint16_t program[] = {
+		OP_SEI,				// 0
+		OP_LDI(16, 1),		// 1: runs before the interrupt
+		OP_LDI(16, 2),		// 2: after it
+		OP_MUL(16, 17),		// 3
+		OP_NOP,
+		OP_RETI,			// 5: the vector
+	};
+
+	test_load(program, sizeof(program) / 2);
+	test_pending_vector = 5;
+
+	test_run(2);
+	test_check(test_avr.data[16] == 1 && test_avr.pc == 2, "SEI: r16 %u, pc %u", test_avr.data[16], test_avr.pc);
+
+	uint32_t cycles = test_run(1);
+	test_check(test_avr.event == SIM_AVR_EVENT_INTERRUPT && test_avr.pc == 5 && cycles == 4 && !test_flag(SIM_AVR_FLAG_I),
+		"interrupt: event %u, pc %u, %u cycles, SREG %02X", test_avr.event, test_avr.pc, cycles, test_avr.data[SIM_AVR_SREG]);
+
+	cycles = test_run(1);
+	test_check(test_avr.event == SIM_AVR_EVENT_RETI && test_avr.pc == 2 && cycles == 4 && test_flag(SIM_AVR_FLAG_I),
+		"RETI: event %u, pc %u, %u cycles", test_avr.event, test_avr.pc, cycles);
+
+	test_run(2);
+	test_check(test_avr.data[16] == 2 && test_avr.event == SIM_AVR_EVENT_INVALID && test_avr.pc == 3,
+		"MUL: event %u, pc %u", test_avr.event, test_avr.pc);
+}
+
+// the default layout (nesminicontrollerdrv.c): report bit for every bit of the buttons
+static const uint8_t test_layout[16] = { 0, 3, 0xFF, 8, 7, 9, 6, 0xFF, 0xFF, 11, 5, 0xFF, 4, 10, 2, 1 };
+
+static uint16_t test_map(uint16_t buttons) {
+	uint16_t mapped = 0;
+
+	for (uint8_t x = 0; x < 16; x++) {
+		if ((buttons & (1 << x)) && test_layout[x] != 0xFF) mapped |= 1 << test_layout[x];
+	}
+
+	return mapped;
+}
+
+// runs the function at word 2 (called from word 0, the return lands on the loop at
+// word 1) with the buttons in r25:r24, as avr-gcc passes them. Returns its cycles,
+// the call and the return included, and the result (r25:r24) in *mapped
+static uint32_t test_call(uint16_t buttons, uint16_t *mapped) {
+	uint32_t cycles = 0;
+
+	sim_avr_reset(&test_avr);
+	test_avr.data[24] = buttons;
+	test_avr.data[25] = buttons >> 8;
+
+	do cycles += sim_avr_step(&test_avr); while (test_avr.pc != 1 && cycles < 1000);
+
+	*mapped = test_avr.data[24] | (test_avr.data[25] << 8);
+	return cycles;
+}
+
+// runs the loaded mapping for all the bitmasks, checks the results and that it
+// takes the same cycles for every one of them, and prints them
+static void test_mapping_sweep(const char *name) {
+	uint32_t cycles = 0, failures = 0;
+	uint16_t mapped;
+
+	for (uint32_t buttons = 0; buttons < 0x10000; buttons++) {
+		uint32_t taken = test_call(buttons, &mapped);
+
+		if (mapped != test_map(buttons) || (buttons && taken != cycles)) failures++;
+		cycles = taken;
+	}
+
+	test_check(!failures, "%s: %u wrong or with different cycles", name, failures);
+	printf("%-40s %4u cycles (%.1f us), every bitmask\n", name, cycles, cycles * 1e6 / F_CPU);
+}
+
+// the original if-chain (snes_set_report_buttons before the tables): one SBRC + ORI
+// per button into r19:r18, on registers like the table lookup below so the two
+// compare (the original also read the state and wrote the report through pointers)
+static void test_if_chain_cycles() {
+	uint16_t program[2 + 2 + 2 * 16 + 2], words = 0;
+
+	program[words++] = OP_RCALL(1);
+	program[words++] = OP_RJMP(-1);
+	program[words++] = OP_LDI(18, 0);
+	program[words++] = OP_LDI(19, 0);
+
+	for (uint8_t x = 0; x < 16; x++) {
+		if (test_layout[x] == 0xFF) continue;
+
+		program[words++] = OP_SBRC(24 + x / 8, x % 8);
+		program[words++] = OP_ORI(18 + test_layout[x] / 8, 1 << (test_layout[x] % 8));
+	}
+
+	program[words++] = OP_MOVW(24, 18);
+	program[words++] = OP_RET;
+
+	test_load(program, words);
+	test_mapping_sweep("snes_map_buttons, original if-chain");
+}
+
+// the 4 x 16 table of report words at this address
+#define TEST_MAP_TABLE		0x0100
+#define TEST_MINUS_LO(x)	(-(x) & 0xFF)
+#define TEST_MINUS_HI(x)	((-(x) >> 8) & 0xFF)
+
+// one lookup: Z = table + 2 * nibble (the low one of source, or the high one
+// after a SWAP), the word into low:low + 1
+#define TEST_LOOKUP_Z(table, low) \
+	OP_ANDI(30, 0x0F), OP_LDI(31, 0), OP_ADD(30, 30), \
+	OP_SUBI(30, TEST_MINUS_LO(table)), OP_SBCI(31, TEST_MINUS_HI(table)), \
+	OP_LDD_Z(low, 0), OP_LDD_Z((low) + 1, 1)
+#define TEST_LOOKUP(source, table, low)			OP_MOV(30, source), TEST_LOOKUP_Z(table, low)
+#define TEST_LOOKUP_HIGH(source, table, low)	OP_MOV(30, source), OP_SWAP(30), TEST_LOOKUP_Z(table, low)
+
+// the table lookup, snes_map_table[n][nibble n] ORed together
+static void test_mapping_cycles() {
+	static const uint16_t program[] = {
+		OP_RCALL(1),
+		OP_RJMP(-1),
+		TEST_LOOKUP(24, TEST_MAP_TABLE, 18),
+		TEST_LOOKUP_HIGH(24, TEST_MAP_TABLE + 32, 20), OP_OR(18, 20), OP_OR(19, 21),
+		TEST_LOOKUP(25, TEST_MAP_TABLE + 64, 20), OP_OR(18, 20), OP_OR(19, 21),
+		TEST_LOOKUP_HIGH(25, TEST_MAP_TABLE + 96, 20), OP_OR(18, 20), OP_OR(19, 21),
+		OP_MOVW(24, 18),
+		OP_RET,
+	};
+	test_load(program, sizeof(program) / 2);
+
+	// what snes_build_map_table makes of the layout
+	for (uint8_t n = 0; n < 4; n++) {
+		for (uint8_t v = 0; v < 16; v++) {
+			uint16_t word = test_map(v << (4 * n));
+
+			test_avr.data[TEST_MAP_TABLE + 32 * n + 2 * v] = word;
+			test_avr.data[TEST_MAP_TABLE + 32 * n + 2 * v + 1] = word >> 8;
+		}
+	}
+
+	test_mapping_sweep("snes_map_buttons, table lookup");
+}
+
+// NRZI and stuffing undone, straight from the symbols (a second decoder, the
+// test doesn't trust the one in sim_usb.c). Returns the bytes, SYNC included
+static uint8_t test_usb_bytes(const uint8_t *symbols, uint8_t length, uint8_t *bytes) {
+	uint8_t previous = SIM_USB_J, ones = 0, count = 0, bits = 0;
+
+	memset(bytes, 0, 16);
+
+	for (uint8_t x = 0; x < length && symbols[x] != SIM_USB_SE0; x++) {
+		uint8_t bit = symbols[x] == previous;
+
+		previous = symbols[x];
+		if (ones == 6) {
+			ones = 0;
+			continue;
+		}
+		ones = bit ? ones + 1 : 0;
+
+		bytes[count] |= bit << bits;
+		if (++bits == 8) {
+			bits = 0;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// what "from" sends, driven by the device side of "to" (as if it was the
+// firmware): it decodes it when the lines are released
+static void test_usb_loopback(const sim_usb_t *from, sim_usb_t *to) {
+	uint64_t at = 1000;
+
+	for (uint8_t x = 0; x < (*from).tx_length; x++) sim_usb_device(to, at + SIM_USB_BITS(x), SIM_USB_J | SIM_USB_K, (*from).tx[x]);
+	sim_usb_device(to, at + SIM_USB_BITS((*from).tx_length), 0, 0);
+}
+
+static void test_usb() {
+	static sim_usb_t host, device;
+	uint8_t bytes[16];
+
+	// known values (a CRC16 seen on a real bus, the CRC5 of the USB spec examples)
+	static const uint8_t setup[] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 };
+	test_check(sim_usb_crc16(setup, sizeof(setup)) == 0x94DD, "CRC16 of GET_DESCRIPTOR: %04X", sim_usb_crc16(setup, sizeof(setup)));
+	test_check(sim_usb_crc5(0x000) == 0x02, "CRC5 of address 0, endpoint 0: %02X", sim_usb_crc5(0x000));
+	test_check(sim_usb_crc5(0x001) == 0x1D, "CRC5 of address 1, endpoint 0: %02X", sim_usb_crc5(0x001));
+
+	// SETUP to address 0: SYNC, 2D 00 10, then the EOP
+	sim_usb_init(&host);
+	sim_usb_send_token(&host, 0, SIM_USB_PID_SETUP, 0);
+	uint8_t length = test_usb_bytes(host.tx, host.tx_length, bytes);
+	test_check(length == 4 && bytes[0] == SIM_USB_SYNC && bytes[1] == 0x2D && bytes[2] == 0x00 && bytes[3] == 0x10,
+		"SETUP token: %u bytes, %02X %02X %02X %02X", length, bytes[0], bytes[1], bytes[2], bytes[3]);
+	test_check(host.tx[host.tx_length - 3] == SIM_USB_SE0 && host.tx[host.tx_length - 2] == SIM_USB_SE0 && host.tx[host.tx_length - 1] == SIM_USB_J,
+		"SETUP token: no EOP at the end");
+
+	// loopback of a report, the way the host takes it from the device (configured, waiting for data)
+	static const uint8_t report[] = { 0x81, 0x02 };
+	sim_usb_send_data(&host, 0, SIM_USB_PID_DATA1, report, sizeof(report));
+
+	sim_usb_init(&device);
+	device.state = SIM_USB_STATE_CONFIGURED;
+	device.waiting = SIM_USB_WAIT_DATA;
+	test_usb_loopback(&host, &device);
+	test_check(device.errors == 0 && device.transactions == 1 && device.last.length == 2 && !memcmp(device.last.data, report, 2),
+		"report loopback: %u errors, %u transactions, %u bytes %02X %02X", device.errors, device.transactions,
+		device.last.length, device.last.data[0], device.last.data[1]);
+
+	// eight 0xFF: a stuffed bit every six ones
+	static const uint8_t ones[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	sim_usb_send_data(&host, 0, SIM_USB_PID_DATA0, ones, sizeof(ones));
+	test_check(host.tx_length > (1 + 1 + 8 + 2) * 8 + 3 + 8, "0xFF loopback: %u symbols, not stuffed", host.tx_length);
+
+	sim_usb_init(&device);
+	device.state = SIM_USB_STATE_CONFIGURED;
+	device.waiting = SIM_USB_WAIT_DATA;
+	test_usb_loopback(&host, &device);
+	test_check(device.errors == 0 && device.last.length == 8 && !memcmp(device.last.data, ones, 8),
+		"0xFF loopback: %u errors, %u bytes", device.errors, device.last.length);
+
+	// a bit flipped in the data: the CRC catches it
+	sim_usb_send_data(&host, 0, SIM_USB_PID_DATA1, report, sizeof(report));
+	host.tx[20] ^= SIM_USB_J | SIM_USB_K;
+
+	sim_usb_init(&device);
+	device.state = SIM_USB_STATE_CONFIGURED;
+	device.waiting = SIM_USB_WAIT_DATA;
+	test_usb_loopback(&host, &device);
+	test_check(device.errors == 1 && device.transactions == 0, "corrupted loopback: %u errors, %u transactions", device.errors, device.transactions);
+}
+
+int main() {
+	test_arithmetic();
+	test_loop();
+	test_calls();
+	test_memory();
+	test_interrupts();
+	test_usb();
+	test_if_chain_cycles();
+	test_mapping_cycles();
+
+	printf("%u checks, %u failed\n", test_checks, test_failures);
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,482 @@
+/*
+	Host build: low-speed USB host model (see sim_usb.h).
+*/
+
+#include <string.h>
+
+#include "sim_usb.h"
+
+#define SIM_USB_MS				(F_CPU / 1000)
+#define SIM_USB_BITS(n)			((uint64_t)(n) * SIM_USB_BIT_CYCLES)
+
+#define SIM_USB_GAP_BITS		4		// between two packets of the host
+#define SIM_USB_TIMEOUT_BITS	32		// for the device answer (the spec says 16 - 18, some slack here)
+
+#define SIM_USB_STATE_DETACHED		0	// D- pulled low by the device
+#define SIM_USB_STATE_ATTACHING		1	// debounce
+#define SIM_USB_STATE_RESETTING		2
+#define SIM_USB_STATE_ENUMERATING	3
+#define SIM_USB_STATE_CONFIGURED	4
+
+#define SIM_USB_WAIT_NONE		0
+#define SIM_USB_WAIT_HANDSHAKE	1
+#define SIM_USB_WAIT_DATA		2
+
+#define SIM_USB_AFTER_NONE		0
+#define SIM_USB_AFTER_DATA		1		// the data packet of a SETUP / OUT goes next
+#define SIM_USB_AFTER_HANDSHAKE	2		// wait for the ACK / NAK of the device
+#define SIM_USB_AFTER_ANSWER	3		// wait for its DATA0 / DATA1 (or NAK)
+
+// control transfer stages
+#define SIM_USB_STAGE_SETUP		0
+#define SIM_USB_STAGE_DATA_IN	1
+#define SIM_USB_STAGE_STATUS_OUT	2	// after a data stage
+#define SIM_USB_STAGE_STATUS_IN		3	// no data stage
+
+#define SIM_USB_PID_OUT			0xE1
+#define SIM_USB_PID_IN			0x69
+#define SIM_USB_PID_SETUP		0x2D
+#define SIM_USB_PID_DATA0		0xC3
+#define SIM_USB_PID_DATA1		0x4B
+#define SIM_USB_PID_ACK			0xD2
+#define SIM_USB_PID_NAK			0x5A
+#define SIM_USB_PID_STALL		0x1E
+
+#define SIM_USB_SYNC			0x80
+
+// the enumeration, more or less what a PC asks
+static const uint8_t sim_usb_script[][8] = {
+	{ 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 }, // GET_DESCRIPTOR device, 64 bytes (address 0)
+	{ 0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }, // SET_ADDRESS 1
+	{ 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 }, // GET_DESCRIPTOR device
+	{ 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xFF, 0x00 }, // GET_DESCRIPTOR configuration (everything)
+	{ 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 }, // SET_CONFIGURATION 1
+	{ 0x21, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // HID SET_IDLE 0 (only on changes)
+	{ 0x81, 0x06, 0x00, 0x22, 0x00, 0x00, 0xFF, 0x00 }, // GET_DESCRIPTOR HID report
+};
+
+#define SIM_USB_SCRIPT_LENGTH	(sizeof(sim_usb_script) / sizeof(sim_usb_script[0]))
+
+#define SIM_USB_REQUEST_SET_ADDRESS		0x05
+#define SIM_USB_REQUEST_GET_DESCRIPTOR	0x06
+#define SIM_USB_DESCRIPTOR_CONFIGURATION	0x02
+#define SIM_USB_DESCRIPTOR_ENDPOINT		0x05
+
+static uint8_t sim_usb_crc5(uint16_t value) {
+	uint8_t crc = 0x1F;
+
+	for (uint8_t bit = 0; bit < 11; bit++) {
+		crc = ((crc ^ (value >> bit)) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+	}
+
+	return ~crc & 0x1F;
+}
+
+static uint16_t sim_usb_crc16(const uint8_t *data, uint8_t length) {
+	uint16_t crc = 0xFFFF;
+
+	for (uint8_t x = 0; x < length; x++) {
+		crc ^= data[x];
+		for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+
+	return ~crc;
+}
+
+// SYNC + the bytes (PID first), NRZI with bit stuffing, then the EOP. Out at "at"
+static void sim_usb_send(sim_usb_t *usb, uint64_t at, const uint8_t *bytes, uint8_t length) {
+	uint8_t line = SIM_USB_J, ones = 0;
+
+	usb->tx_length = 0;
+	usb->tx_start = at;
+
+	for (int16_t x = -1; x < length; x++) {
+		uint8_t byte = x < 0 ? SIM_USB_SYNC : bytes[x];
+
+		for (uint8_t bit = 0; bit < 8; bit++) {
+			if ((byte >> bit) & 1) { // 1: the line stays
+				usb->tx[usb->tx_length++] = line;
+				if (++ones < 6) continue;
+			}
+
+			// 0 (or the 0 stuffed after six 1s): the line changes
+			line ^= SIM_USB_J | SIM_USB_K;
+			usb->tx[usb->tx_length++] = line;
+			ones = 0;
+		}
+	}
+
+	usb->tx[usb->tx_length++] = SIM_USB_SE0;
+	usb->tx[usb->tx_length++] = SIM_USB_SE0;
+	usb->tx[usb->tx_length++] = SIM_USB_J;
+}
+
+static void sim_usb_send_token(sim_usb_t *usb, uint64_t at, uint8_t pid, uint8_t endpoint) {
+	uint16_t value = usb->address | (endpoint << 7);
+
+	value |= sim_usb_crc5(value) << 11;
+
+	uint8_t bytes[3] = { pid, value, value >> 8 };
+	sim_usb_send(usb, at, bytes, sizeof(bytes));
+}
+
+static void sim_usb_send_data(sim_usb_t *usb, uint64_t at, uint8_t pid, const uint8_t *data, uint8_t length) {
+	uint8_t bytes[1 + 8 + 2];
+	uint16_t crc = sim_usb_crc16(data, length);
+
+	bytes[0] = pid;
+	memcpy(&bytes[1], data, length);
+	bytes[1 + length] = crc;
+	bytes[2 + length] = crc >> 8;
+
+	sim_usb_send(usb, at, bytes, length + 3);
+}
+
+static void sim_usb_send_handshake(sim_usb_t *usb, uint64_t at, uint8_t pid) {
+	sim_usb_send(usb, at, &pid, 1);
+}
+
+static uint8_t sim_usb_sending(const sim_usb_t *usb, uint64_t now) {
+	return usb->tx_length && now < usb->tx_start + SIM_USB_BITS(usb->tx_length);
+}
+
+static void sim_usb_idle(sim_usb_t *usb) {
+	usb->tx_length = 0;
+	usb->waiting = SIM_USB_WAIT_NONE;
+	usb->after_tx = SIM_USB_AFTER_NONE;
+	usb->transaction_at = 0;
+}
+
+// bInterval of the first endpoint in the configuration descriptor
+static void sim_usb_find_interval(sim_usb_t *usb) {
+	for (uint16_t x = 0; x + 6 < usb->received && usb->data[x]; x += usb->data[x]) {
+		if (usb->data[x + 1] == SIM_USB_DESCRIPTOR_ENDPOINT) {
+			usb->interval = usb->data[x + 6] ? usb->data[x + 6] : 1;
+			return;
+		}
+	}
+}
+
+static void sim_usb_transfer_done(sim_usb_t *usb, uint64_t now) {
+	const uint8_t *setup = sim_usb_script[usb->request];
+
+	if (setup[1] == SIM_USB_REQUEST_SET_ADDRESS) usb->address = setup[2];
+	if (setup[1] == SIM_USB_REQUEST_GET_DESCRIPTOR && setup[3] == SIM_USB_DESCRIPTOR_CONFIGURATION) sim_usb_find_interval(usb);
+
+	usb->stage = SIM_USB_STAGE_SETUP;
+	usb->received = 0;
+
+	if (++usb->request == SIM_USB_SCRIPT_LENGTH) {
+		usb->state = SIM_USB_STATE_CONFIGURED;
+		usb->configured_at = now;
+		usb->poll_frames = usb->interval; // first poll right away
+	}
+}
+
+static void sim_usb_report(sim_usb_t *usb, uint64_t now, const uint8_t *data, uint8_t length) {
+	if (length > SIM_USB_REPORT_LENGTH) length = SIM_USB_REPORT_LENGTH;
+
+	usb->reports++;
+
+	if (usb->reports > 1 && length == usb->last.length && !memcmp(data, usb->last.data, length)) return;
+
+	usb->last.at = now;
+	usb->last.length = length;
+	memcpy(usb->last.data, data, length);
+
+	if (usb->change_count < SIM_USB_REPORTS) usb->changes[usb->change_count++] = usb->last;
+}
+
+// a packet from the device (PID first, no SYNC), while waiting for one
+static void sim_usb_packet(sim_usb_t *usb, uint64_t now, const uint8_t *bytes, uint8_t length) {
+	uint8_t waiting = usb->waiting, pid = bytes[0];
+
+	usb->waiting = SIM_USB_WAIT_NONE;
+
+	if (waiting == SIM_USB_WAIT_NONE) {
+		usb->errors++; // talking out of turn
+		return;
+	}
+
+	if (pid == SIM_USB_PID_NAK) {
+		usb->naks++;
+		return;
+	}
+
+	// not supported: the request is skipped
+	if (pid == SIM_USB_PID_STALL) {
+		usb->errors++;
+		if (usb->state == SIM_USB_STATE_ENUMERATING) sim_usb_transfer_done(usb, now);
+		return;
+	}
+
+	if (waiting == SIM_USB_WAIT_HANDSHAKE) {
+		if (pid != SIM_USB_PID_ACK) {
+			usb->errors++;
+			return;
+		}
+
+		usb->transactions++;
+		if (usb->state != SIM_USB_STATE_ENUMERATING) return;
+
+		if (usb->stage == SIM_USB_STAGE_SETUP) {
+			const uint8_t *setup = sim_usb_script[usb->request];
+			usb->stage = ((setup[0] & 0x80) && (setup[6] || setup[7])) ? SIM_USB_STAGE_DATA_IN : SIM_USB_STAGE_STATUS_IN;
+		} else {
+			sim_usb_transfer_done(usb, now); // the status OUT
+		}
+		return;
+	}
+
+	// data: DATA0 / DATA1 with a good CRC, ACKed
+	if ((pid != SIM_USB_PID_DATA0 && pid != SIM_USB_PID_DATA1) || length < 3 || length > 11 ||
+		sim_usb_crc16(&bytes[1], length - 3) != (bytes[length - 2] | (bytes[length - 1] << 8))) {
+		usb->errors++;
+		return;
+	}
+
+	const uint8_t *data = &bytes[1];
+	uint8_t data_length = length - 3;
+
+	usb->transactions++;
+	sim_usb_send_handshake(usb, now + SIM_USB_BITS(2), SIM_USB_PID_ACK);
+
+	if (usb->state == SIM_USB_STATE_CONFIGURED) {
+		sim_usb_report(usb, now, data, data_length);
+		return;
+	}
+
+	if (usb->stage == SIM_USB_STAGE_STATUS_IN) {
+		sim_usb_transfer_done(usb, now);
+		return;
+	}
+
+	const uint8_t *setup = sim_usb_script[usb->request];
+	uint16_t wanted = setup[6] | (setup[7] << 8);
+
+	for (uint8_t x = 0; x < data_length && usb->received < sizeof(usb->data); x++) usb->data[usb->received++] = data[x];
+	if (data_length < 8 || usb->received >= wanted) usb->stage = SIM_USB_STAGE_STATUS_OUT;
+}
+
+// what the device sent, from its line changes: every segment between two changes
+// is a number of bits (resynchronized on each edge), NRZI and stuffing undone
+static void sim_usb_decode(sim_usb_t *usb, uint64_t end) {
+	uint8_t bytes[16], length = 0, byte = 0, bits = 0, ones = 0, previous = SIM_USB_J;
+	uint8_t first;
+
+	for (first = 0; first < usb->rx_changes && usb->rx_lines[first] == SIM_USB_J; first++);
+
+	for (uint8_t x = first; x < usb->rx_changes; x++) {
+		uint8_t line = usb->rx_lines[x];
+		uint64_t length_cycles = (x + 1 < usb->rx_changes ? usb->rx_at[x + 1] : end) - usb->rx_at[x];
+		uint16_t count = (length_cycles + SIM_USB_BIT_CYCLES / 2) / SIM_USB_BIT_CYCLES;
+
+		if (line == SIM_USB_SE0) break; // EOP
+		if (line != SIM_USB_J && line != SIM_USB_K) {
+			usb->errors++; // SE1
+			return;
+		}
+
+		for (uint16_t n = 0; n < count; n++) {
+			uint8_t bit = (line == previous);
+			previous = line;
+
+			if (ones == 6) { // stuffed bit
+				ones = 0;
+				if (bit) {
+					usb->errors++;
+					return;
+				}
+				continue;
+			}
+
+			ones = bit ? ones + 1 : 0;
+			byte |= bit << bits;
+
+			if (++bits == 8) {
+				if (length == sizeof(bytes)) {
+					usb->errors++;
+					return;
+				}
+				bytes[length++] = byte;
+				byte = bits = 0;
+			}
+		}
+	}
+
+	if (length < 2 || bytes[0] != SIM_USB_SYNC || (bytes[1] & 0x0F) != (~bytes[1] >> 4 & 0x0F)) {
+		usb->errors++;
+		return;
+	}
+
+	sim_usb_packet(usb, end, &bytes[1], length - 1);
+}
+
+void sim_usb_init(sim_usb_t *usb) {
+	memset(usb, 0, sizeof(*usb));
+
+	// plugged at power-on: the pull-up on D- is there from the start
+	usb->state = SIM_USB_STATE_ATTACHING;
+	usb->timer = 100 * SIM_USB_MS;
+	usb->interval = 10;
+	usb->turnaround_min = 0xFF;
+}
+
+uint8_t sim_usb_lines(const sim_usb_t *usb, uint64_t now) {
+	if (now < usb->reset_until) return SIM_USB_SE0;
+
+	if (usb->tx_length && now >= usb->tx_start) {
+		uint64_t symbol = (now - usb->tx_start) / SIM_USB_BIT_CYCLES;
+		if (symbol < usb->tx_length) return usb->tx[symbol];
+	}
+
+	return SIM_USB_J;
+}
+
+void sim_usb_device(sim_usb_t *usb, uint64_t now, uint8_t outputs, uint8_t levels) {
+	if (outputs == (SIM_USB_J | SIM_USB_K)) {
+		if (!usb->device_driving) {
+			usb->device_driving = 1;
+			usb->rx_changes = 0;
+
+			if (usb->waiting != SIM_USB_WAIT_NONE) {
+				// from the end of the host packet (its EOP included)
+				uint8_t bits = (now - (usb->wait_until - SIM_USB_BITS(SIM_USB_TIMEOUT_BITS))) / SIM_USB_BIT_CYCLES;
+				if (bits < usb->turnaround_min) usb->turnaround_min = bits;
+				if (bits > usb->turnaround_max) usb->turnaround_max = bits;
+			}
+		}
+
+		if ((!usb->rx_changes || usb->rx_lines[usb->rx_changes - 1] != levels) && usb->rx_changes < SIM_USB_RX_CHANGES) {
+			usb->rx_at[usb->rx_changes] = now;
+			usb->rx_lines[usb->rx_changes++] = levels;
+		}
+		return;
+	}
+
+	if (usb->device_driving) {
+		usb->device_driving = 0;
+		sim_usb_decode(usb, now);
+	}
+
+	// usbDeviceDisconnect: D- driven low. The host sees it gone, and back once released
+	uint8_t detached = (outputs & SIM_USB_J) && !(levels & SIM_USB_J);
+
+	if (detached && !usb->detached) {
+		usb->detaches++;
+		usb->state = SIM_USB_STATE_DETACHED;
+		usb->address = 0;
+		usb->reset_until = 0;
+		sim_usb_idle(usb);
+	} else if (!detached && usb->detached) {
+		usb->state = SIM_USB_STATE_ATTACHING;
+		usb->timer = now + 100 * SIM_USB_MS;
+	}
+
+	usb->detached = detached;
+}
+
+void sim_usb_update(sim_usb_t *usb, uint64_t now) {
+	switch (usb->state) {
+		case SIM_USB_STATE_DETACHED:
+			return;
+
+		case SIM_USB_STATE_ATTACHING:
+			if (now < usb->timer) return;
+
+			usb->state = SIM_USB_STATE_RESETTING;
+			usb->reset_until = now + 10 * SIM_USB_MS;
+			usb->attached_at = now;
+			return;
+
+		case SIM_USB_STATE_RESETTING:
+			if (now < usb->reset_until) return;
+
+			usb->state = SIM_USB_STATE_ENUMERATING;
+			usb->address = 0;
+			usb->request = 0;
+			usb->stage = SIM_USB_STAGE_SETUP;
+			usb->received = 0;
+			usb->frame_next = now;
+			sim_usb_idle(usb);
+			break;
+	}
+
+	if (sim_usb_sending(usb, now) || usb->device_driving) return;
+
+	// the packet of the host is out
+	if (usb->tx_length) {
+		uint64_t end = usb->tx_start + SIM_USB_BITS(usb->tx_length);
+		uint8_t after = usb->after_tx;
+
+		usb->tx_length = 0;
+		usb->after_tx = SIM_USB_AFTER_NONE;
+
+		switch (after) {
+			case SIM_USB_AFTER_DATA: {
+				const uint8_t *setup = sim_usb_script[usb->request];
+
+				usb->after_tx = SIM_USB_AFTER_HANDSHAKE;
+				if (usb->stage == SIM_USB_STAGE_SETUP) sim_usb_send_data(usb, end + SIM_USB_BITS(SIM_USB_GAP_BITS), SIM_USB_PID_DATA0, setup, 8);
+				else sim_usb_send_data(usb, end + SIM_USB_BITS(SIM_USB_GAP_BITS), SIM_USB_PID_DATA1, NULL, 0);
+				return;
+			}
+
+			case SIM_USB_AFTER_HANDSHAKE:
+			case SIM_USB_AFTER_ANSWER:
+				usb->waiting = after == SIM_USB_AFTER_HANDSHAKE ? SIM_USB_WAIT_HANDSHAKE : SIM_USB_WAIT_DATA;
+				usb->wait_until = end + SIM_USB_BITS(SIM_USB_TIMEOUT_BITS);
+				return;
+		}
+	}
+
+	if (usb->waiting != SIM_USB_WAIT_NONE) {
+		if (now < usb->wait_until) return;
+
+		usb->waiting = SIM_USB_WAIT_NONE;
+		usb->errors++; // no answer, again on the next frame
+	}
+
+	// a new frame: keep-alive EOP, and a transaction right after it
+	if (now >= usb->frame_next) {
+		usb->frame_next += SIM_USB_MS;
+		usb->frames++;
+
+		uint8_t keep_alive[3] = { SIM_USB_SE0, SIM_USB_SE0, SIM_USB_J };
+		memcpy(usb->tx, keep_alive, sizeof(keep_alive));
+		usb->tx_length = sizeof(keep_alive);
+		usb->tx_start = now;
+		usb->transaction_at = now + SIM_USB_BITS(sizeof(keep_alive) + SIM_USB_GAP_BITS);
+		return;
+	}
+
+	if (!usb->transaction_at || now < usb->transaction_at) return;
+	usb->transaction_at = 0;
+
+	if (usb->state == SIM_USB_STATE_CONFIGURED) {
+		if (++usb->poll_frames < usb->interval) return;
+
+		usb->poll_frames = 0;
+		usb->polls++;
+		usb->after_tx = SIM_USB_AFTER_ANSWER;
+		sim_usb_send_token(usb, now, SIM_USB_PID_IN, 1);
+		return;
+	}
+
+	switch (usb->stage) {
+		case SIM_USB_STAGE_SETUP:
+			usb->after_tx = SIM_USB_AFTER_DATA;
+			sim_usb_send_token(usb, now, SIM_USB_PID_SETUP, 0);
+			break;
+
+		case SIM_USB_STAGE_STATUS_OUT:
+			usb->after_tx = SIM_USB_AFTER_DATA;
+			sim_usb_send_token(usb, now, SIM_USB_PID_OUT, 0);
+			break;
+
+		default: // data or status IN
+			usb->after_tx = SIM_USB_AFTER_ANSWER;
+			sim_usb_send_token(usb, now, SIM_USB_PID_IN, 0);
+			break;
+	}
+}
@@ -0,0 +1,110 @@
+/*
+	Host build: a low-speed USB host on the D+ / D- lines of the simulated
+	ATtiny85 (host/sim_bench.c), at the bit level: J / K / SE0 every
+	F_CPU / 1.5MHz cycles (11 at 16.5MHz), NRZI, bit stuffing, CRC5 / CRC16.
+
+	What it does, as a (patient) PC would:
+
+	* Waits for the device: 100ms after it stops pulling D- low (the
+	  disconnect of usb_reenumerate) it resets the bus (10ms of SE0) and
+	  starts the frames, a keep-alive EOP every 1ms.
+	* Enumerates it with a fixed script of control transfers: the device
+	  descriptor, SET_ADDRESS, the configuration descriptor (bInterval comes
+	  from there), SET_CONFIGURATION, SET_IDLE and the HID report descriptor.
+	  At most one transaction per frame, NAKs and missing answers are
+	  retried on the next one.
+	* Then polls the interrupt endpoint every bInterval frames, and keeps
+	  the reports that change (with their time).
+
+	The device side is decoded from what the firmware drives on the pins
+	(both lines outputs = transmitting), resynchronized on every edge.
+	Anything that doesn't decode as a packet, or a missing answer, is
+	counted as an error.
+*/
+
+#ifndef SIM_USB_H
+#define SIM_USB_H
+
+#include <stdint.h>
+
+// line states (bit 0: D-, bit 1: D+), J / K for low speed
+#define SIM_USB_SE0				0
+#define SIM_USB_J				1
+#define SIM_USB_K				2
+
+#define SIM_USB_BIT_CYCLES		((F_CPU + 750000) / 1500000)
+
+#define SIM_USB_TX_SYMBOLS		160		// longest packet: SYNC, PID, 8 bytes, CRC16, stuffing, EOP
+#define SIM_USB_RX_CHANGES		160
+#define SIM_USB_REPORTS			64		// changes kept
+#define SIM_USB_REPORT_LENGTH	8
+
+typedef struct {
+	uint64_t	at;						// cycles
+	uint8_t		length;
+	uint8_t		data[SIM_USB_REPORT_LENGTH];
+} sim_usb_report_t;
+
+typedef struct {
+	uint8_t		state;
+	uint64_t	timer;					// when the current state is over (attach debounce, reset)
+	uint8_t		address;
+
+	// frames and transactions
+	uint64_t	frame_next;
+	uint32_t	frames;
+	uint64_t	transaction_at;			// when this frame's transaction starts (0 = done for this frame)
+	uint8_t		waiting;				// what the host expects from the device (SIM_USB_WAIT_*)
+	uint64_t	wait_until;
+	uint8_t		after_tx;				// what to do once the current packet is out (SIM_USB_AFTER_*)
+
+	// the control transfer running (index in the script) and its stage
+	uint8_t		request;
+	uint8_t		stage;
+	uint16_t	received;
+	uint8_t		data[256];				// what it got in the data stage
+	uint8_t		interval;				// ms, from the endpoint descriptor
+	uint8_t		poll_frames;
+
+	// host side of the lines
+	uint8_t		tx[SIM_USB_TX_SYMBOLS];
+	uint8_t		tx_length;
+	uint64_t	tx_start;
+	uint64_t	reset_until;			// SE0 until then
+
+	// device side
+	uint8_t		device_lines;			// what it drives (SIM_USB_*), when driving
+	uint8_t		device_driving;
+	uint8_t		detached;				// D- pulled low
+	uint64_t	rx_at[SIM_USB_RX_CHANGES];
+	uint8_t		rx_lines[SIM_USB_RX_CHANGES];
+	uint8_t		rx_changes;
+
+	// results
+	uint64_t	attached_at;			// last reset (0 = not yet)
+	uint64_t	configured_at;			// end of the script (0 = not yet)
+	uint32_t	transactions;
+	uint32_t	naks;
+	uint32_t	errors;					// timeouts, garbage, unexpected answers
+	uint32_t	detaches;
+	uint32_t	polls;
+	uint32_t	reports;
+	uint8_t		turnaround_min;			// bits from the end of the host packet to the device answer
+	uint8_t		turnaround_max;
+	sim_usb_report_t	changes[SIM_USB_REPORTS];
+	uint8_t		change_count;
+	sim_usb_report_t	last;
+} sim_usb_t;
+
+void sim_usb_init(sim_usb_t *usb);
+
+// what the host puts on the lines now (SIM_USB_*), for the pins the device doesn't drive
+uint8_t sim_usb_lines(const sim_usb_t *usb, uint64_t now);
+
+// the device side changed: which lines are outputs and their levels (bit 0: D-, bit 1: D+)
+void sim_usb_device(sim_usb_t *usb, uint64_t now, uint8_t outputs, uint8_t levels);
+
+// lets the host do its thing (call it often: every instruction)
+void sim_usb_update(sim_usb_t *usb, uint64_t now);
+
+#endif
@@ -0,0 +1,669 @@
+/*
+	Host build tests (make test): the driver compiled natively against the
+	simulated registers of host/mock_avr.c, like the benchmarks, but checking
+	results instead of timing them. Every failed check is printed, and the exit
+	status is 1 if there was any.
+
+	* The button mapping (snes_map_buttons) against straightforward versions
+	  of it, for all the 65536 button bitmasks and a bunch of layouts: the
+	  default one against the mapping it replaced (one if per button, fixed
+	  layout) and every layout against a bit by bit loop over the layout.
+	* The layouts themselves: a few by hand (what a button ends up as), the
+	  invalid entries going nowhere and the buttons a NES Mini report (one
+	  byte) can carry.
+	* When the sampler lets a report go (sampler_report_due), with made up
+	  ticks and host polls.
+	* The latch of the oversampled reads (sampler_latch): a press held through
+	  the whole window, a release in the middle of it and short glitches,
+	  what each report gets.
+	* The button event queue (SAMPLER_EVENTS, on for the whole file too):
+	  the order after the indexes wrap around, what's dropped when it's full
+	  and a batch cut short by the request length.
+	* When a new report is sent and what's in it (report.c, the part of the
+	  main loop that builds the reports): changes, the idle rate, the forced
+	  ones and the length for each controller.
+	* The connection retries (snes_update_connection) with a controller on
+	  the simulated bus (host/mock_controller.c) that connects and then
+	  doesn't read right, and the connection itself split in short steps.
+	* The repeated start probe with nothing pressed, where the buttons alone
+	  can't tell a real read from a failed one.
+	* The blocking transfers clocked by Timer0 (I2C_TIMER0_CLOCK, on for
+	  the whole file): the reads, the fallback before sei and a stuck SCL.
+*/
+
+#include <stdio.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "mock_avr.h"
+#include "mock_controller.h"
+
+typedef unsigned char uchar; // usbdrv.h
+
+// the blocking transfers clocked by Timer0 here (the build option, see
+// test_timer0_clock), the benchmarks cover the default software strobe
+#define I2C_TIMER0_CLOCK 1
+
+#include "nesminicontrollerdrv.c"
+
+static uchar test_usb_ready; // the interrupt buffer was drained
+#define usbInterruptIsReady() test_usb_ready
+
+// the event queue on too (see test_events)
+#define SAMPLER_EVENTS 1
+
+#include "sampler.c"
+#include "report.c"
+
+static uint32_t test_checks;
+static uint32_t test_failures;
+
+#define test_check(condition, ...) do { \
+	test_checks++; \
+	if (!(condition)) { \
+		test_failures++; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+// fresh adapter, nothing in the EEPROM (the default layout), the bus at 100kHz
+// with no repeated start (a connection in an earlier test may have changed them),
+// interrupts on (Timer1 for the ticks, the background I2C transactions)
+static void test_reset() {
+	mock_reset();
+	i2c_speed = I2C_SPEED_STANDARD;
+	i2c_set_repeated_start(0);
+	diagnostics_init();
+	memset(snes_layout_eeprom, 0xFF, sizeof(snes_layout_eeprom));
+	snes_layout_magic_eeprom = 0xFF;
+	snes_init();
+	sei();
+}
+
+// the mapping before the layouts (snes_set_report_buttons on the
+// original code), default layout only
+static uint16_t test_map_original(uint16_t buttons) {
+	snes_report_t report = { 0 };
+
+	if (buttons & NES_BUTTON_UP) report.commonButtonMask = 0x01;
+	if (buttons & NES_BUTTON_RIGHT) report.commonButtonMask |= (0x01 << 1);
+	if (buttons & NES_BUTTON_DOWN) report.commonButtonMask |= (0x01 << 2);
+	if (buttons & NES_BUTTON_LEFT) report.commonButtonMask |= (0x01 << 3);
+
+	if (buttons & NES_BUTTON_SELECT) report.commonButtonMask |= (0x01 << 4);
+	if (buttons & NES_BUTTON_START) report.commonButtonMask |= (0x01 << 5);
+
+	if (buttons & NES_BUTTON_B) report.commonButtonMask |= (0x01 << 6);
+	if (buttons & NES_BUTTON_A) report.commonButtonMask |= (0x01 << 7);
+
+	if (buttons & NES_BUTTON_X) report.snesButtonMask = 0x01;
+	if (buttons & NES_BUTTON_Y) report.snesButtonMask |= (0x01 << 1);
+
+	if (buttons & NES_BUTTON_L) report.snesButtonMask |= (0x01 << 2);
+	if (buttons & NES_BUTTON_R) report.snesButtonMask |= (0x01 << 3);
+
+	return report.commonButtonMask | (report.snesButtonMask << 8);
+}
+
+// any layout, one bit at a time (report bits past the 12 buttons go nowhere)
+static uint16_t test_map_loop(const uint8_t *layout, uint16_t buttons) {
+	uint16_t mapped = 0;
+
+	for (uint8_t bit = 0; bit < SNES_LAYOUT_LENGTH; bit++) {
+		if ((buttons & (1 << bit)) && layout[bit] < 12) mapped |= 1 << layout[bit];
+	}
+
+	return mapped;
+}
+
+static uint16_t test_map(uint16_t buttons) {
+	snes_report_t report;
+
+	snes_map_buttons(buttons, &report);
+	return report.commonButtonMask | (report.snesButtonMask << 8);
+}
+
+// every bitmask with the layout (as set, NULL for the default one) against
+// test_map_loop (and the original mapping too, for the default layout). One
+// failure per layout is enough
+static void test_mapping_all(const char *name, const uint8_t *layout) {
+	uint8_t original = !layout;
+
+	if (original) layout = snes_layout;
+
+	for (uint32_t buttons = 0; buttons < 0x10000; buttons++) {
+		uint16_t mapped = test_map(buttons);
+		uint16_t expected = test_map_loop(layout, buttons);
+
+		if (original && expected != test_map_original(buttons)) {
+			test_check(0, "%s: buttons %04X, the bit loop gives %04X, the original mapping %04X", name, buttons, expected, test_map_original(buttons));
+			return;
+		}
+
+		if (mapped != expected) {
+			test_check(0, "%s: buttons %04X mapped to %04X, expected %04X", name, buttons, mapped, expected);
+			return;
+		}
+	}
+
+	test_check(1, "%s", name);
+}
+
+static void test_mapping() {
+	uint8_t layout[SNES_LAYOUT_LENGTH];
+	char name[48];
+	uint32_t seed = 12345;
+
+	test_reset();
+	test_mapping_all("default layout", NULL);
+
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = x;
+	snes_set_layout(layout);
+	test_mapping_all("identity layout", layout);
+
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = SNES_LAYOUT_LENGTH - 1 - x;
+	snes_set_layout(layout);
+	test_mapping_all("reversed layout", layout);
+
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = SNES_LAYOUT_NONE;
+	snes_set_layout(layout);
+	test_mapping_all("empty layout", layout);
+
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = 0;
+	snes_set_layout(layout);
+	test_mapping_all("every button on bit 0", layout);
+
+	// shuffled ones (the same every run), some buttons going nowhere
+	for (uint8_t round = 0; round < 8; round++) {
+		for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = x;
+
+		for (uint8_t x = SNES_LAYOUT_LENGTH - 1; x > 0; x--) {
+			seed = seed * 1103515245 + 12345;
+			uint8_t y = (seed >> 16) % (x + 1), swap = layout[x];
+			layout[x] = layout[y];
+			layout[y] = swap;
+		}
+
+		layout[round] = SNES_LAYOUT_NONE;
+
+		snes_set_layout(layout);
+		snprintf(name, sizeof(name), "shuffled layout %u", round);
+		test_mapping_all(name, layout);
+	}
+}
+
+static void test_layouts() {
+	uint8_t layout[SNES_LAYOUT_LENGTH];
+
+	test_reset();
+
+	// A and B swapped, X on nothing
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = snes_layout[x];
+	layout[4] = snes_layout[6]; // 0x0010 A
+	layout[6] = snes_layout[4]; // 0x0040 B
+	layout[3] = SNES_LAYOUT_NONE; // 0x0008 X
+	snes_set_layout(layout);
+
+	test_check(test_map(NES_BUTTON_A) == 0x40, "A/B swapped: A mapped to %04X", test_map(NES_BUTTON_A));
+	test_check(test_map(NES_BUTTON_B) == 0x80, "A/B swapped: B mapped to %04X", test_map(NES_BUTTON_B));
+	test_check(test_map(NES_BUTTON_X) == 0, "X on nothing: mapped to %04X", test_map(NES_BUTTON_X));
+	test_check(test_map(NES_BUTTON_A | NES_BUTTON_X | NES_BUTTON_Y) == 0x240, "A/B swapped: A+X+Y mapped to %04X", test_map(NES_BUTTON_A | NES_BUTTON_X | NES_BUTTON_Y));
+
+	// report bits 12-15 are padding and anything past 15 isn't a bit: no button
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = 12 + x;
+	layout[0] = 11;
+	snes_set_layout(layout);
+
+	test_check(snes_layout[0] == 11, "report bit 11 not accepted (%u)", snes_layout[0]);
+
+	for (uint8_t x = 1; x < SNES_LAYOUT_LENGTH; x++) {
+		test_check(snes_layout[x] == SNES_LAYOUT_NONE, "invalid entry %u (%u) kept as %u", x, layout[x], snes_layout[x]);
+	}
+
+	test_check(test_map(0xFFFF) == (1 << 11), "invalid entries: everything mapped to %04X", test_map(0xFFFF));
+
+	// the same from the EEPROM (saved by an older version)
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) snes_layout_eeprom[x] = 15;
+	snes_layout_magic_eeprom = SNES_LAYOUT_MAGIC;
+	snes_init();
+	test_check(test_map(0xFFFF) == 0, "invalid EEPROM layout: everything mapped to %04X", test_map(0xFFFF));
+
+	// a NES Mini report is the first byte only: with the default layout all
+	// its buttons are there, one moved to bit 8 or more is gone
+	test_reset();
+	test_check(!(test_map((NES_BUTTON_ALL & ~NES_BUTTON_SNES_ONLY)) & 0xFF00), "default layout: NES buttons mapped to %04X", test_map((NES_BUTTON_ALL & ~NES_BUTTON_SNES_ONLY)));
+
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) layout[x] = snes_layout[x];
+	layout[4] = 9; // 0x0010 A
+	snes_set_layout(layout);
+
+	snes_report_t report;
+	snes_map_buttons(NES_BUTTON_A, &report);
+	test_check(report.commonButtonMask == 0, "A on bit 9: NES byte %02X", report.commonButtonMask);
+}
+
+// with the phase known the report waits for the final read before the poll,
+// without it (or without a controller) it goes right away
+static void test_sampler() {
+	uint16_t now = 1000;
+
+	sampler_init(20);
+	test_check(sampler_report_due(now), "not locked: report held");
+
+	// a report taken by the host: locked, the next poll one period later
+	sampler_queued(0);
+	test_usb_ready = 1;
+	sampler_update(now);
+	test_check(sampler_locked, "drain seen, not locked");
+	test_check(!sampler_report_due(now), "right after the drain: report due");
+
+	// a read in between
+	now += sampler_read_spacing;
+	sampler_update(now);
+	test_check(sampler_should_start(now), "read in between not started");
+	sampler_read_started(now);
+	now += 10;
+	sampler_read_done(now);
+	sampler_latch(NES_BUTTON_A);
+	test_check(!sampler_report_due(now), "after a read in between: report due");
+
+	// the final one
+	now = sampler_final_read();
+	sampler_update(now);
+	test_check(sampler_should_start(now), "final read not started");
+	sampler_read_started(now);
+	test_check(!sampler_report_due(now), "final read going on: report due");
+	now += 10;
+	sampler_read_done(now);
+	sampler_latch(NES_BUTTON_B);
+	test_check(sampler_report_due(now), "final read done: report held");
+	test_check(sampler_report_buttons() & NES_BUTTON_B, "report buttons %04X, without the last sample", sampler_report_buttons());
+
+	// taken by the host, and then no reads at all (no controller): held until
+	// the final one should have started
+	sampler_queued(sampler_report_buttons());
+	now = sampler_next_poll;
+	sampler_update(now);
+	test_check(!sampler_report_due(now), "no controller, right after the drain: report due");
+	now = sampler_final_read();
+	sampler_update(now);
+	test_check(sampler_report_due(now), "no controller: report held past the final read");
+}
+
+// one window of samples (SAMPLER_OVERSAMPLING of them), latched like the reads
+// between two reports, then the report: returns its buttons and sends it
+static uint16_t test_latch_window(const uint16_t *samples) {
+	uint16_t buttons;
+
+	for (uint8_t x = 0; x < SAMPLER_OVERSAMPLING; x++) sampler_latch(samples[x]);
+
+	buttons = sampler_report_buttons();
+	sampler_queued(buttons);
+	return buttons;
+}
+
+// the oversampled reads between two reports: a button held through the whole
+// window is pressed in the report (and stays so), a release in the middle
+// of the window is a release, and a glitch shorter than a window (press or
+// release) shows up in one report and is undone in the next one
+static void test_latch() {
+	static const uint16_t held[SAMPLER_OVERSAMPLING] = { NES_BUTTON_A, NES_BUTTON_A, NES_BUTTON_A, NES_BUTTON_A };
+	static const uint16_t released[SAMPLER_OVERSAMPLING] = { NES_BUTTON_A, NES_BUTTON_A, 0, 0 };
+	static const uint16_t none[SAMPLER_OVERSAMPLING] = { 0, 0, 0, 0 };
+	static const uint16_t tap[SAMPLER_OVERSAMPLING] = { 0, NES_BUTTON_B, 0, 0 };
+	static const uint16_t lift[SAMPLER_OVERSAMPLING] = { NES_BUTTON_A, 0, NES_BUTTON_A, NES_BUTTON_A };
+	uint16_t buttons;
+
+	sampler_current = 0;
+	sampler_queued(0);
+
+	// held through the whole window, and the next one
+	buttons = test_latch_window(held);
+	test_check(buttons == NES_BUTTON_A, "held: report %04X", buttons);
+	buttons = test_latch_window(held);
+	test_check(buttons == NES_BUTTON_A, "still held: report %04X", buttons);
+
+	// released mid-window: released in this report, not pressed again after
+	buttons = test_latch_window(released);
+	test_check(buttons == 0, "released mid-window: report %04X", buttons);
+	buttons = test_latch_window(none);
+	test_check(buttons == 0, "after the release: report %04X", buttons);
+
+	// a tap on one sample: pressed in this report, released in the next one
+	buttons = test_latch_window(tap);
+	test_check(buttons == NES_BUTTON_B, "tap: report %04X", buttons);
+	buttons = test_latch_window(none);
+	test_check(buttons == 0, "after the tap: report %04X", buttons);
+
+	// a held button lifted for one sample: released once, pressed again after
+	test_latch_window(held);
+	buttons = test_latch_window(lift);
+	test_check(buttons == 0, "lifted for a sample: report %04X", buttons);
+	buttons = test_latch_window(held);
+	test_check(buttons == NES_BUTTON_A, "after the lift: report %04X", buttons);
+}
+
+// empty event queue, no buttons
+static void test_events_reset() {
+	sampler_events_head = sampler_events_tail = sampler_events_lost = 0;
+	sampler_current = 0;
+}
+
+// a batch of up to max_length bytes: 1 if it has the expected events (their
+// buttons, the oldest first) and lost flag
+static uchar test_events_batch(uint16_t max_length, const uint16_t *buttons, uint8_t count, uint8_t lost) {
+	if (sampler_drain_events(max_length) != 1 + count * sizeof(sampler_event_t)) return 0;
+	if (sampler_events_batch[0] != (count | (lost ? SAMPLER_EVENTS_OVERFLOW : 0))) return 0;
+
+	for (uint8_t x = 0; x < count; x++) {
+		if ((sampler_events_batch[1 + x * 4] | (sampler_events_batch[2 + x * 4] << 8)) != buttons[x]) return 0;
+	}
+
+	return 1;
+}
+
+// the queue of button changes: in order across the wraparound of the indexes,
+// the newest dropped (and said) when full, and a batch cut to the request length
+// leaving the rest for the next one
+static void test_events() {
+	uint16_t buttons[SAMPLER_EVENTS_LENGTH + 2] = { 0 };
+	uint16_t wrong = 0;
+
+	test_reset();
+	test_events_reset();
+
+	// no change, no event
+	sampler_latch(0);
+	test_check(test_events_batch(64, buttons, 0, 0), "event without a change");
+
+	// 3 changes per batch, enough batches for the 8 bit indexes to wrap a few times
+	for (uint16_t batch = 0; batch < 300; batch++) {
+		for (uint8_t x = 0; x < 3; x++) {
+			buttons[x] = batch * 3 + x + 1;
+			sampler_latch(buttons[x]);
+		}
+		if (!test_events_batch(64, buttons, 3, 0)) wrong++;
+	}
+	test_check(!wrong, "wraparound: %u batches of 300 wrong", wrong);
+	test_check(sampler_events_head == sampler_events_tail, "queue not empty after the batches");
+
+	// overflow: the first 8 kept, the 2 after them lost and said so once
+	test_events_reset();
+	for (uint8_t x = 0; x < SAMPLER_EVENTS_LENGTH + 2; x++) {
+		buttons[x] = 0x100 + x;
+		sampler_latch(buttons[x]);
+	}
+	test_check(test_events_batch(64, buttons, SAMPLER_EVENTS_LENGTH, 1), "full queue: not the first 8 and lost");
+	test_check(test_events_batch(64, buttons, 0, 0), "full queue: lost said twice");
+
+	// partial: a request for 2 events and a half gets 2, the other 3 are left
+	test_events_reset();
+	for (uint8_t x = 0; x < 5; x++) {
+		buttons[x] = 0x200 + x;
+		sampler_latch(buttons[x]);
+	}
+	test_check(sampler_drain_events(0) == 0, "batch with no room");
+	test_check(test_events_batch(1 + 2 * sizeof(sampler_event_t) + 2, buttons, 2, 0), "partial: not the first 2");
+	test_check(test_events_batch(1, buttons, 0, 0), "partial: events with room for the count only");
+	test_check(test_events_batch(64, &buttons[2], 3, 0), "partial: not the other 3 next");
+
+	// the lost flag goes with the first batch that has room for the count byte
+	test_events_reset();
+	for (uint8_t x = 0; x < SAMPLER_EVENTS_LENGTH + 1; x++) {
+		buttons[x] = 0x300 + x;
+		sampler_latch(buttons[x]);
+	}
+	test_check(sampler_drain_events(0) == 0 && sampler_events_lost, "lost flag cleared with no room");
+	test_check(test_events_batch(1 + sizeof(sampler_event_t), buttons, 1, 1), "partial and full: not the first one and lost");
+	test_check(test_events_batch(64, &buttons[1], SAMPLER_EVENTS_LENGTH - 1, 0), "partial and full: not the other 7 next");
+}
+
+static void test_report() {
+	uint16_t now = 1000;
+	uchar length;
+
+	test_reset();
+
+	// the first one always goes, then only the changes
+	test_check(report_due(0, now), "first report held");
+	length = report_build(0, SNES_TYPE_SNES_MINI, now);
+	test_check(length == 2, "SNES Mini report, %u bytes", length);
+	test_check(!report_due(0, now + 1), "same buttons, report due");
+	test_check(report_due(NES_BUTTON_A, now + 1), "A pressed, report held");
+
+	length = report_build(NES_BUTTON_A | NES_BUTTON_X, SNES_TYPE_SNES_MINI, now);
+	test_check(report_buffer.commonButtonMask == 0x80 && report_buffer.snesButtonMask == 0x01,
+		"A + X reported as %02X %02X", report_buffer.commonButtonMask, report_buffer.snesButtonMask);
+
+	// a NES Mini gets the first byte only
+	length = report_build(NES_BUTTON_A | NES_BUTTON_UP, SNES_TYPE_NES_MINI, now);
+	test_check(length == 1 && report_buffer.commonButtonMask == 0x81, "NES Mini report, %u bytes, %02X", length, report_buffer.commonButtonMask);
+
+	// forced (a new layout): the same buttons go again
+	report_force = 1;
+	test_check(report_due(NES_BUTTON_A | NES_BUTTON_UP, now), "forced report held");
+	report_build(NES_BUTTON_A | NES_BUTTON_UP, SNES_TYPE_NES_MINI, now);
+	test_check(!report_due(NES_BUTTON_A | NES_BUTTON_UP, now), "forced report due again");
+
+	// idle rate 2 (8ms): the same report again once it expires, and never with 0
+	report_set_idle_rate(2, now);
+	test_check(!report_due(NES_BUTTON_A | NES_BUTTON_UP, now + TICKS_FROM_MS(8) - 2), "idle rate 8ms, due too early");
+	test_check(report_due(NES_BUTTON_A | NES_BUTTON_UP, now + TICKS_FROM_MS(8)), "idle rate 8ms, held past it");
+
+	report_set_idle_rate(0, now);
+	test_check(!report_due(NES_BUTTON_A | NES_BUTTON_UP, now + 60000), "idle rate 0, due");
+}
+
+// a SNES Mini losing its init right after every connection (so every read has
+// unknown bits and it's connected again): the attempts back off like the presence
+// checks, and once it works the interval is back to the shortest one
+static void test_connect_backoff() {
+	static mock_controller_t controller;
+	snes_controller_state state = { 0 };
+	uint16_t connects = 0;
+
+	test_reset();
+	mock_controller_init(&controller, MOCK_CONTROLLER_SNES_MINI);
+	mock_i2c_attach(&controller.device);
+
+	// one second, a 100us main loop like the one in bench_hot_plug
+	while (mock_cycles < (uint64_t)F_CPU) {
+		uint16_t now = ticks_now();
+
+		if (!state.connected) snes_update_connection(&state, now);
+
+		if (controller.initialized) {
+			connects++;
+			controller.initialized = 0;
+		}
+
+		if (state.connected) snes_poll_state(&state);
+
+		mock_advance(F_CPU / 10000);
+	}
+
+	// 10, 20, 40, 80, 160 and 320ms from there on: 7 or 8 in a second
+	test_check(connects >= 2 && connects <= 10, "%u connections in a second", connects);
+	test_check(state.detect_interval >= SNES_DETECT_MAX_TICKS, "interval %u ticks after failing for a second", state.detect_interval);
+
+	// it keeps the init from now on
+	uint64_t until = mock_cycles + F_CPU / 2;
+	while (mock_cycles < until && !(state.connected && state.step == SNES_STEP_DONE)) {
+		uint16_t now = ticks_now();
+
+		if (!state.connected) snes_update_connection(&state, now);
+		if (state.connected) snes_poll_state(&state);
+
+		mock_advance(F_CPU / 10000);
+	}
+
+	test_check(state.connected && state.step == SNES_STEP_DONE, "not read after it started working");
+	test_check(state.detect_interval == SNES_DETECT_MIN_TICKS, "interval %u ticks after a good read", state.detect_interval);
+
+	mock_i2c_attach(NULL);
+}
+
+// a SNES Mini plugged with the main loop running: the connection goes one step per
+// snes_update_connection call, none of them anywhere near the whole thing (~35ms,
+// the budget between usbPoll calls is 45ms), not even with the bus stuck
+static void test_connect_steps() {
+	static mock_controller_t controller;
+	snes_controller_state state = { 0 };
+	uint64_t longest = 0;
+	uint16_t calls = 0;
+
+	test_reset();
+	mock_controller_init(&controller, MOCK_CONTROLLER_SNES_MINI);
+	controller.buttons = NES_BUTTON_Y;
+	mock_i2c_attach(&controller.device);
+
+	while (mock_cycles < F_CPU / 5 && !state.connected) {
+		uint64_t start = mock_cycles;
+
+		snes_update_connection(&state, ticks_now());
+		if (mock_cycles - start > longest) longest = mock_cycles - start;
+		if (state.connect_step != SNES_CONNECT_IDLE || state.connected) calls++;
+
+		mock_advance(F_CPU / 10000);
+	}
+
+	test_check(state.connected && state.type == SNES_TYPE_SNES_MINI, "not connected after 200ms (type %u)", state.type);
+	test_check(calls >= 5, "connected in %u calls", calls);
+	test_check(MOCK_CYCLES_TO_US(longest) < 10000, "a call took %.1f ms", MOCK_CYCLES_TO_US(longest) / 1000);
+
+	while (state.connected && state.step != SNES_STEP_DONE) {
+		snes_poll_state(&state);
+		mock_advance(F_CPU / 10000);
+	}
+	test_check(state.connected && state.buttons == NES_BUTTON_Y, "read %04X after the connection", state.buttons);
+
+	// plugged again, and SCL held low after every ack (100ms, a stuck bus) once the
+	// presence check went through: a single try per step, the first timeout ends the
+	// transaction and the bus is recovered
+	test_reset();
+	mock_controller_init(&controller, MOCK_CONTROLLER_SNES_MINI);
+	mock_i2c_attach(&controller.device);
+
+	state = (snes_controller_state){ 0 };
+	longest = calls = 0;
+
+	while (mock_cycles < F_CPU / 2) {
+		uint64_t start = mock_cycles;
+
+		if (state.connect_step != SNES_CONNECT_IDLE) {
+			controller.stretch_us = 100000;
+			calls++;
+		}
+
+		snes_update_connection(&state, ticks_now());
+		if (mock_cycles - start > longest) longest = mock_cycles - start;
+
+		mock_advance(F_CPU / 10000);
+	}
+
+	test_check(!state.connected && calls, "connected with SCL stuck (%u steps)", calls);
+	test_check(MOCK_CYCLES_TO_US(longest) < 5000, "a call took %.1f ms with SCL stuck", MOCK_CYCLES_TO_US(longest) / 1000);
+
+	mock_i2c_attach(NULL);
+}
+
+// I2C_TIMER0_CLOCK: blocking reads with Timer0 strobing SCL (a byte is 16 half
+// periods of the compare value), the software strobe when the interrupts are
+// disabled, and a stuck SCL ending the wait with a timeout
+// connects a SNES Mini with nothing pressed, returns the repeated start mode the
+// connection ended up with (0xFF if it didn't connect)
+static uchar test_connect_repeated_start(uint8_t repeated_start, uint32_t read_delay_us) {
+	static mock_controller_t controller;
+	snes_controller_state state = { 0 };
+
+	test_reset();
+	mock_controller_init(&controller, MOCK_CONTROLLER_SNES_MINI);
+	controller.repeated_start = repeated_start;
+	controller.read_delay_us = read_delay_us;
+	mock_i2c_attach(&controller.device);
+
+	snes_connect(&state);
+
+	return state.connected ? state.repeated_start : 0xFF;
+}
+
+// with no buttons pressed, the buttons read through a repeated start are the same
+// as the reference whether the read worked or not (0xFF from a NACKed address, data
+// that wasn't ready): the probe has to look at something else
+static void test_repeated_start_probe() {
+	uchar mode;
+
+	mode = test_connect_repeated_start(1, 0);
+	test_check(mode == 1, "repeated start understood: mode %u", mode);
+
+	mode = test_connect_repeated_start(0, 0);
+	test_check(mode == 0, "repeated start NACKed, nothing pressed: mode %u", mode);
+
+	mode = test_connect_repeated_start(1, 1000);
+	test_check(mode == 0, "data 1ms after the pointer, nothing pressed: mode %u", mode);
+}
+
+static void test_timer0_clock() {
+	static mock_controller_t controller;
+	snes_controller_state state = { 0 };
+
+	test_reset();
+	mock_controller_init(&controller, MOCK_CONTROLLER_NES_MINI);
+	controller.buttons = NES_BUTTON_START;
+	mock_i2c_attach(&controller.device);
+
+	state.type = SNES_TYPE_NES_MINI;
+	snes_get_state(&state);
+	test_check(state.connected && state.buttons == NES_BUTTON_START, "Timer0 clock: read %04X", state.buttons);
+
+	i2c_start();
+	uint64_t start = mock_cycles;
+	i2c_transfer(USISR_CLOCK_8_BITS);
+	uint64_t byte = mock_cycles - start;
+	i2c_transfer(USISR_CLOCK_1_BIT);
+	i2c_stop();
+	i2c_error();
+	// 16 half periods, the SDA hold after the last one and the strobe latency
+	test_check(byte >= 17 * (I2C_TIMER0_OCR0A + 1) && byte < 20 * (I2C_TIMER0_OCR0A + 1),
+		"Timer0 clock: byte in %u cycles, %u per half period", (uint32_t)byte, (uint32_t)(I2C_TIMER0_OCR0A + 1));
+
+	cli();
+	controller.buttons = NES_BUTTON_A;
+	snes_get_state(&state);
+	test_check(state.connected && state.buttons == NES_BUTTON_A, "interrupts disabled: read %04X", state.buttons);
+	sei();
+
+	// SCL held low after the address ack
+	uint16_t timeouts = diagnostics.i2c_timeouts;
+	controller.stretch_us = 100000;
+	start = mock_cycles;
+	snes_get_state(&state);
+	test_check(!state.connected && diagnostics.i2c_timeouts == timeouts + 1, "SCL stuck: connected %u, %u timeouts",
+		state.connected, diagnostics.i2c_timeouts - timeouts);
+	test_check(MOCK_CYCLES_TO_US(mock_cycles - start) < 2 * I2C_TIMER0_TRANSFER_US + 1000, "SCL stuck: %.0f us",
+		MOCK_CYCLES_TO_US(mock_cycles - start));
+
+	mock_i2c_attach(NULL);
+}
+
+int main() {
+	test_mapping();
+	test_layouts();
+	test_sampler();
+	test_latch();
+	test_events();
+	test_report();
+	test_connect_backoff();
+	test_connect_steps();
+	test_repeated_start_probe();
+	test_timer0_clock();
+
+	printf("%u checks, %u failed\n", test_checks, test_failures);
+	return test_failures ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+/*
+	Host build: the delays just move the simulated time forward (see host/mock_avr.c),
+	rounded up to whole cycles like the avr-libc ones.
+*/
+
+#ifndef MOCK_UTIL_DELAY_H
+#define MOCK_UTIL_DELAY_H
+
+void mock_delay_us(double us);
+
+#define _delay_us(us)	mock_delay_us(us)
+#define _delay_ms(ms)	mock_delay_us((ms) * 1000.0)
+
+#endif
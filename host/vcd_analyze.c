@@ -0,0 +1,293 @@
+/*
+	Bus timing report from a VCD trace of the host build (make host-trace, see
+	host/mock_avr.h): every I2C transaction (start to stop) with how long it
+	kept the bus busy, grouped by the phase it started in, and the timing
+	minimums of the I2C specification checked on all of them:
+
+		tHD;STA		start hold (SDA low to SCL low)
+		tLOW		SCL low
+		tHIGH		SCL high
+		tSU;DAT		data setup (SDA change to SCL high)
+		tSU;STA		repeated start setup (SCL high to SDA low)
+		tSU;STO		stop setup (SCL high to SDA high)
+		tBUF		bus free between a stop and the next start
+
+	Standard mode (100kHz) or fast mode (400kHz) minimums, depending on the
+	shortest SCL period of each transaction. The data hold time is 0 for
+	I2C devices, so it's always fine. -v lists every transaction.
+
+		cc -Wall -O2 -o host/vcd_analyze host/vcd_analyze.c
+		./host/vcd_analyze [-v] trace.vcd
+
+	Exits with 1 when something is under its minimum.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PHASES				256
+#define PHASE_NAME_LENGTH	48
+
+// the checks, in the order of the report
+#define CHECK_HD_STA	0
+#define CHECK_LOW		1
+#define CHECK_HIGH		2
+#define CHECK_SU_DAT	3
+#define CHECK_SU_STA	4
+#define CHECK_SU_STO	5
+#define CHECK_BUF		6
+#define CHECKS			7
+
+#define MODE_STANDARD	0
+#define MODE_FAST		1
+#define MODES			2
+
+// a transaction with a SCL period under this is a fast mode one
+#define FAST_PERIOD_NS	8000
+
+static const char *check_names[CHECKS] = { "tHD;STA", "tLOW", "tHIGH", "tSU;DAT", "tSU;STA", "tSU;STO", "tBUF" };
+static const char *mode_names[MODES] = { "100kHz", "400kHz" };
+
+// ns, from the I2C specification (UM10204, table 10)
+static const double check_limits[MODES][CHECKS] = {
+	{ 4000, 4700, 4000, 250, 4700, 4000, 4700 },
+	{ 600, 1300, 600, 100, 600, 600, 1300 },
+};
+
+typedef struct {
+	uint64_t	start;
+	uint64_t	end;
+	uint8_t		phase;
+	uint32_t	clocks;
+	uint64_t	min_period;			// cycles between two rising SCL edges
+	uint64_t	min[CHECKS];		// shortest of each, in cycles (UINT64_MAX = not seen)
+} transaction_t;
+
+typedef struct {
+	uint32_t	count;
+	uint64_t	busy;
+	uint64_t	min;
+	uint64_t	max;
+	uint32_t	bytes;
+} phase_stats_t;
+
+static double cycle_ns = 1e9 / 16500000.0;
+
+static char phase_names[PHASES][PHASE_NAME_LENGTH];
+static phase_stats_t phase_stats[PHASES];
+
+static uint64_t check_min[MODES][CHECKS];
+static uint32_t check_count[MODES][CHECKS];
+static uint32_t check_violations[MODES][CHECKS];
+static uint64_t check_first_violation[MODES][CHECKS];
+
+static uint32_t transactions;
+static uint64_t busy_cycles;
+static int verbose;
+
+static void min_update(uint64_t *min, uint64_t value) {
+	if (value < *min) *min = value;
+}
+
+static void transaction_begin(transaction_t *transaction, uint64_t now, uint8_t phase) {
+	memset(transaction, 0, sizeof(*transaction));
+
+	transaction->start = now;
+	transaction->phase = phase;
+	transaction->min_period = UINT64_MAX;
+	for (int x = 0; x < CHECKS; x++) transaction->min[x] = UINT64_MAX;
+}
+
+static void transaction_end(transaction_t *transaction, uint64_t now) {
+	phase_stats_t *stats = &phase_stats[transaction->phase];
+	uint64_t length = now - transaction->start;
+	int mode = (transaction->min_period != UINT64_MAX && transaction->min_period * cycle_ns < FAST_PERIOD_NS) ? MODE_FAST : MODE_STANDARD;
+
+	transaction->end = now;
+
+	for (int x = 0; x < CHECKS; x++) {
+		if (transaction->min[x] == UINT64_MAX) continue;
+
+		if (!check_count[mode][x]++ || transaction->min[x] < check_min[mode][x]) check_min[mode][x] = transaction->min[x];
+
+		if (transaction->min[x] * cycle_ns < check_limits[mode][x]) {
+			if (!check_violations[mode][x]++) check_first_violation[mode][x] = transaction->start;
+		}
+	}
+
+	if (!stats->count++ || length < stats->min) stats->min = length;
+	if (length > stats->max) stats->max = length;
+	stats->busy += length;
+	stats->bytes += transaction->clocks / 9;
+
+	transactions++;
+	busy_cycles += length;
+
+	if (verbose) {
+		printf("%12llu %-24s %s %8.1f us %3u bytes\n", (unsigned long long)transaction->start,
+			phase_names[transaction->phase], mode_names[mode], length * cycle_ns / 1000, transaction->clocks / 9);
+	}
+}
+
+// "$comment phase 3 snes_connect $end" / "$comment time unit: CPU cycles, F_CPU 16500000 $end"
+static void parse_comment(const char *line) {
+	unsigned int phase;
+	unsigned long f_cpu;
+	char name[PHASE_NAME_LENGTH];
+	const char *text;
+
+	if (sscanf(line, "$comment phase %u %47s", &phase, name) == 2 && phase < PHASES) {
+		strcpy(phase_names[phase], name);
+	} else if ((text = strstr(line, "F_CPU")) && sscanf(text, "F_CPU %lu", &f_cpu) == 1 && f_cpu) {
+		cycle_ns = 1e9 / f_cpu;
+	}
+}
+
+int main(int argc, char **argv) {
+	char line[256], id_scl = 0, id_sda = 0, id_phase = 0;
+	const char *path = NULL;
+	FILE *file;
+
+	for (int x = 1; x < argc; x++) {
+		if (!strcmp(argv[x], "-v")) verbose = 1;
+		else path = argv[x];
+	}
+
+	if (!path) {
+		fprintf(stderr, "usage: %s [-v] trace.vcd\n", argv[0]);
+		return 2;
+	}
+
+	if (!(file = fopen(path, "r"))) {
+		perror(path);
+		return 2;
+	}
+
+	strcpy(phase_names[0], "-");
+
+	uint64_t now = 0, first = UINT64_MAX;
+	uint8_t scl = 1, sda = 1, phase = 0, in_transaction = 0, seen_fall = 0;
+	uint64_t last_rise = 0, last_fall = 0, last_sda = 0, last_stop = 0;
+	uint8_t stopped = 0;
+	transaction_t transaction;
+
+	while (fgets(line, sizeof(line), file)) {
+		char id, name[32];
+		unsigned int width;
+		char value[64];
+
+		if (line[0] == '$') {
+			if (sscanf(line, "$var wire %u %c %31s", &width, &id, name) == 3) {
+				if (!strcmp(name, "scl")) id_scl = id;
+				else if (!strcmp(name, "sda")) id_sda = id;
+				else if (!strcmp(name, "phase")) id_phase = id;
+			} else if (!strncmp(line, "$comment", 8)) {
+				parse_comment(line);
+			}
+			continue;
+		}
+
+		if (line[0] == '#') {
+			now = strtoull(line + 1, NULL, 10);
+			if (first == UINT64_MAX) first = now;
+			continue;
+		}
+
+		if (line[0] == 'b') {
+			if (sscanf(line, "b%63s %c", value, &id) == 2 && id == id_phase) phase = strtoul(value, NULL, 2);
+			continue;
+		}
+
+		if ((line[0] != '0' && line[0] != '1') || !line[1]) continue;
+
+		uint8_t level = line[0] - '0';
+		id = line[1];
+
+		if (id == id_scl && level != scl) {
+			scl = level;
+
+			if (!in_transaction) continue;
+
+			if (scl) {
+				if (seen_fall) {
+					min_update(&transaction.min[CHECK_LOW], now - last_fall);
+					if (last_sda > last_fall) min_update(&transaction.min[CHECK_SU_DAT], now - last_sda);
+				}
+				if (transaction.clocks) min_update(&transaction.min_period, now - last_rise);
+				transaction.clocks++;
+				last_rise = now;
+			} else {
+				if (!seen_fall) min_update(&transaction.min[CHECK_HD_STA], now - last_sda);
+				else min_update(&transaction.min[CHECK_HIGH], now - last_rise);
+				seen_fall = 1;
+				last_fall = now;
+			}
+		} else if (id == id_sda && level != sda) {
+			sda = level;
+
+			if (scl && !sda) { // start (or repeated start)
+				if (in_transaction) {
+					min_update(&transaction.min[CHECK_SU_STA], now - last_rise);
+					// a repeated start doesn't end the transaction, but its hold is checked again
+					seen_fall = 0;
+				} else {
+					transaction_begin(&transaction, now, phase);
+					if (stopped) min_update(&transaction.min[CHECK_BUF], now - last_stop);
+					in_transaction = 1;
+					seen_fall = 0;
+				}
+			} else if (scl && sda && in_transaction) { // stop
+				min_update(&transaction.min[CHECK_SU_STO], now - last_rise);
+				transaction_end(&transaction, now);
+				in_transaction = 0;
+				stopped = 1;
+				last_stop = now;
+			}
+
+			last_sda = now;
+		}
+	}
+
+	fclose(file);
+
+	if (first == UINT64_MAX) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		return 2;
+	}
+
+	uint64_t total = now - first;
+
+	printf("%s: %.1f ms, %u transactions, bus busy %.2f%% of the time\n\n", path, total * cycle_ns / 1e6,
+		transactions, total ? busy_cycles * 100.0 / total : 0);
+
+	printf("%-24s %8s %8s %10s %10s %10s %12s\n", "phase", "count", "bytes", "min us", "mean us", "max us", "busy us");
+	for (int x = 0; x < PHASES; x++) {
+		phase_stats_t *stats = &phase_stats[x];
+
+		if (!stats->count) continue;
+
+		printf("%-24s %8u %8u %10.1f %10.1f %10.1f %12.1f\n", phase_names[x], stats->count, stats->bytes,
+			stats->min * cycle_ns / 1000, stats->busy * cycle_ns / 1000 / stats->count,
+			stats->max * cycle_ns / 1000, stats->busy * cycle_ns / 1000);
+	}
+
+	uint32_t violations = 0;
+
+	printf("\n%-8s %-7s %8s %10s %10s %10s\n", "check", "mode", "count", "min us", "limit us", "under");
+	for (int x = 0; x < CHECKS; x++) {
+		for (int mode = 0; mode < MODES; mode++) {
+			if (!check_count[mode][x]) continue;
+
+			printf("%-8s %-7s %8u %10.2f %10.2f %10u", check_names[x], mode_names[mode], check_count[mode][x],
+				check_min[mode][x] * cycle_ns / 1000, check_limits[mode][x] / 1000, check_violations[mode][x]);
+			if (check_violations[mode][x]) printf("  (first at %llu)", (unsigned long long)check_first_violation[mode][x]);
+			printf("\n");
+
+			violations += check_violations[mode][x];
+		}
+	}
+
+	return violations ? 1 : 0;
+}
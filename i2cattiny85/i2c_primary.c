@@ -1,13 +1,54 @@
 #include "i2c_primary.h"
 
-void i2c_init() {
+static uint8_t i2c_speed = I2C_SPEED_STANDARD;
+static uint8_t i2c_repeated_start = 0;
+static uint8_t i2c_last_error = I2C_OK;
+
+// _delay_us needs a constant, so one call per speed
+#define i2c_wait_long()		do { if (i2c_speed) _delay_us(WAIT_LONG_FAST); else _delay_us(WAIT_LONG); } while (0)
+#define i2c_wait_short()	do { if (i2c_speed) _delay_us(WAIT_SHORT_FAST); else _delay_us(WAIT_SHORT); } while (0)
+
+// waits for SCL to go high after releasing it (a device may hold it low), for
+// I2C_SCL_TIMEOUT_US at most. Returns 0 on timeout (and keeps the error, see i2c_error)
+static uint8_t i2c_wait_scl() {
+	uint16_t budget = I2C_SCL_TIMEOUT_US;
+
+	while (!(PINB & (1 << PIN_SCL))) {
+		if (!--budget) {
+			i2c_last_error = I2C_ERROR_TIMEOUT;
+			return 0;
+		}
+		_delay_us(1);
+	}
+
+	return 1;
+}
 
-	DDRB |= (1 << PIN_SDA);
-	DDRB |= (1 << PIN_SCL);
+// I2C_OK or the first error since the last call. After an error the blocking
+// functions don't touch the bus anymore (a stuck SCL costs one I2C_SCL_TIMEOUT_US
+// per transaction, not one per clock), check it once the whole transaction is done
+// and i2c_recover the bus
+static uint8_t i2c_error() {
+	uint8_t error = i2c_last_error;
+	i2c_last_error = I2C_OK;
+	return error;
+}
 
+// 1 if there's been an error since the last i2c_error (without clearing it)
+static uint8_t i2c_failed() {
+	return i2c_last_error != I2C_OK;
+}
+
+void i2c_init() {
+
+	// high first and outputs then, otherwise both lines are driven low for a
+	// moment (a start and a stop on the bus)
 	PORTB |= (1<<PIN_SCL);
 	PORTB |= (1<<PIN_SDA);
 
+	DDRB |= (1 << PIN_SDA);
+	DDRB |= (1 << PIN_SCL);
+
 	USIDR = 0xFF;
 
 	USICR = (1 << USIWM1) | (1 << USICS1) | (1 << USICLK);
@@ -17,42 +58,127 @@ void i2c_init() {
 			(0x0 << USICNT0); // and reset counter.
 }
 
-void i2c_start() {
+// Timer0 strobes SCL (see TIMER0_COMPA_vect below) until stopped
+static void i2c_clock_start() {
+	TCCR0A = (1 << WGM01); // CTC on OCR0A
+	OCR0A = i2c_speed ? I2C_TIMER0_OCR0A_FAST : I2C_TIMER0_OCR0A;
+	TCNT0 = 0;
+	GPIOR0 &= ~(1 << I2C_STRETCHED_BIT);
+	TIFR = (1 << OCF0A);
+	TIMSK |= (1 << OCIE0A);
+	TCCR0B = (1 << CS00); // no prescaler
+}
+
+static void i2c_clock_stop() {
+	TIMSK &= ~(1 << OCIE0A);
+	TCCR0B = 0;
+}
+
+// I2C_SPEED_STANDARD (100kHz, the default) or I2C_SPEED_FAST (400kHz), for the
+// next transactions (don't change it while one is in progress)
+static void i2c_set_speed(uint8_t speed) {
+	if (speed < i2c_speed) _delay_us(WAIT_LONG); // the last stop only waited the fast mode bus free time
+	i2c_speed = speed;
+}
+
+// 1 = the background transactions go from the write part to the read part with
+// a repeated start instead of a stop + start (not every device likes it)
+static void i2c_set_repeated_start(uint8_t enabled) {
+	i2c_repeated_start = enabled;
+}
+
+unsigned char i2c_start() {
+	if (i2c_last_error != I2C_OK) return i2c_last_error;
 
 	// generate start condition
 	PORTB |= (1 << PIN_SDA); // sda released
 	PORTB |= (1<<PIN_SCL); // scl release until high
-	while (!(PORTB & (1<<PIN_SCL)));
+	if (!i2c_wait_scl()) return I2C_ERROR_TIMEOUT;
 
 	PORTB &= ~(1<<PIN_SDA); // sda low (start condition)
 
-	_delay_us(WAIT_LONG);
+	i2c_wait_long();
 
 	PORTB &= ~(1<<PIN_SCL); // scl low	
 
 	PORTB |= (1<<PIN_SDA); // sda high (release to start transmitting)
 
+	return I2C_OK;
+}
+
+// repeated start: a start condition in the middle of a transaction (after an
+// ack, so SCL is low). SCL has to stay high for a while before SDA goes low
+unsigned char i2c_restart() {
+	if (i2c_last_error != I2C_OK) return i2c_last_error;
+
+	PORTB |= (1 << PIN_SDA); // sda released (scl is low, so this is not a stop)
+
+	i2c_wait_long(); // scl low time (the last clock may have just gone low)
+
+	PORTB |= (1 << PIN_SCL);
+	if (!i2c_wait_scl()) return I2C_ERROR_TIMEOUT;
+
+	i2c_wait_long();
+
+	return i2c_start();
 }
 
-void i2c_stop() {
+unsigned char i2c_stop() {
+	if (i2c_last_error != I2C_OK) {
+		PORTB |= (1<<PIN_SDA); // don't leave SDA low
+		return i2c_last_error;
+	}
 
 	// SDA goes low
 	PORTB &= ~(1<<PIN_SDA);
 
+	// the data setup and the SCL low time (the last clock may have just gone
+	// low, in the background transactions)
+	i2c_wait_long();
+
 	// release SCL
 	PORTB |= (1<<PIN_SCL);
-	while (! (PINB & (1<<PIN_SCL)));
+	if (!i2c_wait_scl()) {
+		PORTB |= (1<<PIN_SDA); // don't leave SDA low
+		return I2C_ERROR_TIMEOUT;
+	}
 
-	_delay_us(WAIT_LONG);
+	i2c_wait_long();
 
 	// release SDA
 	PORTB |= (1<<PIN_SDA);
-	
-	_delay_us(WAIT_SHORT);
 
+	// bus free time before the next start
+	i2c_wait_long();
+
+	return I2C_OK;
+}
+
+// I2C_TIMER0_CLOCK: Timer0 toggles SCL until the counter overflows (the strobe
+// interrupt of the background transactions), nothing to do here but wait. The
+// first toggle comes after a full half period, so SCL low is long enough.
+// Returns 0 with the interrupts disabled (before sei), the caller strobes SCL
+// itself then. I2C_TIMER0_TRANSFER_US at most, then it's a timeout
+static uint8_t i2c_clock_bits() {
+	uint16_t budget = I2C_TIMER0_TRANSFER_US;
+
+	if (!(SREG & (1 << SREG_I))) return 0;
+
+	i2c_clock_start();
+	while (!(USISR & (1 << USIOIF))) {
+		if (!--budget) {
+			i2c_last_error = I2C_ERROR_TIMEOUT;
+			break;
+		}
+		_delay_us(1);
+	}
+	i2c_clock_stop();
+
+	return 1;
 }
 
 unsigned char i2c_transfer(unsigned char usisr_mask) {
+	if (i2c_last_error != I2C_OK) return 0xFF; // reads as a nack / nothing pressed
 
 	// force SDL low (it's already low probably, since we're
 	// toggling it up and down in pairs, but just in case...)
@@ -61,14 +187,16 @@ unsigned char i2c_transfer(unsigned char usisr_mask) {
 	USISR = usisr_mask;
 
 	// transfer until counter overflow
-	do {
-		_delay_us(WAIT_LONG);
-		USICR |= (1 << USITC);
-		while (! (PINB & (1<<PIN_SCL))); //Waiting for SCL to go high
-		_delay_us(WAIT_SHORT);
-		USICR |= (1 << USITC);
-	} while (!(USISR & (1 << USIOIF)));
-	_delay_us(WAIT_LONG);
+	if (!I2C_TIMER0_CLOCK || !i2c_clock_bits()) {
+		do {
+			i2c_wait_long();
+			USICR |= (1 << USITC);
+			if (!i2c_wait_scl()) break; //Waiting for SCL to go high
+			i2c_wait_short();
+			USICR |= (1 << USITC);
+		} while (!(USISR & (1 << USIOIF)));
+	}
+	i2c_wait_long();
 
 	// release SDA
 	// "The output pin (DO or SDA, depending on the wire mode)
@@ -112,4 +240,333 @@ unsigned char i2c_read_byte(unsigned char nack) {
 	i2c_transfer(USISR_CLOCK_1_BIT);
 
 	return data;
-}
\ No newline at end of file
+}
+
+/*
+	Interrupt-driven transactions
+
+	The blocking functions above keep the CPU busy toggling SCL for the whole
+	transfer. Here a full "start, address, write N bytes, (stop + start or
+	repeated start, address) read M bytes, stop" sequence is queued with i2c_async_transfer() and runs
+	in the background:
+
+	* Timer0 fires every half SCL period and strobes USITC (tiny naked ISR,
+	  a handful of cycles, so the V-USB interrupt latency is not affected).
+	  It leaves SCL alone when the USI counter has overflowed and while a
+	  device is stretching the clock (and for one more match once it lets
+	  go, so SCL stays high for a whole half period).
+
+	* The USI counter overflow interrupt moves to the next byte / ack bit.
+	  It runs with interrupts enabled again (the USB one has to get through).
+
+	* The stop and start conditions (between the write and the read part, and
+	  at the end) wait a few us each, and up to I2C_SCL_TIMEOUT_US with a
+	  device holding SCL: too long for an interrupt, so the overflow one only
+	  leaves them pending (SCL stays low meanwhile, the device just waits) and
+	  i2c_async_poll does them from the main loop.
+
+	The main loop only checks i2c_async_status() (or i2c_async_busy(), both
+	call i2c_async_poll) until it's not busy anymore.
+	Don't call the blocking functions while a transaction is in progress!
+*/
+
+// what the overflow interrupt left for i2c_async_poll
+#define I2C_PENDING_NONE		0
+#define I2C_PENDING_RESTART		1 // the read part: stop + start or repeated start, read address
+#define I2C_PENDING_STOP		2 // the end: stop, then i2c_async_result
+
+static volatile uint8_t i2c_async_state = I2C_ASYNC_IDLE;
+static volatile uint8_t i2c_async_pending = I2C_PENDING_NONE;
+static uint8_t i2c_async_result;	// state after the pending stop
+static uint8_t i2c_async_phase;
+static uint8_t i2c_async_address;	// 8 bit address (write form, bit 0 cleared)
+static uint8_t i2c_async_reading;	// 1 once the read address has been sent
+static const uint8_t *i2c_async_tx;
+static uint8_t i2c_async_tx_len;
+static uint8_t *i2c_async_rx;
+static uint8_t i2c_async_rx_len;
+
+static void i2c_async_poll();
+
+static uint8_t i2c_async_status() {
+	i2c_async_poll();
+	return i2c_async_state;
+}
+
+static uint8_t i2c_async_busy() {
+	i2c_async_poll();
+	return i2c_async_state == I2C_ASYNC_BUSY;
+}
+
+// loads a byte to be sent and clears the overflow flag, so the strobes
+// start again on the next Timer0 match
+static void i2c_async_send(uint8_t data) {
+	USIDR = data;
+	i2c_async_phase = I2C_PHASE_TX;
+	USISR = USISR_CLOCK_8_BITS;
+}
+
+static void i2c_async_receive() {
+	DDRB &= ~(1 << PIN_SDA); // device drives SDA
+	USIDR = 0xFF;
+	i2c_async_phase = I2C_PHASE_RX;
+	USISR = USISR_CLOCK_8_BITS;
+}
+
+// from the overflow interrupt: no more strobes nor overflow interrupts until
+// i2c_async_poll does the rest (USIOIF stays set)
+static void i2c_async_defer(uint8_t pending, uint8_t result) {
+	i2c_clock_stop();
+	i2c_async_result = result;
+	i2c_async_pending = pending;
+}
+
+static void i2c_async_finish(uint8_t state) {
+	if (i2c_stop() != I2C_OK) state = I2C_ASYNC_ERROR;
+
+	USIDR = 0xFF;
+	USISR = USISR_CLOCK_8_BITS; // clear flags
+
+	i2c_async_state = state;
+}
+
+// the deferred stop / start conditions (see i2c_async_defer), main loop only
+static void i2c_async_poll() {
+	uint8_t pending = i2c_async_pending;
+
+	if (pending == I2C_PENDING_NONE) return;
+	i2c_async_pending = I2C_PENDING_NONE;
+
+	if (pending == I2C_PENDING_STOP) {
+		i2c_async_finish(i2c_async_result);
+		return;
+	}
+
+	// everything written, now the read part
+	uint8_t error;
+	if (i2c_repeated_start) {
+		error = i2c_restart();
+	} else {
+		error = i2c_stop();
+		if (error == I2C_OK) error = i2c_start();
+	}
+	if (error != I2C_OK) {
+		i2c_async_finish(I2C_ASYNC_ERROR);
+		return;
+	}
+
+	i2c_async_reading = 1;
+	i2c_async_send(i2c_async_address | 0x01);
+	USICR |= (1 << USIOIE);
+	i2c_clock_start();
+}
+
+// stops the background transaction right where it is (it ends up as
+// I2C_ASYNC_ERROR), without touching the bus: that's for i2c_recover
+static void i2c_async_abort() {
+	i2c_clock_stop();
+	USICR &= ~(1 << USIOIE);
+	i2c_async_pending = I2C_PENDING_NONE;
+	USIDR = 0xFF;
+	USISR = USISR_CLOCK_8_BITS; // clear flags
+
+	if (i2c_async_state == I2C_ASYNC_BUSY) i2c_async_state = I2C_ASYNC_ERROR;
+}
+
+// bus recovery: a device stuck in the middle of a byte (after a reset or a
+// glitch) keeps SDA low until it gets the rest of its clocks, so up to 9 SCL
+// pulses are sent until it lets SDA go, and then a stop. Also stops any
+// background transaction. Returns I2C_OK if both lines are high at the end
+static unsigned char i2c_recover() {
+	i2c_async_abort();
+
+	DDRB &= ~(1 << PIN_SDA); // let the device drive it
+	PORTB |= (1 << PIN_SDA);
+
+	for (uint8_t x = 0; x < 9 && !(PINB & (1 << PIN_SDA)); x++) {
+		PORTB &= ~(1 << PIN_SCL);
+		_delay_us(WAIT_LONG);
+		PORTB |= (1 << PIN_SCL);
+		if (!i2c_wait_scl()) break;
+		_delay_us(WAIT_SHORT);
+	}
+
+	DDRB |= (1 << PIN_SDA);
+
+	i2c_last_error = I2C_OK;
+	if (!(PINB & (1 << PIN_SDA))) return I2C_ERROR_BUS;
+
+	// a stop from a known state (SCL low first, so SDA going low is not a start)
+	PORTB &= ~(1 << PIN_SCL);
+	_delay_us(WAIT_SHORT);
+	if (i2c_stop() != I2C_OK) {
+		i2c_last_error = I2C_OK;
+		return I2C_ERROR_BUS;
+	}
+
+	return I2C_OK;
+}
+
+// address in write form (the read one is derived from it), tx_len bytes from tx
+// are written first and then rx_len bytes are read into rx (a stop + start goes
+// between both parts). Returns 0 if there's already a transaction in progress
+static uint8_t i2c_async_transfer(uint8_t address, const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len) {
+	if (i2c_async_busy()) return 0;
+
+	i2c_async_address = address & 0xFE;
+	i2c_async_tx = tx;
+	i2c_async_tx_len = tx_len;
+	i2c_async_rx = rx;
+	i2c_async_rx_len = rx_len;
+	i2c_async_reading = (tx_len == 0);
+	i2c_async_state = I2C_ASYNC_BUSY;
+
+	if (i2c_start() != I2C_OK) {
+		i2c_async_state = I2C_ASYNC_ERROR;
+		return 1;
+	}
+
+	// the overflow flag is still set by the last blocking transfer: cleared
+	// (i2c_async_send) before enabling its interrupt, or it would fire right away
+	i2c_async_send(i2c_async_address | i2c_async_reading);
+	USICR |= (1 << USIOIE);
+	i2c_clock_start();
+
+	return 1;
+}
+
+#ifdef __AVR__
+
+// one SCL toggle every compare match. Written by hand in order to touch neither
+// SREG nor any register (sbic/sbis/sbi/cbi/rjmp only), and with sei first as
+// V-USB requires
+ISR(TIMER0_COMPA_vect, ISR_NAKED) {
+	asm volatile(
+		"sei" "\n\t"
+		"sbic %[usisr], %[usioif]" "\n\t"	// byte done, wait for the USI interrupt
+		"reti" "\n\t"
+		"sbis %[portb], %[scl]" "\n\t"		// driving SCL low? release it right away
+		"rjmp 1f" "\n\t"
+		"sbis %[pinb], %[scl]" "\n\t"		// released but still low: clock stretching
+		"rjmp 2f" "\n\t"
+		"sbic %[gpior0], %[stretched]" "\n\t"	// high, but only since the stretch ended
+		"rjmp 3f" "\n\t"
+		"1: sbi %[usicr], %[usitc]" "\n\t"
+		"reti" "\n\t"
+		"2: sbi %[gpior0], %[stretched]" "\n\t"
+		"reti" "\n\t"
+		"3: cbi %[gpior0], %[stretched]" "\n\t"
+		"reti" "\n\t"
+		::
+		[usisr] "I" (_SFR_IO_ADDR(USISR)), [usioif] "I" (USIOIF),
+		[portb] "I" (_SFR_IO_ADDR(PORTB)), [pinb] "I" (_SFR_IO_ADDR(PINB)),
+		[scl] "I" (PIN_SCL),
+		[gpior0] "I" (_SFR_IO_ADDR(GPIOR0)), [stretched] "I" (I2C_STRETCHED_BIT),
+		[usicr] "I" (_SFR_IO_ADDR(USICR)), [usitc] "I" (USITC)
+	);
+}
+
+// USIOIF is only cleared by writing it, so the overflow interrupt is masked
+// before enabling the interrupts again (otherwise it would fire right away)
+// and the rest is done in a regular handler (see below)
+void __vector_i2c_async_overflow(void) __attribute__((signal, used));
+
+ISR(USI_OVF_vect, ISR_NAKED) {
+	asm volatile(
+		"cbi %[usicr], %[usioie]" "\n\t"
+		"sei" "\n\t"
+		"rjmp __vector_i2c_async_overflow" "\n\t"
+		::
+		[usicr] "I" (_SFR_IO_ADDR(USICR)), [usioie] "I" (USIOIE)
+	);
+}
+
+#else
+
+// host build (see host/mock_avr.c): the same two vectors in C
+void __vector_i2c_async_overflow(void);
+
+ISR(TIMER0_COMPA_vect) {
+	if (USISR & (1 << USIOIF)) return;
+
+	if (PORTB & (1 << PIN_SCL)) {
+		if (!(PINB & (1 << PIN_SCL))) {
+			GPIOR0 |= (1 << I2C_STRETCHED_BIT);
+			return;
+		}
+
+		if (GPIOR0 & (1 << I2C_STRETCHED_BIT)) {
+			GPIOR0 &= ~(1 << I2C_STRETCHED_BIT);
+			return;
+		}
+	}
+
+	USICR |= (1 << USITC);
+}
+
+ISR(USI_OVF_vect) {
+	USICR &= ~(1 << USIOIE);
+	__vector_i2c_async_overflow();
+}
+
+#endif
+
+void __vector_i2c_async_overflow(void) {
+	uint8_t data = USIDR;
+
+	switch (i2c_async_phase) {
+		case I2C_PHASE_TX:
+			// wait for ack
+			DDRB &= ~(1 << PIN_SDA);
+			USIDR = 0xFF;
+			i2c_async_phase = I2C_PHASE_TX_ACK;
+			USISR = USISR_CLOCK_1_BIT;
+			break;
+
+		case I2C_PHASE_TX_ACK:
+			DDRB |= (1 << PIN_SDA);
+
+			if (data & 0x01) {
+				i2c_async_defer(I2C_PENDING_STOP, I2C_ASYNC_NACK);
+				return;
+			}
+
+			if (i2c_async_reading) {
+				i2c_async_receive();
+			} else if (i2c_async_tx_len) {
+				i2c_async_tx_len--;
+				i2c_async_send(*i2c_async_tx++);
+			} else if (i2c_async_rx_len) {
+				i2c_async_defer(I2C_PENDING_RESTART, 0);
+				return;
+			} else {
+				i2c_async_defer(I2C_PENDING_STOP, I2C_ASYNC_DONE);
+				return;
+			}
+			break;
+
+		case I2C_PHASE_RX:
+			*i2c_async_rx++ = data;
+			i2c_async_rx_len--;
+
+			// ack if more bytes are coming, nack for the last one
+			DDRB |= (1 << PIN_SDA);
+			USIDR = i2c_async_rx_len ? 0x00 : 0xFF;
+			i2c_async_phase = I2C_PHASE_RX_ACK;
+			USISR = USISR_CLOCK_1_BIT;
+			break;
+
+		default: // I2C_PHASE_RX_ACK
+			USIDR = 0xFF;
+
+			if (!i2c_async_rx_len) {
+				i2c_async_defer(I2C_PENDING_STOP, I2C_ASYNC_DONE);
+				return;
+			}
+
+			i2c_async_receive();
+			break;
+	}
+
+	USICR |= (1 << USIOIE);
+}
@@ -5,6 +5,71 @@
 #define WAIT_LONG				5 // 4,7us
 #define WAIT_SHORT 				4 // 4,0us
 
+// fast mode (400kHz) timing, see i2c_set_speed
+#define WAIT_LONG_FAST			1.3 // 1,3us
+#define WAIT_SHORT_FAST			0.6 // 0,6us
+
+#define I2C_SPEED_STANDARD		0
+#define I2C_SPEED_FAST			1
+
 // USISR mask
 #define USISR_CLOCK_8_BITS		0b11110000
-#define USISR_CLOCK_1_BIT  		0b11111110
\ No newline at end of file
+#define USISR_CLOCK_1_BIT  		0b11111110
+
+// interrupt-driven transactions (see i2c_async_transfer)
+#define I2C_ASYNC_IDLE			0
+#define I2C_ASYNC_BUSY			1
+#define I2C_ASYNC_DONE			2
+#define I2C_ASYNC_NACK			3
+#define I2C_ASYNC_ERROR			4 // bus stuck (see I2C_ERROR_*), needs i2c_recover
+
+// error codes (see i2c_error)
+#define I2C_OK					0
+#define I2C_ERROR_TIMEOUT		1 // SCL held low (clock stretching?) for too long
+#define I2C_ERROR_BUS			2 // still stuck after i2c_recover
+
+// every wait for SCL gives up after this (in us). The controllers don't
+// stretch the clock at all, so anything close to this is a stuck bus. It's
+// also what make wcet counts for every clock of a blocking transaction (a
+// 6 byte read with its pointer is ~80 of them), so keep it short
+#ifndef I2C_SCL_TIMEOUT_US
+#define I2C_SCL_TIMEOUT_US		100
+#endif
+
+// what the USI counter was clocking when it overflowed
+#define I2C_PHASE_TX			0 // address or data byte (primary -> device)
+#define I2C_PHASE_TX_ACK		1 // ack bit after a TX byte
+#define I2C_PHASE_RX			2 // data byte (device -> primary)
+#define I2C_PHASE_RX_ACK		3 // ack/nack bit after a RX byte
+
+// 1 = the blocking transfers are clocked by Timer0 too (i2c_transfer only waits
+// for the USI counter overflow instead of toggling SCL itself, see
+// i2c_clock_bits). The bits come out exactly as long as the compare value makes
+// them, but no CPU time is given back: the CPU waits for the overflow anyway, with
+// the strobe interrupts on top (most of it at 400kHz). Off by default, Timer0 only
+// clocks the background transactions then (see i2c_async_transfer)
+#ifndef I2C_TIMER0_CLOCK
+#define I2C_TIMER0_CLOCK		0
+#endif
+
+// I2C_TIMER0_CLOCK: the longest wait for a counter overflow (in us), a whole byte
+// at 100kHz (16 half periods) plus I2C_SCL_TIMEOUT_US of clock stretching
+#define I2C_TIMER0_TRANSFER_US	(16 * 5 + I2C_SCL_TIMEOUT_US)
+
+// Timer0 (CTC mode, no prescaler) compare value for the SCL strobes: one toggle
+// every half period. Computed from F_CPU as a whole (16.5MHz isn't a round number
+// of cycles per us) so it's 83 cycles per half period, 99.4kHz
+#define I2C_CLOCK_HZ			100000
+#define I2C_TIMER0_OCR0A		(F_CPU / (2UL * I2C_CLOCK_HZ) - 1)
+
+// same for fast mode. Both halves are the same, and SCL low has to be 1.3us at
+// least: 400kHz would be 20 cycles per half period (1.2us, less with the strobe
+// latency), so it's 330kHz, 25 cycles (1.5us). The strobe ISR takes ~14 of
+// them, so the main loop runs slower while a fast transaction is in progress
+// (but the transaction itself is 3 times shorter)
+#define I2C_CLOCK_HZ_FAST		330000
+#define I2C_TIMER0_OCR0A_FAST	(F_CPU / (2UL * I2C_CLOCK_HZ_FAST) - 1)
+
+// GPIOR0 bit set by the strobe ISR when a device is stretching the clock: once
+// SCL goes high it's left alone for one more match (see TIMER0_COMPA_vect)
+#define I2C_STRETCHED_BIT		0
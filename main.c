@@ -25,18 +25,39 @@
 
 #define LED_PIN	4
 
+// polling profiles: how often the host asks for a report (bInterval of the
+// interrupt endpoint). USB_POLL_PROFILE is the default one, and it can be
+// changed at plug-in by holding SELECT and UP (10ms), RIGHT (20ms) or DOWN (100ms)
+// (see the README for the time budget of each one)
+#define USB_POLL_PROFILE_10MS	0
+#define USB_POLL_PROFILE_20MS	1
+#define USB_POLL_PROFILE_100MS	2
+
+#ifndef USB_POLL_PROFILE
+#define USB_POLL_PROFILE		USB_POLL_PROFILE_10MS
+#endif
+
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>  /* for sei() */
+#include <avr/eeprom.h>     /* for the button layout */
 #include <util/delay.h>     /* for _delay_ms() */
 
 #include <avr/pgmspace.h>   /* required by usbdrv.h */
 #include "usbdrv.h"
 
 #include "nesminicontrollerdrv.c"
+#include "sampler.c"
+#include "report.c"
+#include "profiler.c"
+#include "stack.c"
 
 // also change USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH on usbconfig.h
-PROGMEM const char usbHidReportDescriptor[27] = {
+// (both descriptors must have the same length, it's in the configuration descriptor)
+
+// SNES Mini (and default) descriptor, 12 buttons, 2 bytes
+// (+ the button layout and diagnostics feature report on both)
+PROGMEM const char usbHidReportDescriptor[49] = {
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
     0x09, 0x04,                    // USAGE (Mouse)
     0xA1, 0x01,                    // COLLECTION (Application)
@@ -50,72 +71,384 @@ PROGMEM const char usbHidReportDescriptor[27] = {
     0x81, 0x02,                    //   INPUT (Data,Var,Abs)
     0x95, 0x04,                    //   REPORT_COUNT (4), padding to reach 2 bytes
 	0x81, 0x03,                    //   INPUT (Cnst,Var,Abs)
+    0x06, 0x00, 0xFF,              //   USAGE_PAGE (Vendor Defined 0xFF00)
+    0x09, 0x01,                    //   USAGE (Vendor Usage 1), button layout (see snes_set_layout)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xFF, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x10,                    //   REPORT_COUNT (16)
+    0xB1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x09, 0x02,                    //   USAGE (Vendor Usage 2), diagnostics (see diagnostics.c)
+    0x95, 0x10,                    //   REPORT_COUNT (16)
+    0xB1, 0x03,                    //   FEATURE (Cnst,Var,Abs), read only
+    0xC0,                          // END_COLLECTION
+};
+
+// NES Mini descriptor, 8 buttons, 1 byte (the unit items are there
+// just to match the length of the SNES one)
+PROGMEM const char nesHidReportDescriptor[49] = {
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x04,                    // USAGE (Joystick)
+    0xA1, 0x01,                    // COLLECTION (Application)
+    0x05, 0x09,                    //   USAGE_PAGE (Button)
+    0x19, 0x01,                    //   USAGE_MINIMUM
+    0x29, 0x08,                    //   USAGE_MAXIMUM
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x55, 0x00,                    //   UNIT_EXPONENT (0)
+    0x65, 0x00,                    //   UNIT (None)
+    0x95, 0x08,                    //   REPORT_COUNT (8)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x06, 0x00, 0xFF,              //   USAGE_PAGE (Vendor Defined 0xFF00)
+    0x09, 0x01,                    //   USAGE (Vendor Usage 1), button layout (see snes_set_layout)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xFF, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x10,                    //   REPORT_COUNT (16)
+    0xB1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x09, 0x02,                    //   USAGE (Vendor Usage 2), diagnostics (see diagnostics.c)
+    0x95, 0x10,                    //   REPORT_COUNT (16)
+    0xB1, 0x03,                    //   FEATURE (Cnst,Var,Abs), read only
     0xC0,                          // END_COLLECTION
 };
 
-static snes_report_t report_buffer;
+// same as the V-USB one (usbdrv.c) but with the poll interval as a parameter
+#define USB_CONFIGURATION_DESCRIPTOR_LENGTH	34
+#define USB_CONFIGURATION_DESCRIPTOR_HID	18 // where the HID descriptor starts
+
+#define USB_CONFIGURATION_DESCRIPTOR(interval) { \
+    9,                             /* bLength */ \
+    USBDESCR_CONFIG,               /* bDescriptorType */ \
+    USB_CONFIGURATION_DESCRIPTOR_LENGTH, 0, /* wTotalLength (with the ones below) */ \
+    1,                             /* bNumInterfaces */ \
+    1,                             /* bConfigurationValue */ \
+    0,                             /* iConfiguration */ \
+    (char)(1 << 7),                /* bmAttributes (bus powered) */ \
+    USB_CFG_MAX_BUS_POWER / 2,     /* bMaxPower (2mA units) */ \
+    9,                             /* bLength */ \
+    USBDESCR_INTERFACE,            /* bDescriptorType */ \
+    0,                             /* bInterfaceNumber */ \
+    0,                             /* bAlternateSetting */ \
+    1,                             /* bNumEndpoints */ \
+    USB_CFG_INTERFACE_CLASS,       /* bInterfaceClass */ \
+    USB_CFG_INTERFACE_SUBCLASS,    /* bInterfaceSubClass */ \
+    USB_CFG_INTERFACE_PROTOCOL,    /* bInterfaceProtocol */ \
+    0,                             /* iInterface */ \
+    9,                             /* bLength */ \
+    USBDESCR_HID,                  /* bDescriptorType */ \
+    0x01, 0x01,                    /* bcdHID */ \
+    0x00,                          /* bCountryCode */ \
+    0x01,                          /* bNumDescriptors */ \
+    0x22,                          /* bDescriptorType (report) */ \
+    USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0, /* wDescriptorLength */ \
+    7,                             /* bLength */ \
+    USBDESCR_ENDPOINT,             /* bDescriptorType */ \
+    (char)0x81,                    /* bEndpointAddress (IN 1) */ \
+    0x03,                          /* bmAttributes (interrupt) */ \
+    8, 0,                          /* wMaxPacketSize */ \
+    (interval),                    /* bInterval (ms) */ \
+}
+
+// one for every polling profile (USB_POLL_PROFILE_*)
+PROGMEM const char usbConfigurationDescriptors[][USB_CONFIGURATION_DESCRIPTOR_LENGTH] = {
+	USB_CONFIGURATION_DESCRIPTOR(10),
+	USB_CONFIGURATION_DESCRIPTOR(20),
+	USB_CONFIGURATION_DESCRIPTOR(100),
+};
+
+static uchar usb_poll_profile = USB_POLL_PROFILE;
+
+#define usb_poll_interval() \
+	pgm_read_byte(&usbConfigurationDescriptors[usb_poll_profile][USB_CONFIGURATION_DESCRIPTOR_LENGTH - 1])
+
 static snes_controller_state controller_state = { 0, 0 };
 
-// implementation required, but not used
+// controller type the host was told about with the report descriptor
+// (0xFF = not asked yet)
+static uchar usb_controller_type = 0xFF;
+
+// the controller type the reports are for (the one attached, until the host asks)
+#define usb_report_type() (usb_controller_type == 0xFF ? controller_state.type : usb_controller_type)
+
+// feature report: the button layout (read / write) and the diagnostics (read only,
+// ignored when written). Same buffer to send it and to receive it (see usbFunctionWrite)
+static struct{
+	uint8_t			layout[SNES_LAYOUT_LENGTH];
+	diagnostics_t	diagnostics;
+}feature_report;
+
+static uchar feature_received;
+static uchar feature_expected;
+
+// vendor requests (bmRequestType vendor, device to host)
+#define VENDOR_RQ_GET_EVENTS	1 // queued button changes, see sampler_drain_events (SAMPLER_EVENTS only)
+#define VENDOR_RQ_GET_TIMING	2 // poll interval (ms) + the measured sampler_timing_t
+#define VENDOR_RQ_GET_PROFILE	3 // profiler_phases (PROFILER only)
+#define VENDOR_RQ_RESET_PROFILE	4 // clears them (PROFILER only)
+#define VENDOR_RQ_GET_STACK		5 // stack_report_t, see stack.c
+
+static struct{
+	uint8_t				interval;
+	sampler_timing_t	sampler;
+}usb_timing_report;
+
+// HID report types (high byte of wValue on GET_REPORT / SET_REPORT)
+#define HID_REPORT_TYPE_INPUT	1
+#define HID_REPORT_TYPE_FEATURE	3
+
+// HID class requests: GET_REPORT (latest sample over the control pipe, or the
+// button layout), SET_REPORT (new button layout) and GET_IDLE / SET_IDLE (how
+// often the report is sent again if nothing changes)
 usbMsgLen_t usbFunctionSetup(uchar data[8]) {
+	usbRequest_t *rq = (void *)data;
+
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR) {
+		switch (rq->bRequest) {
+#if SAMPLER_EVENTS
+			case VENDOR_RQ_GET_EVENTS:
+				usbMsgPtr = (usbMsgPtr_t)sampler_events_batch;
+				return sampler_drain_events(rq->wLength.word);
+#endif
+
+			case VENDOR_RQ_GET_TIMING:
+				usb_timing_report.interval = usb_poll_interval();
+				sampler_get_timing(&usb_timing_report.sampler);
+				usbMsgPtr = (usbMsgPtr_t)&usb_timing_report;
+				return sizeof(usb_timing_report);
+
+#if PROFILER
+			case VENDOR_RQ_GET_PROFILE:
+				usbMsgPtr = (usbMsgPtr_t)profiler_phases;
+				return sizeof(profiler_phases);
+
+			case VENDOR_RQ_RESET_PROFILE:
+				profiler_reset();
+				return 0;
+#endif
+
+			case VENDOR_RQ_GET_STACK:
+				stack_measure();
+				usbMsgPtr = (usbMsgPtr_t)&stack_report;
+				return sizeof(stack_report);
+		}
+
+		return 0;
+	}
+
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS) return 0;
+
+	switch (rq->bRequest) {
+		case USBRQ_HID_GET_REPORT: // wValue: report type (high byte), report ID (low byte), no IDs here
+			if (rq->wValue.bytes[1] == HID_REPORT_TYPE_FEATURE) {
+				for (uchar x = 0; x < SNES_LAYOUT_LENGTH; x++) feature_report.layout[x] = snes_layout[x];
+
+				diagnostics.oversampling = SAMPLER_OVERSAMPLING;
+				diagnostics.samples_per_report = sampler_samples_per_report;
+				feature_report.diagnostics = diagnostics;
+
+				usbMsgPtr = (usbMsgPtr_t)&feature_report;
+				return sizeof(feature_report);
+			}
+
+			snes_set_report_buttons(&controller_state, &report_buffer);
+			usbMsgPtr = (usbMsgPtr_t)&report_buffer;
+			return report_length(usb_report_type());
+
+		case USBRQ_HID_SET_REPORT:
+			if (rq->wValue.bytes[1] != HID_REPORT_TYPE_FEATURE) return 0;
+
+			feature_received = 0;
+			feature_expected = rq->wLength.word < sizeof(feature_report) ? rq->wLength.word : sizeof(feature_report);
+			return USB_NO_MSG; // data comes in usbFunctionWrite
+
+		case USBRQ_HID_GET_IDLE:
+			usbMsgPtr = (usbMsgPtr_t)&report_idle_rate;
+			return 1;
+
+		case USBRQ_HID_SET_IDLE: // wValue: duration (high byte), report ID (low byte)
+			report_set_idle_rate(rq->wValue.bytes[1], ticks_now());
+			return 0;
+	}
+
 	return 0;
 }
 
-int __attribute__((noreturn)) main(void) {
+// SET_REPORT data (the new layout, the diagnostics after it are ignored), 8 bytes
+// at most every call. Only the layout is enough too
+uchar usbFunctionWrite(uchar *data, uchar len) {
+	for (uchar x = 0; x < len && feature_received < feature_expected; x++) {
+		((uint8_t *)&feature_report)[feature_received++] = data[x];
+	}
 
-	DDRB |= (1 << LED_PIN);
+	if (feature_received < feature_expected) return 0; // more to come
+	if (feature_received < SNES_LAYOUT_LENGTH) return 1; // too short, not a layout
+
+	snes_set_layout(feature_report.layout);
+	report_force = 1; // same buttons, different report
+
+	return 1;
+}
+
+// the configuration descriptor depends on the polling profile and the
+// report descriptor on the controller attached
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+	switch (rq->wValue.bytes[1]) {
+		case USBDESCR_CONFIG:
+			usbMsgPtr = (usbMsgPtr_t)usbConfigurationDescriptors[usb_poll_profile];
+			return USB_CONFIGURATION_DESCRIPTOR_LENGTH;
+
+		case USBDESCR_HID:
+			usbMsgPtr = (usbMsgPtr_t)&usbConfigurationDescriptors[usb_poll_profile][USB_CONFIGURATION_DESCRIPTOR_HID];
+			return 9;
+
+		case USBDESCR_HID_REPORT:
+			diagnostics_enumerated(ticks_now());
+			usb_controller_type = controller_state.type;
+			usbMsgPtr = (usbMsgPtr_t)(usb_controller_type == SNES_TYPE_NES_MINI ? nesHidReportDescriptor : usbHidReportDescriptor);
+			return sizeof(usbHidReportDescriptor);
+	}
+
+	return 0;
+}
 
+// SELECT + a direction while plugging the adapter changes the polling profile
+// (only for this time, it's not saved)
+static void usb_select_poll_profile() {
+	if (!controller_state.connected) return;
+
+	snes_get_state(&controller_state);
+	if (!(controller_state.buttons & NES_BUTTON_SELECT)) return;
+
+	if (controller_state.buttons & NES_BUTTON_UP) usb_poll_profile = USB_POLL_PROFILE_10MS;
+	else if (controller_state.buttons & NES_BUTTON_RIGHT) usb_poll_profile = USB_POLL_PROFILE_20MS;
+	else if (controller_state.buttons & NES_BUTTON_DOWN) usb_poll_profile = USB_POLL_PROFILE_100MS;
+}
+
+// fake USB disconnect for > 250 ms, so the host enumerates the device again.
+// Only the USB interrupt is masked while disconnected (its handler would hang),
+// the rest keep going (Timer1 for the ticks, the I2C ones). noinline, so
+// tools/wcet.bounds can leave it out by name
+static void __attribute__((noinline)) usb_reenumerate() {
+	uchar enabled = USB_INTR_ENABLE & (1 << USB_INTR_ENABLE_BIT); // not yet before usbInit
 	uchar i;
 
-	wdt_enable(WDTO_1S);
-	
-	usbInit();
-	usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
+	USB_INTR_ENABLE &= ~(1 << USB_INTR_ENABLE_BIT);
+	usbDeviceDisconnect();
 	i = 0;
-	while(--i) {             /* fake USB disconnect for > 250 ms */
-		wdt_reset(); 
+	while(--i) {
+		wdt_reset();
 		_delay_ms(1);
 	}
-
 	usbDeviceConnect();
-	sei();
+	USB_INTR_PENDING = (1 << USB_INTR_PENDING_BIT); // whatever it saw while disconnected
+	USB_INTR_ENABLE |= enabled;
+}
+
+int __attribute__((noreturn)) main(void) {
+
+	diagnostics_init();
+
+	DDRB |= (1 << LED_PIN);
+
+	wdt_enable(WDTO_1S);
 
 	// i2c_init, basically
 	snes_init();
 
+	// the controller goes first, before the host asks for the descriptors: the polling
+	// profile may be chosen with it. The I2C and Timer1 interrupts need sei (the USB
+	// one is not enabled yet, until usbInit)
+	sei();
+
 	// snes first connect attempt (will set the connected flag to 1/0)
 	snes_connect(&controller_state);
+	usb_select_poll_profile();
+	sampler_init(usb_poll_interval());
+	profiler_init();
+
+	usb_reenumerate(); /* enforce re-enumeration */
+	cli();
+	usbInit();
+	sei();
 
 	while(1) {
+		profiler_begin(loop_started);
+
 		wdt_reset();
+
+		profiler_begin(usb_poll_started);
 		usbPoll();
-		if (usbInterruptIsReady()) {
-			// called after every poll of the interrupt endpoint
-
-			if (controller_state.connected) {
-				// fetch (or try to) only if connected (in the snes the connection
-				// doesn't mind the proper initialization, so if we try to fetch always
-				// then an effective 0x00 will be read without the init, so force
-				// snes_connect everytime the connection is lost)
-				snes_get_state(&controller_state);
-			} else {
-				PORTB |= (1 << LED_PIN);
-				snes_connect(&controller_state);
-				if (controller_state.connected) PORTB &= ~(1 << LED_PIN);
-			}
+		profiler_end(PROFILER_PHASE_USB_POLL, usb_poll_started);
 
-			snes_set_report_buttons(&controller_state, &report_buffer);
+		uint16_t now = ticks_now();
+		sampler_update(now);
+		diagnostics_update(now);
 
-			usbSetInterrupt((void *)&report_buffer, sizeof(report_buffer));
+		// controller missing, or just plugged: cheap presence checks (less often the longer
+		// it's missing) and the init once it answers, one step per iteration (see snes_update_connection)
+		if (!controller_state.connected) {
+			profiler_begin(connect_started);
+			if (snes_update_connection(&controller_state, now)) diagnostics_count(reconnects);
+			profiler_end(PROFILER_PHASE_CONNECT, connect_started);
 		}
 
-		// set led if some key was preset (outside the USB interrupt block)
+		// one step of the controller read between usbPoll calls (it never blocks:
+		// the I2C transactions run in the background and the 5ms wait is just a check).
+		// A new read only starts when the sampler says so (right before the next host poll)
+		profiler_begin(controller_started);
 		if (controller_state.connected) {
-			if (controller_state.buttons) {
-				PORTB |= (1 << LED_PIN);
-			} else {
-				PORTB &= ~(1 << LED_PIN);
+			if (controller_state.step != SNES_STEP_IDLE) {
+				snes_poll_state(&controller_state);
+				if (controller_state.step == SNES_STEP_DONE) {
+					sampler_read_done(ticks_now());
+					sampler_latch(controller_state.buttons);
+				} else if (!controller_state.connected) {
+					sampler_latch(0); // lost it, nothing pressed
+					diagnostics_count(disconnects);
+				}
+			} else if (sampler_should_start(now)) {
+				sampler_read_started(now);
+				snes_poll_state(&controller_state);
+			}
+		}
+		profiler_end(PROFILER_PHASE_CONTROLLER, controller_started);
+
+		if (usbInterruptIsReady() && sampler_report_due(ticks_now())) {
+			// called after every poll of the interrupt endpoint, once the
+			// last sample before the next one is in
+
+			// every change seen since the last report (not just the last sample)
+			uint16_t buttons = sampler_report_buttons();
+
+			if (report_due(buttons, ticks_now())) {
+				profiler_begin(report_started);
+				usbSetInterrupt((void *)&report_buffer, report_build(buttons, usb_report_type(), ticks_now()));
+				sampler_queued(buttons);
+				profiler_end(PROFILER_PHASE_REPORT, report_started);
 			}
 		}
+
+		// a different controller than the one the host knows about (NES Mini
+		// <-> SNES Mini), the report has changed so enumerate again
+		if (controller_state.connected && usb_controller_type != 0xFF && controller_state.type != usb_controller_type) {
+			usb_controller_type = 0xFF;
+			report_force = 1;
+			usb_reenumerate();
+		}
+
+		snes_save_layout_step();
+
+		// set led if some key was preset (outside the USB interrupt block),
+		// always on while there's no controller
+		profiler_begin(led_started);
+		if (!controller_state.connected || controller_state.buttons) {
+			PORTB |= (1 << LED_PIN);
+		} else {
+			PORTB &= ~(1 << LED_PIN);
+		}
+		profiler_end(PROFILER_PHASE_LED, led_started);
+
+		profiler_end(PROFILER_PHASE_LOOP, loop_started);
 	}
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 #define NESMiniControllerDriver_c
 
 #include "i2c_primary.c"
+#include "ticks.c"
+#include "diagnostics.c"
 
 // old I2C library deprecated
 // #include "i2cattiny85.c"
@@ -31,10 +33,77 @@
 #define NES_BUTTON_START 0x0400
 #define NES_BUTTON_SELECT 0x1000
 
+// every known button (the rest of the bits are always 0 once inverted)
+#define NES_BUTTON_ALL (NES_BUTTON_UP | NES_BUTTON_RIGHT | NES_BUTTON_DOWN | NES_BUTTON_LEFT | \
+	NES_BUTTON_A | NES_BUTTON_B | NES_BUTTON_X | NES_BUTTON_Y | \
+	NES_BUTTON_L | NES_BUTTON_R | NES_BUTTON_START | NES_BUTTON_SELECT)
+
+#define NES_BUTTON_SNES_ONLY (NES_BUTTON_X | NES_BUTTON_Y | NES_BUTTON_L | NES_BUTTON_R)
+
+// controller types (see snes_identify)
+#define SNES_TYPE_SNES_MINI	0 // also the default for anything else, everything enabled
+#define SNES_TYPE_NES_MINI	1 // no init, no delay, 1 byte reports
+
+// extension controller ID, 6 bytes from 0xFA
+#define SNES_ID_REGISTER	0xFA
+#define SNES_ID_LENGTH		6
+
+// the ID in snes_read_buffer is a Classic Controller one (xx xx A4 20 xx 01)
+#define snes_read_classic_id()	(snes_read_buffer[2] == 0xA4 && snes_read_buffer[3] == 0x20 && snes_read_buffer[5] == 0x01)
+
+// the SNES Mini needs some time between setting the register pointer and
+// reading from it (the NES Mini seems to work fine without it)
+#define SNES_READ_DELAY_TICKS TICKS_FROM_MS(5)
+
+// the background reads recover a stuck bus (see i2c_recover) and try again, this
+// many times, and give up on a transaction after SNES_I2C_TIMEOUT_TICKS (a 6 byte
+// read at 100kHz takes less than 1ms). The blocking ones (the connection steps)
+// only recover it: a single try each, so a step of the connection is never longer
+// than one transaction and the 5ms delay (see snes_connect_step)
+#define SNES_I2C_RETRIES		2
+#define SNES_I2C_TIMEOUT_TICKS	TICKS_FROM_MS(3)
+
+// while nothing answers (or it answers but doesn't work), the next attempt is
+// after this, twice as long every time (see snes_update_connection)
+#define SNES_DETECT_MIN_TICKS	TICKS_FROM_MS(10)
+#define SNES_DETECT_MAX_TICKS	TICKS_FROM_MS(320)
+
+// steps for the non-blocking read (see snes_poll_state)
+#define SNES_STEP_IDLE		0 // nothing going on, next step writes the pointer
+#define SNES_STEP_POINTER	1 // pointer write in progress
+#define SNES_STEP_WAITING	2 // pointer written, waiting SNES_READ_DELAY_TICKS before reading
+#define SNES_STEP_READING	3 // button bytes read in progress
+#define SNES_STEP_DONE		4 // buttons updated, next step starts over
+
+// steps of the connection (see snes_connect_step), one per main loop iteration:
+// each one is a single blocking read or write (one try, with the 5ms delay), so
+// usbPoll never waits for the whole thing
+#define SNES_CONNECT_IDLE			0 // not connecting
+#define SNES_CONNECT_ID				1 // back to 100kHz and full reads, extension ID
+#define SNES_CONNECT_TYPE			2 // NES Mini or SNES Mini (snes_identify)
+#define SNES_CONNECT_INIT			3 // the init write (not for the NES Mini)
+#define SNES_CONNECT_SPEED			4 // reference read at 100kHz
+#define SNES_CONNECT_FAST			5 // same read at 400kHz, it stays if they match
+#define SNES_CONNECT_REPEATED_START	6 // same read with a repeated start
+#define SNES_CONNECT_REGULAR_READ	7 // regular read again (no repeated start, the bus may be in a weird state)
+#define SNES_CONNECT_DIRECT_READ	8 // only the two button bytes
+#define SNES_CONNECT_FULL_READ		9 // full read again (no direct read)
+#define SNES_CONNECT_DONE			10
+
 // current controller status (buttons pressed, is_connected? etc.)
 typedef struct{
 	uint16_t	buttons;
-	uchar		connected;
+	uchar		connected;	// initialized and identified, ready to be read
+	uchar		present;	// answers its address (maybe not initialized yet)
+	uchar		type;		// SNES_TYPE_*
+	uchar		repeated_start;	// 1 = pointer write + read in a single transaction (see SNES_CONNECT_REPEATED_START)
+	uchar		direct_read;	// 1 = read only the two button bytes (see SNES_CONNECT_DIRECT_READ)
+	uchar		step;		// SNES_STEP_*
+	uchar		connect_step;	// SNES_CONNECT_*
+	uint16_t	step_ticks;	// when the current step started
+	uchar		retries;	// stuck bus recoveries in a row (see snes_poll_failed)
+	uint16_t	detect_ticks;		// last connection attempt
+	uint16_t	detect_interval;	// until the next one
 }snes_controller_state;
 
 // report struct for the gamepad
@@ -43,101 +112,654 @@ typedef struct{
 	uchar   snesButtonMask;		// X, Y, L, R (SNES only), the last bits are not used
 }snes_report_t;
 
+// bytes read from the controller on every poll (buttons are the last two)
+#define SNES_READ_LENGTH 6
+
+// or, in direct read mode, only the two button bytes
+#define SNES_BUTTONS_REGISTER 0x04
+#define SNES_BUTTONS_LENGTH 2
+
+// 1 = a SNES Mini has been seen since the last power-on (see snes_identify). In
+// .noinit, like the watchdog resets of diagnostics.c: a watchdog or external reset
+// doesn't power the controller off, so it's still initialized after it
+#define SNES_SEEN_MAGIC		0xC3 // next to it, "it's not garbage"
+
+static uint8_t snes_mini_seen __attribute__((section(".noinit")));
+static uint8_t snes_mini_seen_magic __attribute__((section(".noinit")));
+
+// register pointer for each mode: from 0x00 or straight to the buttons
+static const uint8_t snes_pointer[] = { 0x00, SNES_BUTTONS_REGISTER };
+static uint8_t snes_read_buffer[SNES_READ_LENGTH];
+
+#define snes_pointer_for(state)		(&snes_pointer[(*state).direct_read])
+#define snes_read_length(state)		((*state).direct_read ? SNES_BUTTONS_LENGTH : SNES_READ_LENGTH)
+
+static void snes_load_layout();
+
+// after diagnostics_init (it keeps the reset cause)
 static void snes_init() {
+	if ((diagnostics.reset_cause & (1 << PORF)) || snes_mini_seen_magic != SNES_SEEN_MAGIC) {
+		snes_mini_seen = 0;
+		snes_mini_seen_magic = SNES_SEEN_MAGIC;
+	}
+
 	i2c_init();
+	ticks_init();
+	snes_load_layout();
+}
+
+static void snes_decode_buttons(snes_controller_state *state);
+static void snes_get_state(snes_controller_state *state);
+static void snes_get_state_repeated_start(snes_controller_state *state);
+static uint8_t snes_read_registers_repeated_start(uint8_t reg, uint8_t length);
+
+static void snes_read_into_buffer(uint8_t length) {
+	for (uint8_t x = 0; x < length; x++) {
+		snes_read_buffer[x] = i2c_read_byte((x >= length - 1) ? 0xFF : 0x00); // nack ("not gonna ask for more" / "stop" / "omgexplosions" when fetching the last one)
+	}
 }
 
-static void snes_connect(snes_controller_state *state) {
+// after a blocking transaction: 1 if the bus got stuck in the middle (then it's
+// recovered, so the transaction can be tried again)
+static uint8_t snes_bus_failed() {
+	if (i2c_error() == I2C_OK) return 0;
 
-	// According to http://wiibrew.org/wiki/Wiimote/Extension_Controllers the way to initialize the
-	// SNES Mini Controller is by writting 0x55 to 0xF0 and 0x00 to 0xFB BUT it seems it works only
-	// with the first write. The NES Mini does not require the init, but works anyway with it
+	diagnostics_count(i2c_timeouts);
+	i2c_recover();
 
+	return 1;
+}
+
+// the controller stopped answering: back to the presence checks. After good reads
+// the interval is the shortest one (it may be plugged again right away), lost
+// before any it keeps growing (see snes_update_connection)
+static void snes_lost(snes_controller_state *state) {
+	(*state).connected = (*state).present = 0;
+	(*state).buttons = 0;
+}
+
+// presence check: just the address (start, address, stop), no init and no
+// register pointer. Returns 1 if it was acknowledged
+static uint8_t snes_detect() {
+	uint8_t nack = 1;
+
+	if (i2c_start() == I2C_OK) nack = i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01;
+	i2c_stop();
+
+	if (snes_bus_failed()) return 0;
+
+	return !nack;
+}
+
+// reads length bytes starting at reg into snes_read_buffer (blocking, with the
+// delay between the pointer and the read, a single try). Returns 0 if nobody
+// answered or the bus got stuck (recovered then)
+static uint8_t snes_read_registers(uint8_t reg, uint8_t length) {
 	i2c_start();
-	
-	if (i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01) (*state).connected = 0;
-	else (*state).connected = 1;
 
-	i2c_write_byte(0xF0); // "address"
-	i2c_write_byte(0x55); // info to write
+	uint8_t nack = i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01;
+	i2c_write_byte(reg);
 	i2c_stop();
+
+	if (i2c_failed()) nack = 1; // no delay for a stuck bus
+	else if (nack) diagnostics_count(i2c_nacks);
+
+	if (!nack) {
+		_delay_ms(5);
+
+		i2c_start();
+		i2c_write_byte(NES_I2C_ADDRESS_READ);
+		snes_read_into_buffer(length);
+		i2c_stop();
+	}
+
+	if (snes_bus_failed()) return 0;
+
+	return !nack;
 }
 
-static void snes_get_state(snes_controller_state *state) {
+// NES Mini or SNES Mini? Both identify themselves as a Classic Controller
+// (xx 00 A4 20 0x 01 on 0xFA), so the ID only tells us it's one of them. The
+// difference is the init: the NES Mini answers with proper data without it,
+// the SNES Mini reads 0x00 (all buttons "pressed", unknown bits included)
+// until it gets it. Called after the ID, before the init.
+//
+// A SNES Mini that already got its init (a reconnection after a glitch, a
+// watchdog reset) answers like a NES Mini, so once a SNES Mini has been seen
+// since the power-on (snes_mini_seen) it's never taken for a NES Mini again.
+// A NES Mini plugged after it passes for a SNES Mini: everything enabled and
+// two report bytes, the X, Y, L and R bits are just never set
+static void snes_identify(snes_controller_state *state) {
+	if (!snes_read_registers(0x00, SNES_READ_LENGTH)) return;
+	snes_decode_buttons(state);
+
+	if ((*state).buttons & ~(NES_BUTTON_ALL & ~NES_BUTTON_SNES_ONLY)) snes_mini_seen = 1;
+	else if (!snes_mini_seen) (*state).type = SNES_TYPE_NES_MINI;
+	(*state).buttons = 0;
+}
+
+// According to http://wiibrew.org/wiki/Wiimote/Extension_Controllers the way to initialize the
+// SNES Mini Controller is by writting 0x55 to 0xF0 and 0x00 to 0xFB BUT it seems it works only
+// with the first write. The NES Mini does not require the init, so it's skipped for it
+static void snes_write_init(snes_controller_state *state) {
 	i2c_start();
 
-	if (i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01) (*state).connected = 0;
-	else (*state).connected = 1;
+	if (i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01) {
+		(*state).connected = 0;
+		diagnostics_count(i2c_nacks);
+	} else {
+		(*state).connected = 1;
+	}
 
-	i2c_write_byte(0x00); // we're gonna read from 0x00
+	i2c_write_byte(0xF0); // "address"
+	i2c_write_byte(0x55); // info to write
 	i2c_stop();
 
+	if (snes_bus_failed()) (*state).connected = 0;
+}
+
+// 1 if the last read doesn't match the reference one (or has garbage bits)
+#define snes_read_differs(state, reference) \
+	(!(*state).connected || (*state).buttons != (reference) || ((*state).buttons & ~NES_BUTTON_ALL))
+
+// one step of the connection (start it with connect_step = SNES_CONNECT_ID): the
+// ID and the type, the init, then the faster modes are tried one by one against
+// a regular read at 100kHz (the fast mode, a repeated start instead of the stop
+// and the delay, 2 bytes instead of 6), each one kept only if it reads the same.
+// connected stays 0 until the last step (so the main loop doesn't read it in the
+// middle) and connect_step goes back to SNES_CONNECT_IDLE when it's over: then
+// connected says how it went
+static void snes_connect_step(snes_controller_state *state) {
+	uint16_t reference = (*state).buttons;
+	uchar step = (*state).connect_step;
+
+	(*state).connect_step = step + 1;
+
+	switch (step) {
+		case SNES_CONNECT_ID:
+			i2c_set_speed(I2C_SPEED_STANDARD);
+			i2c_set_repeated_start(0);
+			(*state).repeated_start = (*state).direct_read = 0;
+			(*state).retries = 0;
+			(*state).type = SNES_TYPE_SNES_MINI;
+
+			(*state).connected = snes_read_registers(SNES_ID_REGISTER, SNES_ID_LENGTH);
+
+			// not a Classic Controller ID: taken for a SNES Mini, everything enabled
+			if (!snes_read_classic_id()) (*state).connect_step = SNES_CONNECT_INIT;
+			break;
+
+		case SNES_CONNECT_TYPE:
+			snes_identify(state);
+			(*state).connected = 1; // it answered the ID, whatever the type read did
+			if ((*state).type == SNES_TYPE_NES_MINI) (*state).connect_step = SNES_CONNECT_SPEED;
+			break;
+
+		case SNES_CONNECT_INIT:
+			snes_write_init(state);
+			break;
+
+		case SNES_CONNECT_SPEED:
+			snes_get_state(state);
+			break;
+
+		case SNES_CONNECT_FAST:
+			i2c_set_speed(I2C_SPEED_FAST);
+			snes_get_state(state);
+
+			if (snes_read_differs(state, reference)) {
+				i2c_set_speed(I2C_SPEED_STANDARD);
+				(*state).connected = 1; // it was fine at 100kHz
+				(*state).buttons = reference;
+			}
+			break;
+
+		case SNES_CONNECT_REPEATED_START:
+			// the same buttons as the regular read don't prove much alone: with
+			// nothing pressed, stale data or the 0xFF of a NACKed read match too.
+			// So the ID first, another register with known bytes: it only reads
+			// right if the pointer written before the repeated start was taken,
+			// and then the buttons, the pointer moved back, have to match again
+			(*state).repeated_start = snes_read_registers_repeated_start(SNES_ID_REGISTER, SNES_ID_LENGTH) && snes_read_classic_id();
+
+			if ((*state).repeated_start) {
+				snes_get_state_repeated_start(state);
+				(*state).repeated_start = !snes_read_differs(state, reference);
+			}
+
+			i2c_set_repeated_start((*state).repeated_start);
+
+			if ((*state).repeated_start) (*state).connect_step = SNES_CONNECT_DIRECT_READ;
+			else (*state).connected = 1; // the regular read decides
+			break;
+
+		case SNES_CONNECT_REGULAR_READ:
+		case SNES_CONNECT_FULL_READ:
+			snes_get_state(state);
+			(*state).connect_step = step == SNES_CONNECT_REGULAR_READ ? SNES_CONNECT_DIRECT_READ : SNES_CONNECT_DONE;
+			break;
+
+		case SNES_CONNECT_DIRECT_READ:
+			(*state).direct_read = 1;
+			if ((*state).repeated_start) snes_get_state_repeated_start(state);
+			else snes_get_state(state);
+
+			if (snes_read_differs(state, reference)) {
+				(*state).direct_read = 0;
+				(*state).connected = 1; // the full read decides
+			} else {
+				(*state).connect_step = SNES_CONNECT_DONE;
+			}
+			break;
+	}
+
 	if (!(*state).connected) {
-		(*state).buttons = 0;
-		return;
+		(*state).connect_step = SNES_CONNECT_IDLE;
+	} else if ((*state).connect_step == SNES_CONNECT_DONE) {
+		(*state).connect_step = SNES_CONNECT_IDLE;
+		(*state).step = SNES_STEP_IDLE;
+	} else {
+		(*state).connected = 0; // not yet
+	}
+}
+
+// blocking version, all the steps in a row (~35ms with a SNES Mini): only before
+// usbInit and on the host benchmarks. noinline, so the loop has a name in
+// tools/wcet.bounds
+static void __attribute__((noinline)) snes_connect(snes_controller_state *state) {
+	(*state).connect_step = SNES_CONNECT_ID;
+	while ((*state).connect_step != SNES_CONNECT_IDLE) snes_connect_step(state);
+
+	(*state).present = (*state).connected;
+}
+
+// connection manager, call it every main loop iteration while the controller is not
+// connected. One attempt every detect_interval, doubling it every time up to
+// SNES_DETECT_MAX_TICKS: nothing attached, a presence check (snes_detect); something
+// answers (just plugged, or never initialized), the connection, one step per call
+// from there (snes_connect_step). A controller that connects but then doesn't read
+// right (unknown bits, see snes_poll_state) is tried again at the same pace, only a
+// good read brings the interval back to the shortest one. Returns 1 when it's
+// connected again
+static uint8_t snes_update_connection(snes_controller_state *state, uint16_t now) {
+	if ((*state).connect_step == SNES_CONNECT_IDLE) {
+		if ((uint16_t)(now - (*state).detect_ticks) < (*state).detect_interval) return 0;
+
+		(*state).detect_ticks = now;
+		if ((*state).detect_interval < SNES_DETECT_MIN_TICKS) (*state).detect_interval = SNES_DETECT_MIN_TICKS;
+		else if ((*state).detect_interval < SNES_DETECT_MAX_TICKS) (*state).detect_interval <<= 1;
+
+		if (!(*state).present) {
+			// the presence check alone this time, the connection starts on the next call
+			(*state).present = snes_detect();
+			if ((*state).present) (*state).connect_step = SNES_CONNECT_ID;
+			return 0;
+		}
+
+		(*state).connect_step = SNES_CONNECT_ID;
 	}
 
-	_delay_ms(5); // the nes mini controller seems to work fine without this delay
+	snes_connect_step(state);
+	if ((*state).connected) return 1;
+
+	// answers but it doesn't work (yet?), same as if it wasn't there
+	if ((*state).connect_step == SNES_CONNECT_IDLE) (*state).present = 0;
+	return 0;
+}
+
+// sets the register pointer (0x00, or the buttons in direct read mode), updating the connected flag
+static void snes_write_pointer(snes_controller_state *state) {
+	i2c_start();
+
+	if (i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01) {
+		(*state).connected = 0;
+		diagnostics_count(i2c_nacks);
+	} else {
+		(*state).connected = 1;
+	}
+
+	i2c_write_byte(*snes_pointer_for(state));
+	i2c_stop();
+
+	if (!(*state).connected) (*state).buttons = 0;
+}
+
+// converts the last two bytes of a read (inverted, 0 = pressed) into the buttons bitmask
+static void snes_decode_buttons(snes_controller_state *state) {
+	uint8_t *read = &snes_read_buffer[snes_read_length(state) - 2];
+	(*state).buttons = ((uint16_t)(read[0] ^ 0xFF) << 8) | (read[1] ^ 0xFF); // "255 - read"
+}
+
+static void snes_read_bytes(snes_controller_state *state) {
+	snes_read_into_buffer(snes_read_length(state));
+}
 
+static void snes_read_buttons(snes_controller_state *state) {
 	i2c_start();
 
 	i2c_write_byte(NES_I2C_ADDRESS_READ); // read
 
 	// read 6 bytes, use only the last two ones
 	// (need to "read" the first 4 bytes in order
-	// to "advance" to the last two ones)
-	uint16_t buttons = 0;
-	uint8_t read = 0;
-	for (char x = 0; x < 6; x++) {
-		read = i2c_read_byte((x >= 5) ? 0xFF : 0x00); // nack ("not gonna ask for more" / "stop" / "omgexplosions" when fetching the last one)
-
-		if (x >= 4) {
-			read ^= 0xFF; // "255 - read"
-			buttons |= read;
-			if (x == 4) buttons <<= 8;
-		}
+	// to "advance" to the last two ones, unless
+	// we're in direct read mode)
+	snes_read_bytes(state);
+
+	i2c_stop();
+
+	snes_decode_buttons(state);
+}
+
+// blocking version, everything in a row (only for places where
+// stalling the main loop for a few ms doesn't matter). A single try: a
+// stuck bus is recovered and the controller taken as not connected
+static void snes_get_state(snes_controller_state *state) {
+	snes_write_pointer(state);
+
+	if ((*state).connected) {
+		if ((*state).type != SNES_TYPE_NES_MINI) _delay_ms(5); // the nes mini controller works fine without this delay
+
+		snes_read_buttons(state);
+	}
+
+	if (snes_bus_failed()) {
+		(*state).connected = 0;
+		(*state).buttons = 0;
+	}
+}
+
+// like snes_read_registers, but the pointer write and the read in the same
+// transaction, joined by a repeated start (no stop and no delay in between).
+// Returns 0 if either address was NACKed (a controller that doesn't take the
+// repeated start) or the bus got stuck (recovered then)
+static uint8_t snes_read_registers_repeated_start(uint8_t reg, uint8_t length) {
+	i2c_start();
+
+	uint8_t nack = i2c_write_byte(NES_I2C_ADDRESS_WRITE) & 0x01;
+
+	if (!nack) {
+		i2c_write_byte(reg);
+
+		i2c_restart();
+		nack = i2c_write_byte(NES_I2C_ADDRESS_READ) & 0x01;
+
+		if (!nack) snes_read_into_buffer(length);
 	}
 
 	i2c_stop();
 
-	(*state).buttons = buttons;
+	if (nack && !i2c_failed()) diagnostics_count(i2c_nacks);
+
+	// (only used by the probes, not worth a retry: the mode is just not enabled)
+	if (snes_bus_failed()) return 0;
+
+	return !nack;
 }
 
-static void snes_set_report_buttons(snes_controller_state *state, snes_report_t *report) {
-	(*report).commonButtonMask = (*report).snesButtonMask = 0x00;
-
-	// UP 0
-	// RIGHT 1
-	// DOWN 2 
-	// LEFT 3 
-	// SELECT 4
-	// START 5
-	// B 6
-	// A 7
-	// X 8 (SNES only)
-	// Y 9 (SNES only)
-	// L 10 (SNES only)
-	// R 11 (SNES only)
-	//
-	// wanna read an EXACT MATCH without any other buttons?
-	// use (!(controller_state.buttons ^ NES_BUTTON_SELECT)) instead
+static void snes_get_state_repeated_start(snes_controller_state *state) {
+	(*state).connected = snes_read_registers_repeated_start(*snes_pointer_for(state), snes_read_length(state));
+
+	if ((*state).connected) snes_decode_buttons(state);
+	else (*state).buttons = 0;
+}
+
+// non-blocking version: advances the read one step every call, so the main loop
+// can keep calling usbPoll() in between instead of sitting in the 5ms delay.
+// Both I2C transactions run in the background (i2c_async_transfer), the steps
+// only queue them and check when they're done.
+// (*state).buttons always holds the last complete sample
+static void snes_poll_state(snes_controller_state *state);
+
+// a background transaction got stuck (or took too long): recover the bus and start
+// the read over, SNES_I2C_RETRIES times in a row at most before giving up on the controller
+static void snes_poll_failed(snes_controller_state *state) {
+	diagnostics_count(i2c_timeouts);
+
+	(*state).step = SNES_STEP_IDLE;
+
+	if (i2c_recover() == I2C_OK && (*state).retries < SNES_I2C_RETRIES) {
+		(*state).retries++;
+		snes_poll_state(state);
+		return;
+	}
+
+	snes_lost(state);
+}
+
+// 1 if the background transaction of the current step is still going
+// (stops it when it's been too long, snes_poll_failed recovers the bus then)
+static uint8_t snes_poll_busy(snes_controller_state *state) {
+	if (!i2c_async_busy()) return 0;
+	if ((uint16_t)(ticks_now() - (*state).step_ticks) < SNES_I2C_TIMEOUT_TICKS) return 1;
+
+	i2c_async_abort(); // leaves it in I2C_ASYNC_ERROR
+	return 0;
+}
+
+static void snes_poll_state(snes_controller_state *state) {
+	switch ((*state).step) {
+		case SNES_STEP_IDLE:
+			(*state).step_ticks = ticks_now();
 
-	if ((*state).buttons & NES_BUTTON_UP) (*report).commonButtonMask = 0x01;
-	if ((*state).buttons & NES_BUTTON_RIGHT) (*report).commonButtonMask |= (0x01 << 1);
-	if ((*state).buttons & NES_BUTTON_DOWN) (*report).commonButtonMask |= (0x01 << 2);
-	if ((*state).buttons & NES_BUTTON_LEFT) (*report).commonButtonMask |= (0x01 << 3);
+			if ((*state).repeated_start) {
+				// pointer write and read at once, straight to the reading step
+				if (i2c_async_transfer(NES_I2C_ADDRESS_WRITE, snes_pointer_for(state), 1, snes_read_buffer, snes_read_length(state))) {
+					(*state).step = SNES_STEP_READING;
+				}
+			} else if (i2c_async_transfer(NES_I2C_ADDRESS_WRITE, snes_pointer_for(state), 1, 0, 0)) {
+				(*state).step = SNES_STEP_POINTER;
+			}
+			break;
 
-	if ((*state).buttons & NES_BUTTON_SELECT) (*report).commonButtonMask |= (0x01 << 4);
-	if ((*state).buttons & NES_BUTTON_START) (*report).commonButtonMask |= (0x01 << 5);
+		case SNES_STEP_POINTER:
+			if (snes_poll_busy(state)) break;
 
-	if ((*state).buttons & NES_BUTTON_B) (*report).commonButtonMask |= (0x01 << 6);
-	if ((*state).buttons & NES_BUTTON_A) (*report).commonButtonMask |= (0x01 << 7);
+			if (i2c_async_status() == I2C_ASYNC_ERROR) {
+				snes_poll_failed(state);
+				break;
+			}
 
-	if ((*state).buttons & NES_BUTTON_X) (*report).snesButtonMask = 0x01;
-	if ((*state).buttons & NES_BUTTON_Y) (*report).snesButtonMask |= (0x01 << 1);
+			if (i2c_async_status() == I2C_ASYNC_NACK) {
+				diagnostics_count(i2c_nacks);
+				snes_lost(state);
+				(*state).step = SNES_STEP_IDLE;
+				break;
+			}
 
-	if ((*state).buttons & NES_BUTTON_L) (*report).snesButtonMask |= (0x01 << 2);
-	if ((*state).buttons & NES_BUTTON_R) (*report).snesButtonMask |= (0x01 << 3);
+			(*state).step_ticks = ticks_now();
+			(*state).step = SNES_STEP_WAITING;
+			// the NES Mini doesn't need to wait
+			// fall through
+
+		case SNES_STEP_WAITING:
+			if ((*state).type == SNES_TYPE_NES_MINI || (uint16_t)(ticks_now() - (*state).step_ticks) >= SNES_READ_DELAY_TICKS) {
+				i2c_async_transfer(NES_I2C_ADDRESS_WRITE, 0, 0, snes_read_buffer, snes_read_length(state));
+				(*state).step_ticks = ticks_now();
+				(*state).step = SNES_STEP_READING;
+			}
+			break;
+
+		case SNES_STEP_READING:
+			if (snes_poll_busy(state)) break;
+
+			if (i2c_async_status() == I2C_ASYNC_ERROR) {
+				snes_poll_failed(state);
+				break;
+			}
+
+			if (i2c_async_status() == I2C_ASYNC_NACK) {
+				diagnostics_count(i2c_nacks);
+				snes_lost(state);
+				(*state).step = SNES_STEP_IDLE;
+				break;
+			}
+
+			snes_decode_buttons(state);
+			(*state).retries = 0;
+
+			// bits no button uses: a controller plugged again between two reads, answering
+			// without its init (the SNES Mini reads all 0x00). It needs the whole init again
+			if ((*state).buttons & ~NES_BUTTON_ALL) {
+				(*state).connected = 0;
+				(*state).buttons = 0;
+				(*state).step = SNES_STEP_IDLE;
+				break;
+			}
+
+			(*state).step = SNES_STEP_DONE;
+			(*state).detect_interval = SNES_DETECT_MIN_TICKS; // it works, see snes_update_connection
+
+			// just in case: a SNES Mini that kept its init through something seen
+			// as a power-on here passes for a NES Mini, until one of its own buttons
+			// shows up
+			if ((*state).type == SNES_TYPE_NES_MINI && ((*state).buttons & NES_BUTTON_SNES_ONLY)) {
+				(*state).type = SNES_TYPE_SNES_MINI;
+				snes_mini_seen = 1;
+			}
+			break;
+
+		default: // SNES_STEP_DONE
+			(*state).step = SNES_STEP_IDLE;
+			break;
+	}
+}
+
+// layout: report bit for every bit of the buttons (index = bit of NES_BUTTON_*),
+// SNES_LAYOUT_NONE for the ones that don't go anywhere. Stored in the EEPROM
+// (see snes_load_layout / snes_set_layout), the default one is:
+//
+// UP 0
+// RIGHT 1
+// DOWN 2
+// LEFT 3
+// SELECT 4
+// START 5
+// B 6
+// A 7
+// X 8 (SNES only)
+// Y 9 (SNES only)
+// L 10 (SNES only)
+// R 11 (SNES only)
+//
+// Only the first 12 report bits have a button (SNES_REPORT_BITS, the rest is
+// padding), anything else is SNES_LAYOUT_NONE. With a NES Mini the report is
+// just the first byte, so a button on 8 or more doesn't show up there (the
+// layout is the same for both controllers, a NES Mini one has to keep its 8
+// buttons on 0-7, like the default one)
+#define SNES_REPORT_BITS	12
+#define SNES_LAYOUT_LENGTH	16
+#define SNES_LAYOUT_NONE	0xFF
+#define SNES_LAYOUT_MAGIC	0xA5 // in the EEPROM next to the layout, "there's a saved one"
+
+PROGMEM const uint8_t snes_default_layout[SNES_LAYOUT_LENGTH] = {
+	0,					// 0x0001 UP
+	3,					// 0x0002 LEFT
+	SNES_LAYOUT_NONE,	// 0x0004
+	8,					// 0x0008 X
+	7,					// 0x0010 A
+	9,					// 0x0020 Y
+	6,					// 0x0040 B
+	SNES_LAYOUT_NONE,	// 0x0080
+	SNES_LAYOUT_NONE,	// 0x0100
+	11,					// 0x0200 R
+	5,					// 0x0400 START
+	SNES_LAYOUT_NONE,	// 0x0800
+	4,					// 0x1000 SELECT
+	10,					// 0x2000 L
+	2,					// 0x4000 DOWN
+	1,					// 0x8000 RIGHT
+};
+
+uint8_t EEMEM snes_layout_eeprom[SNES_LAYOUT_LENGTH];
+uint8_t EEMEM snes_layout_magic_eeprom;
+
+static uint8_t snes_layout[SNES_LAYOUT_LENGTH];
+// EEPROM save progress: 0 = clear the magic byte, 1..LENGTH = layout bytes,
+// LENGTH + 1 = magic byte, SNES_LAYOUT_SAVED = nothing to do
+#define SNES_LAYOUT_SAVED	(SNES_LAYOUT_LENGTH + 2)
+static uint8_t snes_layout_save = SNES_LAYOUT_SAVED;
+
+// the mapping is a bit permutation, done with one lookup per nibble of the buttons:
+// snes_map_table[n][v] is the report for the nibble n (bits 4n..4n+3) set to v.
+// Rebuilt from snes_layout every time it changes, so the report always costs the
+// same (4 lookups and 3 ORs, no branches, see make sim-test for the cycles).
+// 128 bytes of RAM
+static uint16_t snes_map_table[4][16];
+
+// invalid entries (no button on that report bit) go nowhere
+static void snes_build_map_table() {
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) {
+		if (snes_layout[x] >= SNES_REPORT_BITS) snes_layout[x] = SNES_LAYOUT_NONE;
+	}
+
+	for (uint8_t n = 0; n < 4; n++) {
+		for (uint8_t v = 0; v < 16; v++) {
+			uint16_t mapped = 0;
+
+			for (uint8_t b = 0; b < 4; b++) {
+				uint8_t bit = snes_layout[4 * n + b];
+				if ((v & (1 << b)) && bit != SNES_LAYOUT_NONE) mapped |= (1 << bit);
+			}
+
+			snes_map_table[n][v] = mapped;
+		}
+	}
+}
+
+// new layout (e.g. from the feature report): invalid entries are ignored, the
+// map table is rebuilt right away and the EEPROM is updated later, a byte at a
+// time, by snes_save_layout_step (writing it takes ~3.4ms per byte)
+static void snes_set_layout(const uint8_t *layout) {
+	for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) snes_layout[x] = layout[x];
+
+	snes_build_map_table();
+	snes_layout_save = 0;
+}
+
+// the saved layout, or the default one if there's nothing in the EEPROM
+static void snes_load_layout() {
+	if (eeprom_read_byte(&snes_layout_magic_eeprom) == SNES_LAYOUT_MAGIC) {
+		eeprom_read_block(snes_layout, snes_layout_eeprom, SNES_LAYOUT_LENGTH);
+	} else {
+		for (uint8_t x = 0; x < SNES_LAYOUT_LENGTH; x++) snes_layout[x] = pgm_read_byte(&snes_default_layout[x]);
+	}
+
+	snes_build_map_table();
+}
+
+// call it from the main loop, one byte at a time and only when the EEPROM is
+// ready, so it never blocks (the magic byte is cleared first and written last,
+// so a half-written layout is not used after a reset)
+static void snes_save_layout_step() {
+	if (snes_layout_save == SNES_LAYOUT_SAVED || !eeprom_is_ready()) return;
+
+	if (snes_layout_save == 0) {
+		eeprom_update_byte(&snes_layout_magic_eeprom, 0xFF);
+	} else if (snes_layout_save <= SNES_LAYOUT_LENGTH) {
+		eeprom_update_byte(&snes_layout_eeprom[snes_layout_save - 1], snes_layout[snes_layout_save - 1]);
+	} else {
+		eeprom_update_byte(&snes_layout_magic_eeprom, SNES_LAYOUT_MAGIC);
+	}
+
+	snes_layout_save++;
+}
+
+// same as snes_set_report_buttons, for any buttons bitmask (not just the last sample)
+static void snes_map_buttons(uint16_t buttons, snes_report_t *report) {
+	// wanna read an EXACT MATCH without any other buttons?
+	// use (!(controller_state.buttons ^ NES_BUTTON_SELECT)) instead
+
+	uint16_t mapped = snes_map_table[0][buttons & 0x0F] |
+		snes_map_table[1][(buttons >> 4) & 0x0F] |
+		snes_map_table[2][(buttons >> 8) & 0x0F] |
+		snes_map_table[3][buttons >> 12];
+
+	(*report).commonButtonMask = mapped;		// first 8 report bits (D-pad, SELECT, START, B, A by default)
+	(*report).snesButtonMask = mapped >> 8;		// the rest (X, Y, L, R by default)
+}
+
+static void snes_set_report_buttons(snes_controller_state *state, snes_report_t *report) {
+	snes_map_buttons((*state).buttons, report);
 }
 
 #endif
\ No newline at end of file
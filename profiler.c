@@ -0,0 +1,83 @@
+/*
+	Where the main loop spends its time.
+
+	Every phase of the main loop (usbPoll, the controller read, the connection,
+	the report and the led) is timed with Timer1 (see ticks.c, it runs at ~1us,
+	16 cycles, when the profiler is on) and gets its min, max, total and count
+	(mean = total / count) plus a histogram of the durations, 4 times wider
+	every bin: < 4us, < 16us, < 64us, ..., >= 16ms.
+
+	The host gets everything with the vendor request 3 (VENDOR_RQ_GET_PROFILE on
+	main.c) and clears it with the 4. tools/nesminictl.c reads and prints it.
+
+	Build with -DPROFILER=1. Otherwise nothing of this is compiled: the
+	profiler_begin / profiler_end macros are empty.
+*/
+
+#ifndef Profiler_c
+#define Profiler_c
+
+#if PROFILER
+
+#define PROFILER_PHASE_LOOP			0	// the whole iteration
+#define PROFILER_PHASE_USB_POLL		1
+#define PROFILER_PHASE_CONTROLLER	2	// snes_poll_state
+#define PROFILER_PHASE_CONNECT		3	// snes_update_connection (one step of the connection at most)
+#define PROFILER_PHASE_REPORT		4	// mapping + usbSetInterrupt
+#define PROFILER_PHASE_LED			5
+#define PROFILER_PHASES				6
+
+#define PROFILER_BINS				8
+
+typedef struct{
+	uint16_t	min;					// Timer1 counts (~1us), saturated to 0xFFFF
+	uint16_t	max;
+	uint32_t	total;
+	uint16_t	count;
+	uint8_t		bins[PROFILER_BINS];	// saturated to 0xFF
+}profiler_phase_t;
+
+// sent as is (18 bytes per phase, little endian, no padding on AVR)
+static profiler_phase_t profiler_phases[PROFILER_PHASES];
+
+static void profiler_reset() {
+	for (uint8_t x = 0; x < PROFILER_PHASES; x++) {
+		profiler_phase_t *phase = &profiler_phases[x];
+
+		(*phase).min = 0xFFFF;
+		(*phase).max = (*phase).total = (*phase).count = 0;
+		for (uint8_t y = 0; y < PROFILER_BINS; y++) (*phase).bins[y] = 0;
+	}
+}
+
+static void profiler_record(uint8_t phase_index, uint32_t counts) {
+	profiler_phase_t *phase = &profiler_phases[phase_index];
+	uint16_t duration = (counts & 0xFFFFFF) > 0xFFFF ? 0xFFFF : counts; // the counter is 24 bits
+	uint8_t bin = 0;
+
+	if (!++(*phase).count) { // wrapped: start again
+		profiler_reset();
+		(*phase).count = 1;
+	}
+
+	if (duration < (*phase).min) (*phase).min = duration;
+	if (duration > (*phase).max) (*phase).max = duration;
+	(*phase).total += duration;
+
+	while (bin < PROFILER_BINS - 1 && (duration >>= 2) != 0) bin++;
+	if ((*phase).bins[bin] < 0xFF) (*phase).bins[bin]++;
+}
+
+#define profiler_init()				profiler_reset()
+#define profiler_begin(name)		uint32_t name = ticks_counter()
+#define profiler_end(phase, name)	profiler_record(phase, ticks_counter() - name)
+
+#else
+
+#define profiler_init()
+#define profiler_begin(name)
+#define profiler_end(phase, name)
+
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+/*
+	The input report: what goes in it and when a new one is sent on the
+	interrupt endpoint (the change-only reports, the HID idle rate). Nothing
+	here touches USB, main.c does the usbSetInterrupt with what it builds, so
+	the host tests (host/test.c) run it as it is.
+*/
+
+#ifndef Report_c
+#define Report_c
+
+// 1 = the interrupt endpoint only gets a new report when the buttons change (or
+// when the idle rate set by the host expires), otherwise it keeps NAKing.
+// 0 = a new report on every poll, like before
+#define REPORT_CHANGES_ONLY	1
+
+static snes_report_t report_buffer;
+
+// HID idle rate (4ms units, 0 = only on changes, the default for joysticks)
+static uchar report_idle_rate = 0;
+static uint16_t report_idle_period_ticks = 0;
+static uint16_t report_idle_ticks;		// when the last report was sent
+
+// buttons in the last report sent (the mapping only runs when they change)
+static uint16_t report_buttons;
+static uchar report_force = 1;			// send a report no matter what (first one, etc.)
+
+// SET_IDLE, the new period starts now
+static void report_set_idle_rate(uchar rate, uint16_t now) {
+	report_idle_rate = rate;
+	report_idle_period_ticks = TICKS_FROM_MS((uint16_t)rate * 4);
+	report_idle_ticks = now;
+}
+
+// for a controller type (SNES_TYPE_*): the NES Mini report is just the first byte
+#define report_length(type) ((type) == SNES_TYPE_NES_MINI ? 1 : sizeof(report_buffer))
+
+// 1 if the buttons (every change since the last report, see sampler_report_buttons)
+// need a new report
+static uchar report_due(uint16_t buttons, uint16_t now) {
+	return !REPORT_CHANGES_ONLY || report_force || buttons != report_buttons ||
+		(report_idle_rate && (uint16_t)(now - report_idle_ticks) >= report_idle_period_ticks);
+}
+
+// maps the buttons into report_buffer and takes them as sent. Returns the length
+// for the controller type the host knows about
+static uchar report_build(uint16_t buttons, uchar type, uint16_t now) {
+	snes_map_buttons(buttons, &report_buffer);
+
+	report_buttons = buttons;
+	report_force = 0;
+	report_idle_ticks = now;
+
+	return report_length(type);
+}
+
+#endif
@@ -0,0 +1,261 @@
+/*
+	When to read the controller.
+
+	The host polls the interrupt endpoint every few ms, always with the same
+	period. If the controller is read just before that poll, the report the
+	host gets is as fresh as possible, instead of being up to a whole period
+	old (or one read old, when reading the controller nonstop).
+
+	The only thing we can see from here of the host polls is the interrupt
+	buffer being drained (usbInterruptIsReady becoming true again after a
+	usbSetInterrupt). Every drain gives the phase of the polls, and the time
+	between two of them (when it's a single period) refines the period.
+	Together with how long a read takes (measured too), that tells when the
+	next read must start to be done right before the next poll.
+
+	With the change-only reports there may be no drains for a long time, and
+	our clock and the host one drift apart: once the phase is too old the
+	controller is read nonstop again, until the next drain.
+
+	The controller is also read SAMPLER_OVERSAMPLING times per period (evenly
+	spread, the last one right before the poll), so a tap shorter than the
+	period is not lost between two reads: every change seen since the last
+	report is latched and shows up in the next one (a tap is reported as
+	pressed and then, in the following report, as released).
+
+	The report goes out once the final read before the poll is done (see
+	sampler_report_due): queued right after the drain it would miss the last
+	and freshest sample, and get it only one period later.
+
+	Optionally (SAMPLER_EVENTS) every change between two samples is also
+	queued with its time, relative to the last host poll seen, so a host
+	tool can get the exact sequence (see sampler_drain_events). They don't
+	go with the interrupt reports (that would take a second interrupt
+	endpoint and report descriptor): the host takes them in batches over
+	the control pipe with a vendor request, as often as it wants
+	(nesminictl events watch asks once per poll interval). There's at most
+	one change per sample, so the queue holds two periods of them at the
+	default oversampling; past that the newest ones are dropped and the
+	next batch says so.
+*/
+
+#ifndef Sampler_c
+#define Sampler_c
+
+// margin between the end of the read and the expected poll (main loop
+// iteration jitter, report building...)
+#define SAMPLER_MARGIN_TICKS		TICKS_FROM_MS(1)
+
+// phase older than this is not trusted anymore
+#define SAMPLER_PHASE_MAX_AGE_TICKS	TICKS_FROM_MS(1000)
+
+// controller reads per host poll period (1 = only the one right before the poll)
+#ifndef SAMPLER_OVERSAMPLING
+#define SAMPLER_OVERSAMPLING		4
+#endif
+
+static uint16_t sampler_period_ticks;	// time between host polls (learned)
+static uint16_t sampler_next_poll;		// when the next host poll is expected
+static uint16_t sampler_drain_ticks;	// when the last drain was seen
+static uchar sampler_locked = 0;		// 1 = the phase is known (and fresh)
+static uchar sampler_report_queued = 0;	// 1 = usbSetInterrupt called, not drained yet
+
+static uint16_t sampler_read_ticks;		// how long a read takes (learned)
+static uint16_t sampler_read_start;
+static uint16_t sampler_read_for;		// poll the last read was started for (one final read per poll)
+static uint16_t sampler_final_done;		// poll the last final read was done for
+static uchar sampler_read_final;		// 1 = the read going on is the final one
+static uint16_t sampler_read_spacing;	// period / SAMPLER_OVERSAMPLING
+static uint16_t sampler_next_read;		// when the next read in between polls is due
+
+static uint16_t sampler_reported;		// buttons in the last report sent
+static uint16_t sampler_changed;		// buttons that changed since then (see sampler_latch)
+static uint16_t sampler_current;		// last sample
+
+#ifndef SAMPLER_EVENTS
+#define SAMPLER_EVENTS				0
+#endif
+
+#if SAMPLER_EVENTS
+#define SAMPLER_EVENTS_LENGTH		8	// power of 2
+#define SAMPLER_EVENTS_OVERFLOW		0x80	// in the count byte of a batch: some events were lost
+
+typedef struct{
+	uint16_t	buttons;	// after the change
+	uint16_t	ticks;		// since the last drain of the interrupt buffer (~host poll)
+}sampler_event_t;
+
+static sampler_event_t sampler_events[SAMPLER_EVENTS_LENGTH];
+static uint8_t sampler_events_head = 0;	// next one to write
+static uint8_t sampler_events_tail = 0;	// next one to read
+static uint8_t sampler_events_lost = 0;
+
+// count (+ SAMPLER_EVENTS_OVERFLOW) and up to SAMPLER_EVENTS_LENGTH events
+static uint8_t sampler_events_batch[1 + SAMPLER_EVENTS_LENGTH * sizeof(sampler_event_t)];
+#endif
+
+// for the diagnostics
+static uint8_t sampler_samples;			// reads since the last report
+static uint8_t sampler_samples_per_report;	// ... in the last report
+
+// interval: the bInterval (ms) the host was given, the starting point for the period
+static void sampler_init(uint8_t interval) {
+	sampler_period_ticks = TICKS_FROM_MS(interval);
+	sampler_read_spacing = sampler_period_ticks / SAMPLER_OVERSAMPLING;
+	sampler_read_ticks = SNES_READ_DELAY_TICKS;
+}
+
+// call it every main loop iteration
+static void sampler_update(uint16_t now) {
+	if (sampler_report_queued && usbInterruptIsReady()) {
+		// the host took the report between the last iteration and this one
+		uint16_t elapsed = now - sampler_drain_ticks;
+
+		// back to back drains (one period apart) refine the period, 3/4 old + 1/4 new
+		if (sampler_locked && elapsed < sampler_period_ticks + sampler_period_ticks / 2) {
+			sampler_period_ticks = (uint16_t)(((uint32_t)sampler_period_ticks * 3 + elapsed) / 4);
+			sampler_read_spacing = sampler_period_ticks / SAMPLER_OVERSAMPLING;
+		}
+
+		sampler_report_queued = 0;
+		sampler_drain_ticks = now;
+		sampler_next_poll = now + sampler_period_ticks;
+		sampler_locked = 1;
+	}
+
+	if (!sampler_locked) return;
+
+	if ((uint16_t)(now - sampler_drain_ticks) >= SAMPLER_PHASE_MAX_AGE_TICKS) {
+		sampler_locked = 0;
+		return;
+	}
+
+	// move the expected poll forward, one period at a time
+	while ((int16_t)(now - sampler_next_poll) >= 0) sampler_next_poll += sampler_period_ticks;
+}
+
+// when the last read before the next poll has to start
+#define sampler_final_read() (sampler_next_poll - sampler_read_ticks - SAMPLER_MARGIN_TICKS)
+
+// 1 if a new read should start now (always, if the phase is unknown)
+static uchar sampler_should_start(uint16_t now) {
+	if (!sampler_locked) return 1;
+
+	uint16_t final = sampler_final_read();
+
+	// the one right before the poll
+	if (sampler_read_for != sampler_next_poll && (int16_t)(now - final) >= 0) return 1;
+
+	// the ones in between, as long as they're done before the final one
+	return (int16_t)(now - sampler_next_read) >= 0 && (int16_t)(final - now) > (int16_t)sampler_read_ticks;
+}
+
+static void sampler_read_started(uint16_t now) {
+	sampler_read_start = now;
+	sampler_next_read = now + sampler_read_spacing;
+
+	sampler_read_final = sampler_locked && (int16_t)(now - sampler_final_read()) >= 0;
+	if (sampler_read_final) sampler_read_for = sampler_next_poll;
+}
+
+// keeps the longest read seen lately (slowly forgotten, in case it was a one-off)
+static void sampler_read_done(uint16_t now) {
+	uint16_t took = now - sampler_read_start;
+
+	if (took > sampler_read_ticks) sampler_read_ticks = took;
+	else sampler_read_ticks -= (sampler_read_ticks - took) >> 3;
+
+	if (sampler_read_final) sampler_final_done = sampler_read_for;
+	sampler_read_final = 0;
+}
+
+// 1 if the next report can be queued now: with the phase known, only after the
+// final read before the next poll (or once it should have started and didn't,
+// e.g. no controller). Without the phase, right away
+static uchar sampler_report_due(uint16_t now) {
+	if (!sampler_locked || sampler_final_done == sampler_next_poll) return 1;
+
+	return sampler_read_for != sampler_next_poll && (int16_t)(now - sampler_final_read()) >= 0;
+}
+
+// measured timing, for the latency report (see VENDOR_RQ_GET_TIMING on main.c)
+typedef struct{
+	uint16_t	period_ticks;	// between host polls
+	uint16_t	read_ticks;		// a whole controller read
+	int16_t		headroom_ticks;	// left in every period after the final read (and the margin)
+	uint8_t		samples_per_report;
+	uint8_t		locked;
+}sampler_timing_t;
+
+static void sampler_get_timing(sampler_timing_t *timing) {
+	(*timing).period_ticks = sampler_period_ticks;
+	(*timing).read_ticks = sampler_read_ticks;
+	(*timing).headroom_ticks = sampler_period_ticks - sampler_read_ticks - SAMPLER_MARGIN_TICKS;
+	(*timing).samples_per_report = sampler_samples_per_report;
+	(*timing).locked = sampler_locked;
+}
+
+// every new sample: keeps track of the buttons that differ from the last report
+// (if a button goes and comes back before the report, the change is kept)
+static void sampler_latch(uint16_t buttons) {
+#if SAMPLER_EVENTS
+	if (buttons != sampler_current) {
+		if ((uint8_t)(sampler_events_head - sampler_events_tail) < SAMPLER_EVENTS_LENGTH) {
+			sampler_event_t *event = &sampler_events[sampler_events_head++ & (SAMPLER_EVENTS_LENGTH - 1)];
+			(*event).buttons = buttons;
+			(*event).ticks = ticks_now() - sampler_drain_ticks;
+		} else {
+			sampler_events_lost = 1;
+		}
+	}
+#endif
+
+	sampler_current = buttons;
+	sampler_changed |= buttons ^ sampler_reported;
+
+	if (sampler_samples < 0xFF) sampler_samples++;
+}
+
+// buttons for the next report: the last reported ones with every change flipped
+#define sampler_report_buttons() (sampler_reported ^ sampler_changed)
+
+// after every usbSetInterrupt, with the buttons it got. Whatever is still
+// different from the last sample goes in the next report
+static void sampler_queued(uint16_t buttons) {
+	sampler_report_queued = 1;
+
+	sampler_reported = buttons;
+	sampler_changed = sampler_current ^ buttons;
+
+	if (!sampler_samples) diagnostics_count(stale_reports); // nothing new since the last one
+	sampler_samples_per_report = sampler_samples;
+	sampler_samples = 0;
+}
+
+#if SAMPLER_EVENTS
+// moves the queued events (oldest first) to sampler_events_batch, as many as fit in
+// max_length bytes (the wLength of the request), returns its length. The ones that
+// don't fit stay queued for the next batch
+static uint8_t sampler_drain_events(uint16_t max_length) {
+	uint8_t count = 0;
+	uint8_t *out = &sampler_events_batch[1];
+
+	if (!max_length) return 0;
+
+	while (sampler_events_tail != sampler_events_head && 1 + (count + 1) * sizeof(sampler_event_t) <= max_length) {
+		sampler_event_t *event = &sampler_events[sampler_events_tail++ & (SAMPLER_EVENTS_LENGTH - 1)];
+		*out++ = (*event).buttons;
+		*out++ = (*event).buttons >> 8;
+		*out++ = (*event).ticks;
+		*out++ = (*event).ticks >> 8;
+		count++;
+	}
+
+	sampler_events_batch[0] = count | (sampler_events_lost ? SAMPLER_EVENTS_OVERFLOW : 0);
+	sampler_events_lost = 0;
+
+	return 1 + count * sizeof(sampler_event_t);
+}
+#endif
+
+#endif
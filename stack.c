@@ -0,0 +1,63 @@
+/*
+	How deep the stack got.
+
+	The 512 bytes of SRAM are the V-USB buffers, the report, the driver state...
+	(.data, .bss and .noinit, up to _end) and the stack, growing down from
+	RAMEND towards them. Nothing checks that they don't meet.
+
+	Right after the reset (.init1, before the startup code sets up anything)
+	everything from _end to RAMEND is painted with STACK_PAINT. Later, the
+	first byte from _end up that isn't the paint anymore is the deepest the
+	stack went (a pushed byte that happens to be STACK_PAINT hides it, that's
+	one byte of error, rarely more).
+
+	The host gets it with the vendor request 5 (VENDOR_RQ_GET_STACK on main.c),
+	tools/nesminictl.c prints it. make ram (tools/callgraph.c) is the static
+	side of it: what the stack could take at most, checked on every build.
+*/
+
+#ifndef Stack_c
+#define Stack_c
+
+#define STACK_PAINT		0xC5
+
+extern uint8_t _end;		// the linker: first byte after .data / .bss / .noinit
+extern uint8_t __stack;		// RAMEND
+
+// sent as is (little endian, no padding on AVR)
+typedef struct{
+	uint16_t	high_water;		// bytes of stack used at most since the reset
+	uint16_t	available;		// from _end to RAMEND
+}stack_report_t;
+
+static stack_report_t stack_report;
+
+// no stack yet and no r1 = 0 (that's .init2), so only asm: Z from _end to __stack (included)
+static void stack_paint() __attribute__((naked, used, section(".init1")));
+static void stack_paint() {
+	__asm__ volatile(
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_PAINT)
+	);
+}
+
+// noinline: tools/wcet.bounds bounds its loop by name
+static void __attribute__((noinline)) stack_measure() {
+	const uint8_t *paint = &_end;
+
+	while (paint <= &__stack && *paint == STACK_PAINT) paint++;
+
+	stack_report.available = &__stack - &_end + 1;
+	stack_report.high_water = &__stack - paint + 1;
+}
+
+#endif
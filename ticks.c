@@ -0,0 +1,70 @@
+/*
+	Free-running time base for the main loop, built on Timer1.
+
+	Timer1 runs at F_CPU / 1024 (about 62us per tick at 16.5MHz) and its 8 bits
+	are extended to 16 by counting the overflows, every 256 ticks (~15ms), in
+	an interrupt. It starts with sei (like the I2C ones) and it's
+	ISR_NOBLOCK, so the V-USB one gets through right away. Nothing is lost
+	while the main loop is busy somewhere else (the USB re-enumeration, for
+	instance, masks only the USB interrupt). That gives a ~4 seconds wrap,
+	more than enough for the delays we need.
+
+	Always compare ticks using differences (now - start) so the wrap doesn't matter.
+
+	With the profiler (PROFILER, see profiler.c) Timer1 runs 64 times faster
+	(CK/16, ~1us, an overflow every ~250us). The ticks are the same: the
+	counter divided by 64.
+*/
+
+#ifndef Ticks_c
+#define Ticks_c
+
+#define TICKS_PRESCALER			1024
+
+#ifndef PROFILER
+#define PROFILER				0
+#endif
+
+// ms -> ticks, rounded up (waiting a bit more is always safe)
+#define TICKS_FROM_MS(ms)		((uint16_t)(((uint32_t)F_CPU / TICKS_PRESCALER * (ms)) / 1000 + 1))
+
+#if PROFILER
+#define TICKS_TIMER1_CLOCK		((1 << CS12) | (1 << CS10)) // CK/16
+#define TICKS_TIMER1_SHIFT		6 // 1024 / 16
+#else
+#define TICKS_TIMER1_CLOCK		((1 << CS13) | (1 << CS11) | (1 << CS10)) // CK/1024
+#define TICKS_TIMER1_SHIFT		0
+#endif
+
+static volatile uint16_t ticks_overflows = 0;
+
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {
+	ticks_overflows++;
+}
+
+static void ticks_init() {
+	TCNT1 = 0;
+	TCCR1 = TICKS_TIMER1_CLOCK; // no PWM, no CTC
+	TIMSK |= (1 << TOIE1);
+}
+
+// Timer1 counts in 24 bits
+static uint32_t ticks_counter() {
+	uint16_t hi;
+	uint8_t lo;
+
+	uint8_t sreg = SREG;
+	cli();
+	hi = ticks_overflows;
+	lo = TCNT1;
+	if ((TIFR & (1 << TOV1)) && lo < 0x80) hi++; // wrapped, interrupt still pending
+	SREG = sreg;
+
+	return ((uint32_t)hi << 8) | lo;
+}
+
+static uint16_t ticks_now() {
+	return ticks_counter() >> TICKS_TIMER1_SHIFT;
+}
+
+#endif
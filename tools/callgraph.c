@@ -0,0 +1,1603 @@
+/*
+	Static worst case execution time of the main loop, from the disassembly of
+	main.elf (avr-objdump -d): the longest path from one usbPoll call to the
+	next one, in CPU cycles, checked against a budget (make wcet, also part of
+	make hex). V-USB wants usbPoll "somewhat less than 50ms" apart at most, and
+	the interrupt endpoint only gets a new report once the loop comes around.
+
+		cc -Wall -O2 -o tools/callgraph tools/callgraph.c
+		avr-objdump -d main.elf | ./tools/callgraph [-v] [-b budget_us] tools/wcet.bounds -
+
+	How it works:
+
+	* The call graph, from every call reachable from main (rcall .+0, the
+	  stack space trick of gcc, is not a call). A jump to the entry of a
+	  function that is called somewhere else is a tail call.
+	* Every function: its control flow graph (branches, skips, jumps), the
+	  loops (from the backward branches, merged until they nest) and the
+	  longest path through it, a loop counting as (bound + 1) times its
+	  longest iteration, every call as the callee's own worst case.
+	  Instruction timing of the ATtiny85 datasheet, branches always taken.
+	* Loop bounds: counter loops are found on their own (a counter loaded
+	  with ldi right before the loop, only decremented in it and tested
+	  right after that, like every _delay_us / _delay_ms expansion and the
+	  I2C timeouts, or counted up with subi 0xFF / inc to a cpi). The rest
+	  come from the bounds file (see tools/wcet.bounds): per function and
+	  loop number, or per I/O bit the loop waits on. -v lists every loop
+	  with its number, so a missing bound is easy to add.
+	* The main loop: the innermost loop around the usbPoll call, from the
+	  call (usbPoll included) to the end of the iteration and from the start
+	  of the next one back to the call.
+
+	Interrupts are not counted (the USB one, the I2C ones): leave room for
+	them in the budget. Indirect calls and jumps (icall, ijmp, jump tables)
+	need a "cost" line for the function that has them, recursion isn't
+	supported.
+
+	With -r (make ram) it's the RAM instead: .data / .bss / .noinit per module,
+	from avr-nm -S -A of the objects and main.elf (usbdrv and osccal by object,
+	main.o by the prefix of the names: snes_ the driver, i2c_ the I2C layer...),
+	plus the worst case stack from the same call graph:
+
+		avr-nm -S -A $(OBJECTS) main.elf > main.sym
+		avr-objdump -d main.elf | ./tools/callgraph -r main.sym [-m margin] tools/wcet.bounds -
+
+	* Every function: what it pushes (push, rcall .+0, the frame of gcc: in
+	  r28, 0x3d and the sbiw / subi right after it), plus the deepest of its
+	  calls (2 bytes for the return address and the callee's own). Pushes on
+	  every path are added up, whatever path they're on.
+	* main, then every __vector_N on top of it (2 bytes for the return
+	  address): only one of the interrupts that keep them disabled at a time,
+	  but all the ones that enable them again (sei, ISR_NOBLOCK) can pile up.
+	  Indirect calls need a "stack" line (tools/wcet.bounds), recursion isn't
+	  supported.
+
+	Fails when the static RAM plus that stack leaves less than the margin
+	free. stack.c measures the real high-water mark on the device.
+
+	Exits with 1 when the path is over the budget (the RAM is over) or
+	something can't be bounded, 2 on bad input.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU				16500000
+#endif
+
+#define FLASH_BYTES			8192
+#define INSTRUCTIONS		(FLASH_BYTES / 2)
+#define SYMBOLS				1024
+#define SYMBOL_LENGTH		48
+#define FUNCTIONS			256
+#define LOOPS				64
+#define ANNOTATIONS			128
+#define COUNTER_SCAN		12		// instructions before a loop searched for the ldi of its counter
+#define FRAME_SCAN			3		// instructions after in r28, 0x3d searched for the frame size
+
+// ATtiny85
+#define RAM_START			0x60
+#define RAM_BYTES			512
+#define DATA_OFFSET			0x800000	// data space addresses on the ELF symbols
+
+#define KIND_NORMAL			0
+#define KIND_BRANCH			1		// brXX: 1 cycle, 2 when taken
+#define KIND_SKIP			2		// cpse, sbrc, sbrs, sbic, sbis: 1 cycle, 2 or 3 when skipping
+#define KIND_JUMP			3
+#define KIND_CALL			4
+#define KIND_RETURN			5
+#define KIND_INDIRECT		6		// ijmp, icall
+#define KIND_INVALID		7		// .word (data, or not an instruction)
+
+#define NONE				0xFFFF
+
+// annotations (the bounds file)
+#define ANNOTATION_LOOP		0		// loop <function> <number | *> <iterations>
+#define ANNOTATION_IO		1		// io <address> <bit> <iterations>
+#define ANNOTATION_COST		2		// cost <function> <cycles>
+#define ANNOTATION_IGNORE	3		// ignore <function>
+#define ANNOTATION_STACK	4		// stack <function> <bytes> (make ram)
+
+// where a loop bound came from
+#define BOUND_NONE			0
+#define BOUND_ANNOTATION	1
+#define BOUND_COUNTER		2
+#define BOUND_IO			3
+#define BOUND_FUNCTION		4
+
+static const char *bound_names[] = { "none", "bounds file", "counter", "I/O bit", "bounds file (*)" };
+
+typedef struct {
+	uint16_t	address;			// bytes
+	uint8_t		words;
+	uint8_t		kind;
+	uint8_t		cycles;				// worst case, the instruction alone
+	char		mnemonic[8];
+	char		operands[32];
+	uint16_t	target;				// branch / jump / call target (bytes), NONE otherwise
+	uint8_t		rd;					// first operand register (0xFF = none)
+	uint8_t		rr;					// second operand register (0xFF = none)
+	int32_t		k;					// second operand constant (ldi, subi, cpi, sbiw...), -1 = none
+	uint8_t		target_of;			// some branch or jump goes here
+} instruction_t;
+
+typedef struct {
+	uint16_t	address;
+	char		name[SYMBOL_LENGTH];
+} symbol_t;
+
+typedef struct {
+	uint8_t		type;
+	char		function[SYMBOL_LENGTH];
+	uint16_t	number;				// loop number (0 = all), I/O address
+	uint8_t		bit;
+	uint32_t	value;
+	uint16_t	line;
+	uint8_t		used;
+} annotation_t;
+
+typedef struct {
+	uint16_t	start;				// instruction indexes, start <= end
+	uint16_t	end;
+	int16_t		parent;
+	uint8_t		number;				// 1.. by address in the function
+	uint8_t		bound_source;
+	uint32_t	bound;
+	uint64_t	iteration;			// longest iteration
+	uint64_t	cost;				// (bound + 1) * iteration
+	uint8_t		state;				// 0 not yet, 1 in progress, 2 done
+} loop_t;
+
+typedef struct function {
+	uint16_t	entry;				// instruction index
+	char		name[SYMBOL_LENGTH];
+	uint8_t		state;				// 0 not yet, 1 in progress, 2 done
+	uint8_t		ignored;
+	uint8_t		annotated;
+	uint64_t	wcet;
+	uint32_t	calls;				// call sites seen (for the report)
+
+	// make ram: bytes of stack below the return address, callees included
+	uint8_t		stack_state;		// 0 not yet, 1 in progress, 2 done
+	uint32_t	stack;
+	uint32_t	frame;				// its own part
+	uint8_t		enables_interrupts;	// sei somewhere in it (not in the callees)
+	struct function *deepest;		// the callee the stack goes on with, NULL = none
+
+	// its control flow graph, once analyzed
+	uint16_t	*nodes;				// instruction indexes in address order
+	uint16_t	node_count;
+	loop_t		loops[LOOPS];
+	uint8_t		loop_count;
+} function_t;
+
+static instruction_t instructions[INSTRUCTIONS];
+static uint16_t instruction_count;
+static uint16_t instruction_at[INSTRUCTIONS];	// by word address, NONE = not the start of one
+
+static symbol_t symbols[SYMBOLS];				// in address order (as objdump prints them)
+static uint16_t symbol_count;
+
+static function_t functions[FUNCTIONS];
+static uint16_t function_count;
+static uint8_t call_target[INSTRUCTIONS];		// by instruction index
+
+static annotation_t annotations[ANNOTATIONS];
+static uint8_t annotation_count;
+
+static uint8_t verbose;
+static uint8_t ram;					// -r: make ram instead of make wcet
+static uint16_t errors;
+
+// per analysis scratch, by instruction index
+static uint8_t *inside;				// part of the function being analyzed
+static int16_t *loop_of;			// innermost loop
+static uint64_t *distance;			// longest path to the start of it, UINT64_MAX = not reached
+static uint16_t *previous;			// the node before it on that path
+
+// --- input ---
+
+static void trim(char *text) {
+	size_t length = strlen(text);
+
+	while (length && (text[length - 1] == ' ' || text[length - 1] == '\n' || text[length - 1] == '\r')) text[--length] = 0;
+	while (text[0] == ' ') memmove(text, text + 1, length--);
+}
+
+static uint8_t parse_register(const char *text) {
+	if (text[0] != 'r' || text[1] < '0' || text[1] > '9') return 0xFF;
+	return atoi(text + 1);
+}
+
+static void parse_instruction(instruction_t *instruction) {
+	static const struct {
+		const char	*mnemonic;
+		uint8_t		cycles;
+		uint8_t		kind;
+	} timing[] = {
+		{ "adiw", 2, KIND_NORMAL }, { "sbiw", 2, KIND_NORMAL },
+		{ "cbi", 2, KIND_NORMAL }, { "sbi", 2, KIND_NORMAL },
+		{ "ld", 2, KIND_NORMAL }, { "ldd", 2, KIND_NORMAL }, { "lds", 2, KIND_NORMAL },
+		{ "st", 2, KIND_NORMAL }, { "std", 2, KIND_NORMAL }, { "sts", 2, KIND_NORMAL },
+		{ "push", 2, KIND_NORMAL }, { "pop", 2, KIND_NORMAL },
+		{ "lpm", 3, KIND_NORMAL }, { "spm", 4, KIND_NORMAL },
+		{ "rjmp", 2, KIND_JUMP }, { "jmp", 3, KIND_JUMP },
+		{ "rcall", 3, KIND_CALL }, { "call", 4, KIND_CALL },
+		{ "ijmp", 2, KIND_INDIRECT }, { "icall", 3, KIND_INDIRECT },
+		{ "ret", 4, KIND_RETURN }, { "reti", 4, KIND_RETURN },
+		{ "cpse", 1, KIND_SKIP }, { "sbrc", 1, KIND_SKIP }, { "sbrs", 1, KIND_SKIP },
+		{ "sbic", 1, KIND_SKIP }, { "sbis", 1, KIND_SKIP },
+		{ ".word", 1, KIND_INVALID },
+	};
+	char first[32] = "", *second;
+
+	instruction->kind = KIND_NORMAL;
+	instruction->cycles = 1;
+	instruction->target = NONE;
+	instruction->k = -1;
+
+	for (uint8_t x = 0; x < sizeof(timing) / sizeof(timing[0]); x++) {
+		if (!strcmp(instruction->mnemonic, timing[x].mnemonic)) {
+			instruction->kind = timing[x].kind;
+			instruction->cycles = timing[x].cycles;
+		}
+	}
+
+	if (!strncmp(instruction->mnemonic, "br", 2) && strcmp(instruction->mnemonic, "break")) {
+		instruction->kind = KIND_BRANCH;
+		instruction->cycles = 2;
+	}
+
+	// operands: "r24, 0x05", ".-4", "0x1f4", "Y+2, r24"...
+	snprintf(first, sizeof(first), "%s", instruction->operands);
+	second = strchr(first, ',');
+	if (second) {
+		*second++ = 0;
+		while (*second == ' ') second++;
+	}
+
+	instruction->rd = parse_register(first);
+	instruction->rr = second ? parse_register(second) : 0xFF;
+	if (second && second[0] != 'r' && second[0] != 'X' && second[0] != 'Y' && second[0] != 'Z') instruction->k = strtol(second, NULL, 0);
+
+	if (instruction->kind == KIND_BRANCH || instruction->kind == KIND_JUMP || instruction->kind == KIND_CALL) {
+		if (first[0] == '.') instruction->target = instruction->address + 2 + strtol(first + 1, NULL, 0);
+		else instruction->target = strtol(first, NULL, 0);
+	}
+}
+
+// "   6c:	0e 94 36 00 	call	0x1f4	; 0x1f4 <usbPoll>" or "000001f4 <usbPoll>:"
+static uint8_t read_disassembly(FILE *file) {
+	char line[256];
+
+	for (uint16_t x = 0; x < INSTRUCTIONS; x++) instruction_at[x] = NONE;
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned address;
+		char name[SYMBOL_LENGTH];
+
+		if (sscanf(line, "%x <%47[^>]>:", &address, name) == 2 && line[0] != ' ') {
+			if (symbol_count < SYMBOLS && address < FLASH_BYTES) {
+				symbols[symbol_count].address = address;
+				snprintf(symbols[symbol_count++].name, SYMBOL_LENGTH, "%s", name);
+			}
+			continue;
+		}
+
+		char *fields[5] = { 0 };
+		uint8_t count = 0;
+
+		line[strcspn(line, "\n")] = 0;
+		for (char *field = strtok(line, "\t"); field && count < 5; field = strtok(NULL, "\t")) fields[count++] = field;
+
+		if (count < 3 || sscanf(fields[0], " %x:", &address) != 1 || !strchr(fields[0], ':')) continue;
+		if (address >= FLASH_BYTES || (address & 1) || instruction_count == INSTRUCTIONS) continue;
+
+		instruction_t *instruction = &instructions[instruction_count];
+		uint8_t bytes = 0;
+
+		for (char *byte = fields[1]; *byte; byte++) {
+			if (*byte != ' ' && (byte == fields[1] || byte[-1] == ' ')) bytes++;
+		}
+
+		memset(instruction, 0, sizeof(*instruction));
+		instruction->address = address;
+		instruction->words = bytes > 2 ? 2 : 1;
+		snprintf(instruction->mnemonic, sizeof(instruction->mnemonic), "%s", fields[2]);
+		trim(instruction->mnemonic);
+		if (count > 3 && fields[3][0] != ';') snprintf(instruction->operands, sizeof(instruction->operands), "%s", fields[3]);
+		trim(instruction->operands);
+
+		parse_instruction(instruction);
+		instruction_at[address / 2] = instruction_count++;
+	}
+
+	for (uint16_t x = 0; x < instruction_count; x++) {
+		uint16_t target = instructions[x].target;
+
+		if (target != NONE && target < FLASH_BYTES && instruction_at[target / 2] != NONE) {
+			instructions[instruction_at[target / 2]].target_of = 1;
+		}
+	}
+
+	return instruction_count != 0;
+}
+
+static uint8_t read_annotations(const char *path) {
+	FILE *file = fopen(path, "r");
+	char line[256];
+	uint16_t number = 0;
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		char type[16], function[SYMBOL_LENGTH], which[16];
+		annotation_t *annotation = &annotations[annotation_count];
+		unsigned long value;
+		unsigned io, bit;
+
+		number++;
+		line[strcspn(line, "#\n")] = 0;
+		if (sscanf(line, "%15s", type) != 1) continue;
+
+		if (annotation_count == ANNOTATIONS) {
+			fprintf(stderr, "%s:%u: too many lines\n", path, number);
+			break;
+		}
+
+		memset(annotation, 0, sizeof(*annotation));
+		annotation->line = number;
+
+		if (!strcmp(type, "loop") && sscanf(line, "%*s %47s %15s %lu", function, which, &value) == 3) {
+			annotation->type = ANNOTATION_LOOP;
+			annotation->number = strcmp(which, "*") ? atoi(which) : 0;
+		} else if (!strcmp(type, "io") && sscanf(line, "%*s %i %u %lu", &io, &bit, &value) == 3) {
+			annotation->type = ANNOTATION_IO;
+			annotation->number = io;
+			annotation->bit = bit;
+			function[0] = 0;
+		} else if (!strcmp(type, "cost") && sscanf(line, "%*s %47s %lu", function, &value) == 2) {
+			annotation->type = ANNOTATION_COST;
+		} else if (!strcmp(type, "ignore") && sscanf(line, "%*s %47s", function) == 1) {
+			annotation->type = ANNOTATION_IGNORE;
+			value = 0;
+		} else if (!strcmp(type, "stack") && sscanf(line, "%*s %47s %lu", function, &value) == 2) {
+			annotation->type = ANNOTATION_STACK;
+		} else {
+			fprintf(stderr, "%s:%u: can't make sense of this\n", path, number);
+			fclose(file);
+			return 0;
+		}
+
+		snprintf(annotation->function, SYMBOL_LENGTH, "%s", function);
+		annotation->value = value;
+		annotation_count++;
+	}
+
+	fclose(file);
+	return 1;
+}
+
+// --- names ---
+
+static const char *symbol_exactly_at(uint16_t address) {
+	for (uint16_t x = 0; x < symbol_count; x++) {
+		if (symbols[x].address == address) return symbols[x].name;
+	}
+	return NULL;
+}
+
+// "usbPoll+0x1c"
+static const char *describe(uint16_t address) {
+	static char text[SYMBOL_LENGTH + 16];
+	const symbol_t *best = NULL;
+
+	for (uint16_t x = 0; x < symbol_count; x++) {
+		if (symbols[x].address <= address && (!best || symbols[x].address >= best->address)) best = &symbols[x];
+	}
+
+	if (!best) snprintf(text, sizeof(text), "0x%04x", address);
+	else if (best->address == address) snprintf(text, sizeof(text), "%s", best->name);
+	else snprintf(text, sizeof(text), "%s+0x%x", best->name, address - best->address);
+
+	return text;
+}
+
+static function_t *function_for(uint16_t entry) {
+	for (uint16_t x = 0; x < function_count; x++) {
+		if (functions[x].entry == entry) return &functions[x];
+	}
+
+	if (function_count == FUNCTIONS) return NULL;
+
+	function_t *function = &functions[function_count++];
+	const char *name = symbol_exactly_at(instructions[entry].address);
+
+	memset(function, 0, sizeof(*function));
+	function->entry = entry;
+	if (name) snprintf(function->name, SYMBOL_LENGTH, "%s", name);
+	else snprintf(function->name, SYMBOL_LENGTH, "0x%04x", instructions[entry].address);
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		annotation_t *annotation = &annotations[x];
+
+		if (strcmp(annotation->function, function->name)) continue;
+
+		if (annotation->type == ANNOTATION_IGNORE) {
+			function->ignored = annotation->used = 1;
+		} else if (annotation->type == ANNOTATION_COST) {
+			function->annotated = annotation->used = 1;
+			function->wcet = annotation->value;
+		}
+	}
+
+	return function;
+}
+
+// --- the control flow graph ---
+
+static uint16_t next_of(uint16_t index) {
+	return index + 1 < instruction_count && instructions[index + 1].address == instructions[index].address + 2 * instructions[index].words ? index + 1 : NONE;
+}
+
+static uint16_t index_of(uint16_t address) {
+	return address < FLASH_BYTES ? instruction_at[address / 2] : NONE;
+}
+
+// rcall .+0: 2 bytes of stack space, not a call
+static uint8_t is_call(const instruction_t *instruction) {
+	return instruction->kind == KIND_CALL && instruction->target != instruction->address + 2;
+}
+
+static uint8_t is_tail_call(const instruction_t *instruction) {
+	uint16_t target = index_of(instruction->target);
+	return instruction->kind == KIND_JUMP && target != NONE && call_target[target];
+}
+
+// successors inside the same function (calls return to the next one)
+static uint8_t successors(uint16_t index, uint16_t out[2]) {
+	const instruction_t *instruction = &instructions[index];
+	uint16_t next = next_of(index);
+	uint8_t count = 0;
+
+	switch (instruction->kind) {
+		case KIND_RETURN:
+		case KIND_INDIRECT:
+		case KIND_INVALID:
+			break;
+
+		case KIND_JUMP:
+			if (!is_tail_call(instruction)) out[count++] = index_of(instruction->target);
+			break;
+
+		case KIND_BRANCH:
+			out[count++] = next;
+			out[count++] = index_of(instruction->target);
+			break;
+
+		case KIND_SKIP:
+			out[count++] = next;
+			out[count++] = next != NONE ? next_of(next) : NONE;
+			break;
+
+		default:
+			out[count++] = next;
+	}
+
+	// (NONE: off the end, a bad target)
+	return count;
+}
+
+// worst case of the instruction alone: a skip over a two word instruction takes 3
+static uint8_t instruction_cycles(uint16_t index) {
+	const instruction_t *instruction = &instructions[index];
+	uint16_t next = next_of(index);
+
+	if (instruction->kind == KIND_SKIP) return 1 + (next != NONE ? instructions[next].words : 1);
+	return instruction->cycles;
+}
+
+// registers an instruction changes (bit mask)
+static uint32_t written_registers(const instruction_t *instruction) {
+	static const char *none[] = { "cp", "cpc", "cpi", "cpse", "tst", "out", "sbrc", "sbrs", "sbic", "sbis",
+		"sbi", "cbi", "push", "bst", "nop", "wdr", "sleep", "break", "sei", "cli", "sec", "clc", "sez", "clz",
+		"sen", "cln", "sev", "clv", "ses", "cls", "seh", "clh", "set", "clt", "ret", "reti", "rjmp", "jmp", "spm" };
+	const char *operands = instruction->operands;
+	uint32_t mask = 0;
+
+	if (instruction->kind == KIND_BRANCH) return 0;
+	if (instruction->kind == KIND_CALL || instruction->kind == KIND_INDIRECT) {
+		return is_call(instruction) ? 0xC0FC0001 : 0; // r0, r18 - r27, r30, r31 (call-clobbered)
+	}
+
+	// pointer registers changed by pre-decrement (-X) / post-increment (X+, not Y+2)
+	for (uint8_t x = 0; x < 3; x++) {
+		const char *pointer = strchr(operands, "XYZ"[x]);
+
+		if (pointer && ((pointer > operands && pointer[-1] == '-') || (pointer[1] == '+' && (pointer[2] < '0' || pointer[2] > '9')))) {
+			mask |= 3UL << (26 + 2 * x);
+		}
+	}
+
+	if (!strncmp(instruction->mnemonic, "st", 2)) return mask; // st, std, sts
+
+	for (uint8_t x = 0; x < sizeof(none) / sizeof(none[0]); x++) {
+		if (!strcmp(instruction->mnemonic, none[x])) return mask;
+	}
+
+	if (!strcmp(instruction->mnemonic, "lpm") && !operands[0]) return 1; // r0
+
+	if (instruction->rd < 32) {
+		mask |= 1UL << instruction->rd;
+		if (!strcmp(instruction->mnemonic, "movw") || !strcmp(instruction->mnemonic, "adiw") || !strcmp(instruction->mnemonic, "sbiw")) {
+			mask |= 1UL << (instruction->rd + 1);
+		}
+	}
+
+	return mask;
+}
+
+// --- loops ---
+
+static int16_t loop_at(function_t *function, uint16_t start, uint16_t end) {
+	for (uint8_t x = 0; x < function->loop_count; x++) {
+		loop_t *loop = &function->loops[x];
+
+		// same start or overlapping without nesting: one loop
+		uint8_t nested = (start <= loop->start && end >= loop->end) || (start >= loop->start && end <= loop->end);
+		if (start == loop->start || (!nested && start <= loop->end && end >= loop->start)) return x;
+	}
+
+	return -1;
+}
+
+static void find_loops(function_t *function) {
+	uint8_t merged = 1;
+
+	function->loop_count = 0;
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x], out[2];
+		uint8_t count = successors(node, out);
+
+		for (uint8_t y = 0; y < count; y++) {
+			if (out[y] == NONE || out[y] > node || !inside[out[y]]) continue;
+
+			int16_t existing = loop_at(function, out[y], node);
+			if (existing >= 0) {
+				loop_t *loop = &function->loops[existing];
+				if (out[y] < loop->start) loop->start = out[y];
+				if (node > loop->end) loop->end = node;
+			} else if (function->loop_count < LOOPS) {
+				loop_t *loop = &function->loops[function->loop_count++];
+				memset(loop, 0, sizeof(*loop));
+				loop->start = out[y];
+				loop->end = node;
+			} else {
+				fprintf(stderr, "%s: too many loops\n", function->name);
+				errors++;
+			}
+		}
+	}
+
+	// grown loops may overlap others now
+	while (merged) {
+		merged = 0;
+
+		for (uint8_t x = 0; x < function->loop_count && !merged; x++) {
+			for (uint8_t y = x + 1; y < function->loop_count && !merged; y++) {
+				loop_t *first = &function->loops[x], *second = &function->loops[y];
+				uint8_t nested = (first->start <= second->start && first->end >= second->end) ||
+					(second->start <= first->start && second->end >= first->end);
+
+				if (first->start != second->start && (nested || first->start > second->end || second->start > first->end)) continue;
+
+				if (second->start < first->start) first->start = second->start;
+				if (second->end > first->end) first->end = second->end;
+				*second = function->loops[--function->loop_count];
+				merged = 1;
+			}
+		}
+	}
+
+	// numbered by address, the parent is the smallest one around it
+	for (uint8_t x = 0; x < function->loop_count; x++) {
+		loop_t *loop = &function->loops[x];
+
+		loop->number = 1;
+		loop->parent = -1;
+
+		for (uint8_t y = 0; y < function->loop_count; y++) {
+			loop_t *other = &function->loops[y];
+
+			if (y == x) continue;
+			if (other->start < loop->start) loop->number++;
+			if (other->start <= loop->start && other->end >= loop->end &&
+				(loop->parent < 0 || other->end - other->start < function->loops[loop->parent].end - function->loops[loop->parent].start)) {
+				loop->parent = y;
+			}
+		}
+	}
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x];
+		int16_t innermost = -1;
+
+		for (uint8_t y = 0; y < function->loop_count; y++) {
+			loop_t *loop = &function->loops[y];
+
+			if (node < loop->start || node > loop->end) continue;
+			if (innermost < 0 || loop->end - loop->start < function->loops[innermost].end - function->loops[innermost].start) innermost = y;
+		}
+
+		loop_of[node] = innermost;
+	}
+}
+
+static uint8_t in_loop(const function_t *function, uint16_t node, int16_t loop) {
+	if (loop < 0) return inside[node];
+	return inside[node] && node >= function->loops[loop].start && node <= function->loops[loop].end;
+}
+
+// the value loaded with ldi (or clr) into the counter (registers low byte first)
+// before the loop starts, on the only way in. 0 = can't tell
+static uint8_t counter_start(function_t *function, int16_t loop_index, const uint8_t *registers, uint8_t length, uint32_t *value) {
+	loop_t *loop = &function->loops[loop_index];
+	uint16_t entries = 0, from = NONE;
+
+	// only one way in, from right before it (or a jump from there into it)
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x], out[2];
+		uint8_t count = successors(node, out);
+
+		if (in_loop(function, node, loop_index)) continue;
+		for (uint8_t y = 0; y < count; y++) {
+			if (out[y] != NONE && in_loop(function, out[y], loop_index)) {
+				entries++;
+				from = node;
+			}
+		}
+	}
+
+	if (entries != 1 || from != loop->start - 1) return 0;
+
+	uint32_t found = 0, counter = 0;
+
+	for (uint8_t x = 0; x < length; x++) counter |= 1UL << registers[x];
+	*value = 0;
+
+	for (uint16_t x = 0, node = from; x < COUNTER_SCAN && node != NONE && inside[node]; x++, node--) {
+		const instruction_t *instruction = &instructions[node];
+		uint32_t written = written_registers(instruction) & counter & ~found;
+
+		if (instruction->kind != KIND_NORMAL && !(node == from && instruction->kind == KIND_JUMP)) break;
+
+		if (written) {
+			uint8_t byte = 0;
+
+			while (registers[byte] != instruction->rd) byte++;
+
+			if (!strcmp(instruction->mnemonic, "ldi") && instruction->k >= 0) {
+				*value |= (uint32_t)(instruction->k & 0xFF) << (8 * byte);
+			} else if (strcmp(instruction->mnemonic, "clr") && (strcmp(instruction->mnemonic, "eor") || instruction->rd != instruction->rr)) {
+				return 0; // not a constant
+			}
+			found |= written;
+		}
+
+		if (found == counter) return 1;
+		if (node == 0 || instructions[node].target_of) break; // someone else jumps in here
+	}
+
+	return 0;
+}
+
+// nothing else in the loop (inner ones and calls included) changes them
+static uint8_t counter_untouched(function_t *function, int16_t loop_index, uint32_t counter, uint16_t first, uint16_t last) {
+	loop_t *loop = &function->loops[loop_index];
+
+	for (uint16_t node = loop->start; node <= loop->end; node++) {
+		if (!inside[node] || (node >= first && node <= last)) continue;
+		if (written_registers(&instructions[node]) & counter) return 0;
+	}
+
+	return 1;
+}
+
+// counter loops: dec / subi 1 (+ sbci 0) / sbiw 1 with a brne back or a breq
+// out right after it, or subi 0xFF / inc up to a cpi with a brne / brlo back
+// or a breq / brsh out
+static uint32_t counter_bound(function_t *function, int16_t loop_index) {
+	loop_t *loop = &function->loops[loop_index];
+
+	for (uint16_t node = loop->start; node <= loop->end; node++) {
+		const instruction_t *branch = &instructions[node];
+
+		if (!inside[node] || loop_of[node] != loop_index || branch->kind != KIND_BRANCH || node == 0) continue;
+
+		uint16_t target = index_of(branch->target);
+		uint8_t back = target != NONE && in_loop(function, target, loop_index);
+		const char *condition = branch->mnemonic + 2;
+		uint8_t while_not_equal = (!strcmp(condition, "ne") && back) || (!strcmp(condition, "eq") && !back);
+		uint8_t while_lower = while_not_equal || (!strcmp(condition, "lo") && back) || (!strcmp(condition, "cs") && back) ||
+			(!strcmp(condition, "sh") && !back) || (!strcmp(condition, "cc") && !back);
+		const instruction_t *test = &instructions[node - 1];
+		uint8_t registers[4], length = 0;
+		uint32_t counter = 0, value;
+		uint16_t first = node - 1;
+
+		if (!while_lower || !inside[node - 1]) continue;
+
+		// counting down to 0
+		if (while_not_equal) {
+			if (!strcmp(test->mnemonic, "sbiw") && test->k == 1) {
+				registers[length++] = test->rd;
+				registers[length++] = test->rd + 1;
+			} else if ((!strcmp(test->mnemonic, "subi") && test->k == 1) || !strcmp(test->mnemonic, "dec")) {
+				registers[length++] = test->rd;
+			} else if (!strcmp(test->mnemonic, "sbci") && test->k == 0) {
+				// subi rA, 0x01; sbci rB, 0x00; sbci rC, 0x00 (the _delay_ms ones)
+				while (first > loop->start && length < 3 && !strcmp(instructions[first].mnemonic, "sbci") && instructions[first].k == 0) first--;
+				if (!strcmp(instructions[first].mnemonic, "subi") && instructions[first].k == 1) {
+					for (uint16_t byte = first; byte < node; byte++) registers[length++] = instructions[byte].rd;
+				}
+			}
+
+			for (uint8_t x = 0; x < length; x++) counter |= 1UL << registers[x];
+
+			if (length && counter_untouched(function, loop_index, counter, first, node - 1) &&
+				counter_start(function, loop_index, registers, length, &value)) {
+				return value ? value : 1UL << (8 * length);
+			}
+		}
+
+		// counting up to a cpi
+		if (!strcmp(test->mnemonic, "cpi") && test->k > 0) {
+			uint16_t increment = NONE;
+
+			registers[0] = test->rd;
+			counter = 1UL << test->rd;
+			for (uint16_t other = loop->start; other <= loop->end; other++) {
+				if (!inside[other] || !(written_registers(&instructions[other]) & counter)) continue;
+
+				const instruction_t *instruction = &instructions[other];
+				if (increment != NONE || !((!strcmp(instruction->mnemonic, "subi") && instruction->k == 0xFF) || !strcmp(instruction->mnemonic, "inc"))) {
+					increment = NONE;
+					break;
+				}
+				increment = other;
+			}
+
+			if (increment != NONE && counter_start(function, loop_index, registers, 1, &value) && value < (uint32_t)test->k) {
+				return test->k - value;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// waits on an I/O bit: sbis / sbic on it, or an in of the register and a sbrs / sbrc of the bit
+static uint32_t io_bound(function_t *function, int16_t loop_index) {
+	loop_t *loop = &function->loops[loop_index];
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		annotation_t *annotation = &annotations[x];
+
+		if (annotation->type != ANNOTATION_IO) continue;
+
+		for (uint16_t node = loop->start; node <= loop->end; node++) {
+			const instruction_t *instruction = &instructions[node];
+			uint8_t found = 0;
+
+			if (!inside[node]) continue;
+
+			if ((!strcmp(instruction->mnemonic, "sbis") || !strcmp(instruction->mnemonic, "sbic")) &&
+				strtol(instruction->operands, NULL, 0) == annotation->number && instruction->k == annotation->bit) {
+				found = 1;
+			}
+
+			if (!strcmp(instruction->mnemonic, "in") && instruction->k == annotation->number) {
+				for (uint16_t test = node + 1; test <= loop->end && !found; test++) {
+					const instruction_t *bit = &instructions[test];
+
+					if (inside[test] && (!strcmp(bit->mnemonic, "sbrs") || !strcmp(bit->mnemonic, "sbrc") || !strcmp(bit->mnemonic, "andi")) &&
+						bit->rd == instruction->rd && (bit->k == annotation->bit || (!strcmp(bit->mnemonic, "andi") && bit->k == (1 << annotation->bit)))) {
+						found = 1;
+					}
+				}
+			}
+
+			if (found) {
+				annotation->used = 1;
+				return annotation->value;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void loop_bound(function_t *function, int16_t loop_index) {
+	loop_t *loop = &function->loops[loop_index];
+	uint32_t bound;
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		annotation_t *annotation = &annotations[x];
+
+		if (annotation->type == ANNOTATION_LOOP && annotation->number == loop->number && !strcmp(annotation->function, function->name)) {
+			annotation->used = 1;
+			loop->bound = annotation->value;
+			loop->bound_source = BOUND_ANNOTATION;
+			return;
+		}
+	}
+
+	if ((bound = counter_bound(function, loop_index))) {
+		loop->bound = bound;
+		loop->bound_source = BOUND_COUNTER;
+		return;
+	}
+
+	if ((bound = io_bound(function, loop_index))) {
+		loop->bound = bound;
+		loop->bound_source = BOUND_IO;
+		return;
+	}
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		annotation_t *annotation = &annotations[x];
+
+		if (annotation->type == ANNOTATION_LOOP && !annotation->number && !strcmp(annotation->function, function->name)) {
+			annotation->used = 1;
+			loop->bound = annotation->value;
+			loop->bound_source = BOUND_FUNCTION;
+			return;
+		}
+	}
+
+	char start[SYMBOL_LENGTH + 16];
+
+	snprintf(start, sizeof(start), "%s", describe(instructions[loop->start].address));
+	fprintf(stderr, "no bound for loop %u of %s (%s - %s), add it to the bounds file\n", loop->number, function->name,
+		start, describe(instructions[loop->end].address));
+	errors++;
+}
+
+// --- longest paths ---
+
+static uint64_t function_wcet(function_t *function);
+static uint64_t loop_cost(function_t *function, int16_t loop_index);
+
+// what a node stands for in the scope of a loop (or the whole function, -1):
+// itself, or the loop right under the scope it's in (its first instruction)
+static uint16_t unit_of(function_t *function, uint16_t node, int16_t scope) {
+	int16_t loop = loop_of[node];
+
+	if (loop == scope) return node;
+	while (loop >= 0 && function->loops[loop].parent != scope) loop = function->loops[loop].parent;
+	return loop >= 0 ? function->loops[loop].start : node;
+}
+
+static int16_t unit_loop(function_t *function, uint16_t unit, int16_t scope) {
+	int16_t loop = loop_of[unit];
+
+	if (loop == scope) return -1;
+	while (loop >= 0 && function->loops[loop].parent != scope) loop = function->loops[loop].parent;
+	return loop;
+}
+
+static uint64_t unit_cost(function_t *function, uint16_t unit, int16_t scope) {
+	int16_t loop = unit_loop(function, unit, scope);
+	const instruction_t *instruction = &instructions[unit];
+	uint64_t cycles = instruction_cycles(unit);
+
+	if (loop >= 0) return loop_cost(function, loop);
+
+	if (is_call(instruction) || is_tail_call(instruction)) {
+		uint16_t target = index_of(instruction->target);
+		function_t *callee = target != NONE ? function_for(target) : NULL;
+
+		if (callee) cycles += function_wcet(callee);
+	}
+
+	return cycles;
+}
+
+// longest paths through the scope (a loop, or -1 for the whole function), back
+// edges left out, from the entries (distance 0). distance[unit]: up to its start
+static void longest_paths(function_t *function, int16_t scope, const uint16_t *entries, uint8_t entry_count) {
+	// the loops right under it first (they need the scratch arrays too)
+	for (uint8_t x = 0; x < function->loop_count; x++) {
+		if (function->loops[x].parent == scope && (scope < 0 || x != scope)) loop_cost(function, x);
+	}
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		distance[function->nodes[x]] = UINT64_MAX;
+		previous[function->nodes[x]] = NONE;
+	}
+
+	for (uint8_t x = 0; x < entry_count; x++) distance[unit_of(function, entries[x], scope)] = 0;
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x];
+
+		if (!in_loop(function, node, scope) || unit_of(function, node, scope) != node || distance[node] == UINT64_MAX) continue;
+
+		uint64_t after = distance[node] + unit_cost(function, node, scope);
+		int16_t loop = unit_loop(function, node, scope);
+		uint16_t last = loop >= 0 ? function->loops[loop].end : node;
+
+		// every way out of it (of the whole inner loop)
+		for (uint16_t from = node; from <= last; from++) {
+			uint16_t out[2];
+			uint8_t count;
+
+			if (!inside[from]) continue;
+			count = successors(from, out);
+
+			for (uint8_t y = 0; y < count; y++) {
+				if (out[y] == NONE || !in_loop(function, out[y], scope)) continue;
+
+				uint16_t unit = unit_of(function, out[y], scope);
+				if (unit <= node) continue; // back edge
+
+				if (distance[unit] == UINT64_MAX || after > distance[unit]) {
+					distance[unit] = after;
+					previous[unit] = node;
+				}
+			}
+		}
+	}
+}
+
+static uint64_t loop_cost(function_t *function, int16_t loop_index) {
+	loop_t *loop = &function->loops[loop_index];
+	uint16_t entries[16];
+	uint8_t entry_count = 0;
+
+	if (loop->state == 2) return loop->cost;
+	loop->state = 2;
+
+	loop_bound(function, loop_index);
+
+	// its start, and wherever the way in lands
+	entries[entry_count++] = loop->start;
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x], out[2];
+		uint8_t count = successors(node, out);
+
+		if (in_loop(function, node, loop_index)) continue;
+		for (uint8_t y = 0; y < count && entry_count < 16; y++) {
+			if (out[y] != NONE && in_loop(function, out[y], loop_index)) entries[entry_count++] = out[y];
+		}
+	}
+
+	longest_paths(function, loop_index, entries, entry_count);
+
+	loop->iteration = 0;
+	for (uint16_t node = loop->start; node <= loop->end; node++) {
+		if (!inside[node] || unit_of(function, node, loop_index) != node || distance[node] == UINT64_MAX) continue;
+
+		uint64_t after = distance[node] + unit_cost(function, node, loop_index);
+		if (after > loop->iteration) loop->iteration = after;
+	}
+
+	loop->cost = (loop->bound + 1) * loop->iteration;
+	return loop->cost;
+}
+
+// the instructions of the function (reachable from its entry) and its loops
+static void build_function(function_t *function) {
+	uint16_t *stack = calloc(instruction_count, sizeof(uint16_t)), depth = 0;
+
+	memset(inside, 0, instruction_count);
+	stack[depth++] = function->entry;
+	inside[function->entry] = 1;
+
+	while (depth) {
+		uint16_t node = stack[--depth], out[2];
+		uint8_t count = successors(node, out);
+
+		for (uint8_t x = 0; x < count; x++) {
+			if (out[x] == NONE) {
+				fprintf(stderr, "%s: runs off the code at %s\n", function->name, describe(instructions[node].address));
+				errors++;
+			} else if (!inside[out[x]]) {
+				inside[out[x]] = 1;
+				stack[depth++] = out[x];
+			}
+		}
+	}
+
+	free(stack);
+
+	function->node_count = 0;
+	function->nodes = calloc(instruction_count, sizeof(uint16_t));
+	for (uint16_t x = 0; x < instruction_count; x++) {
+		const instruction_t *instruction = &instructions[x];
+
+		if (!inside[x]) continue;
+		function->nodes[function->node_count++] = x;
+
+		if (instruction->kind == KIND_INDIRECT) {
+			fprintf(stderr, "%s: %s at %s, give the function a %s in the bounds file\n", function->name,
+				instruction->mnemonic, describe(instruction->address), ram ? "stack" : "cost");
+			errors++;
+		} else if (instruction->kind == KIND_INVALID) {
+			fprintf(stderr, "%s: not an instruction at %s\n", function->name, describe(instruction->address));
+			errors++;
+		} else if ((is_call(instruction) || is_tail_call(instruction)) && index_of(instruction->target) == NONE) {
+			fprintf(stderr, "%s: call out of the code at %s\n", function->name, describe(instruction->address));
+			errors++;
+		}
+	}
+
+	find_loops(function);
+}
+
+// the scratch arrays belong to one function at a time: callees first
+static void analyze_callees(function_t *function) {
+	uint16_t *calls = calloc(function->node_count, sizeof(uint16_t)), call_count = 0;
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		const instruction_t *instruction = &instructions[function->nodes[x]];
+
+		if ((is_call(instruction) || is_tail_call(instruction)) && index_of(instruction->target) != NONE) {
+			calls[call_count++] = index_of(instruction->target);
+		}
+	}
+
+	for (uint16_t x = 0; x < call_count; x++) {
+		function_t *callee = function_for(calls[x]);
+
+		if (callee) {
+			callee->calls++;
+			function_wcet(callee);
+		}
+	}
+
+	free(calls);
+}
+
+static void restore_function(function_t *function) {
+	memset(inside, 0, instruction_count);
+	for (uint16_t x = 0; x < function->node_count; x++) inside[function->nodes[x]] = 1;
+	find_loops(function);
+}
+
+static uint64_t function_wcet(function_t *function) {
+	if (function->state == 2 || function->ignored || function->annotated) return function->ignored ? 0 : function->wcet;
+
+	if (function->state == 1) {
+		fprintf(stderr, "%s: recursion, give it a cost in the bounds file\n", function->name);
+		errors++;
+		return 0;
+	}
+
+	function->state = 1;
+
+	build_function(function);
+	analyze_callees(function);
+	restore_function(function);
+
+	longest_paths(function, -1, &function->entry, 1);
+
+	function->wcet = 0;
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x];
+
+		if (unit_of(function, node, -1) != node || distance[node] == UINT64_MAX) continue;
+
+		uint64_t after = distance[node] + unit_cost(function, node, -1);
+		if (after > function->wcet) function->wcet = after;
+	}
+
+	function->state = 2;
+	return function->wcet;
+}
+
+// --- stack ---
+
+// bytes an instruction takes: push, rcall .+0 and the frame of gcc (in r28,
+// 0x3d, then sbiw r28, N or subi r28, lo / sbci r29, hi)
+static uint32_t stack_bytes(uint16_t index) {
+	const instruction_t *instruction = &instructions[index];
+	uint8_t subi = !strcmp(instruction->mnemonic, "subi");
+
+	if (!strcmp(instruction->mnemonic, "push")) return 1;
+	if (instruction->kind == KIND_CALL && !is_call(instruction)) return 2;
+	if (instruction->rd != 28 || instruction->k < 0 || (!subi && strcmp(instruction->mnemonic, "sbiw"))) return 0;
+
+	// only right after reading SP (otherwise Y is just another pointer)
+	for (uint16_t x = index, y = 0; x > 0 && y < FRAME_SCAN; x--, y++) {
+		const instruction_t *before = &instructions[x - 1];
+
+		if (!strcmp(before->mnemonic, "in") && before->rd == 28 && before->k == 0x3d) {
+			uint16_t next = next_of(index);
+			uint32_t bytes = instruction->k;
+
+			if (subi && next != NONE && !strcmp(instructions[next].mnemonic, "sbci") && instructions[next].rd == 29 && instructions[next].k > 0) {
+				bytes += instructions[next].k << 8;
+			}
+			return bytes;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t function_stack(function_t *function) {
+	uint32_t deepest = 0;
+
+	if (function->stack_state == 2) return function->stack;
+
+	if (function->stack_state == 1) {
+		fprintf(stderr, "%s: recursion, give it a stack in the bounds file\n", function->name);
+		errors++;
+		return 0;
+	}
+
+	function->stack_state = 1;
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		annotation_t *annotation = &annotations[x];
+
+		if (annotation->type == ANNOTATION_STACK && !strcmp(annotation->function, function->name)) {
+			annotation->used = function->annotated = 1;
+			function->frame = function->stack = annotation->value;
+			function->stack_state = 2;
+			return function->stack;
+		}
+	}
+
+	if (!function->nodes) build_function(function);
+
+	for (uint16_t x = 0; x < function->node_count; x++) {
+		uint16_t node = function->nodes[x];
+		const instruction_t *instruction = &instructions[node];
+
+		function->frame += stack_bytes(node);
+		if (!strcmp(instruction->mnemonic, "sei")) function->enables_interrupts = 1;
+
+		if ((is_call(instruction) || is_tail_call(instruction)) && index_of(instruction->target) != NONE) {
+			function_t *callee = function_for(index_of(instruction->target));
+			uint32_t depth;
+
+			if (!callee) continue;
+
+			// a tail call leaves the return address of the caller
+			depth = function_stack(callee) + (is_call(instruction) ? 2 : 0);
+			callee->calls++;
+			if (!function->deepest || depth > deepest) {
+				deepest = depth;
+				function->deepest = callee;
+			}
+		}
+	}
+
+	function->stack = function->frame + deepest;
+	function->stack_state = 2;
+	return function->stack;
+}
+
+// "main > usbPoll > usbFunctionSetup"
+static void print_stack_path(const function_t *function) {
+	printf("%s", function->name);
+	for (function = function->deepest; function; function = function->deepest) printf(" > %s", function->name);
+	printf("\n");
+}
+
+// --- RAM ---
+
+typedef struct {
+	const char	*name;
+	uint32_t	data;				// .data
+	uint32_t	bss;				// .bss, .noinit
+} module_t;
+
+static module_t modules[] = {
+	{ "usbdrv" }, { "osccal" }, { "driver" }, { "i2c" }, { "sampler" }, { "report" }, { "ticks" },
+	{ "diagnostics" }, { "profiler" }, { "stack" }, { "main" },
+};
+
+#define MODULES				(sizeof(modules) / sizeof(modules[0]))
+
+// main.o is everything main.c includes: by the name
+static const struct {
+	const char	*prefix;
+	const char	*module;
+} module_prefixes[] = {
+	{ "snes_", "driver" }, { "i2c_", "i2c" }, { "sampler_", "sampler" }, { "report_", "report" }, { "ticks_", "ticks" },
+	{ "diagnostics", "diagnostics" }, { "profiler_", "profiler" }, { "stack_", "stack" },
+};
+
+static module_t *module_of(const char *object, const char *name) {
+	const char *module = "main";
+
+	if (strstr(object, "usbdrv")) module = "usbdrv";
+	else if (strstr(object, "osccal")) module = "osccal";
+	else {
+		for (uint8_t x = 0; x < sizeof(module_prefixes) / sizeof(module_prefixes[0]); x++) {
+			if (!strncmp(name, module_prefixes[x].prefix, strlen(module_prefixes[x].prefix))) module = module_prefixes[x].module;
+		}
+	}
+
+	for (uint8_t x = 0; x < MODULES; x++) {
+		if (!strcmp(modules[x].name, module)) return &modules[x];
+	}
+	return &modules[MODULES - 1];
+}
+
+// avr-nm -S -A: "main.o:00000004 00000002 b snes_read_buffer", and _end
+// ("main.elf:00800150 B _end") for the total. Returns 0 on bad input
+static uint8_t read_symbols(const char *path, uint32_t *end) {
+	FILE *file = fopen(path, "r");
+	char line[256];
+
+	if (!file) {
+		perror(path);
+		return 0;
+	}
+
+	*end = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		char *colon = strchr(line, ':'), *fields[4];
+		uint8_t count = 0;
+
+		if (!colon) continue;
+		*colon = 0;
+
+		for (char *field = strtok(colon + 1, " \t\n"); field && count < 4; field = strtok(NULL, " \t\n")) fields[count++] = field;
+
+		if (count == 3 && !strcmp(fields[2], "_end")) *end = strtoul(fields[0], NULL, 16);
+		if (count != 4 || strlen(fields[2]) != 1) continue;
+
+		// objects only (main.elf has them all again)
+		size_t length = strlen(line);
+		if (length < 2 || strcmp(line + length - 2, ".o")) continue;
+
+		module_t *module = module_of(line, fields[3]);
+		uint32_t size = strtoul(fields[1], NULL, 16);
+
+		switch (fields[2][0]) {
+			case 'd': case 'D':
+				module->data += size;
+				break;
+
+			case 'b': case 'B': case 'C': // (C: common, still .bss once linked)
+				module->bss += size;
+				break;
+		}
+	}
+
+	fclose(file);
+	return 1;
+}
+
+static int ram_report(const char *path, const char *bounds, const char *symbols_path, uint32_t margin) {
+	uint32_t end, data = 0, bss = 0, total, stack, blocking = 0, nesting = 0;
+	function_t *main_function = NULL, *vectors[32];
+	uint8_t vector_count = 0;
+
+	if (!read_symbols(symbols_path, &end)) return 2;
+
+	for (uint16_t x = 0; x < symbol_count; x++) {
+		uint16_t entry = index_of(symbols[x].address);
+
+		if (entry == NONE) continue;
+		if (!strcmp(symbols[x].name, "main")) main_function = function_for(entry);
+		else if (!strncmp(symbols[x].name, "__vector_", 9) && vector_count < 32) vectors[vector_count++] = function_for(entry);
+	}
+
+	if (!main_function) {
+		fprintf(stderr, "%s: no main\n", path);
+		return 2;
+	}
+
+	printf("%s: static RAM per module\n\n%-40s %6s %6s %6s\n", symbols_path, "module", ".data", ".bss", "total");
+	for (uint8_t x = 0; x < MODULES; x++) {
+		if (!modules[x].data && !modules[x].bss) continue;
+		printf("%-40s %6u %6u %6u\n", modules[x].name, modules[x].data, modules[x].bss, modules[x].data + modules[x].bss);
+		data += modules[x].data;
+		bss += modules[x].bss;
+	}
+
+	total = data + bss;
+	if (end > DATA_OFFSET + RAM_START + total) {
+		printf("%-40s %20u\n", "(the libraries, alignment)", end - DATA_OFFSET - RAM_START - total);
+		total = end - DATA_OFFSET - RAM_START;
+	} else if (!end) {
+		fprintf(stderr, "%s: no _end, only the objects are counted\n", symbols_path);
+	}
+	printf("%-40s %20u\n", "total (from _end)", total);
+
+	// main is called by the startup code: 2 more
+	stack = function_stack(main_function) + 2;
+	printf("\nworst case stack\n\n%-40s %6u  ", "main", stack);
+	print_stack_path(main_function);
+
+	for (uint8_t x = 0; x < vector_count; x++) {
+		function_t *vector = vectors[x];
+		uint32_t depth = function_stack(vector) + 2;
+		char name[SYMBOL_LENGTH + 16];
+
+		// sei inside: all the others can come on top of it (once each), otherwise one at a time
+		if (vector->enables_interrupts) nesting += depth;
+		else if (depth > blocking) blocking = depth;
+
+		snprintf(name, sizeof(name), "%s%s", vector->name, vector->enables_interrupts ? " (sei)" : "");
+		printf("%-40s %6u  ", name, depth);
+		print_stack_path(vector);
+	}
+
+	stack += nesting + blocking;
+	printf("%-40s %6u\n", "total (main + the interrupts on top)", stack);
+
+	if (verbose) {
+		printf("\n%-40s %6s %6s\n", "function", "frame", "stack");
+		for (uint16_t x = 0; x < function_count; x++) {
+			function_t *function = &functions[x];
+
+			if (function->stack_state != 2) continue;
+			printf("%-40s %6u %6u%s\n", function->name, function->frame, function->stack, function->annotated ? "  from the bounds file" : "");
+		}
+	}
+
+	printf("\nRAM: %u bytes, %u static + %u of stack, %d free (margin %u)\n", RAM_BYTES, total, stack,
+		(int)(RAM_BYTES - total - stack), margin);
+
+	fflush(stdout);
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		if (annotations[x].type == ANNOTATION_STACK && !annotations[x].used) {
+			fprintf(stderr, "%s:%u: not used (inlined? renamed?)\n", bounds, annotations[x].line);
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "%u problems, the stack above is not a bound\n", errors);
+		return 1;
+	}
+
+	if (total + stack + margin > RAM_BYTES) {
+		fprintf(stderr, "RAM: %u static + %u of stack + %u of margin, over the %u bytes\n", total, stack, margin, RAM_BYTES);
+		return 1;
+	}
+
+	return 0;
+}
+
+// --- report ---
+
+static void print_loops(function_t *function, int16_t main_loop) {
+	for (uint8_t number = 1; number <= function->loop_count; number++) {
+		for (uint8_t x = 0; x < function->loop_count; x++) {
+			loop_t *loop = &function->loops[x];
+
+			if (loop->number != number) continue;
+
+			printf("  loop %-3u %-32s %8lu x %8llu cycles  (%s)\n", loop->number, describe(instructions[loop->start].address),
+				(unsigned long)loop->bound, (unsigned long long)loop->iteration,
+				x == main_loop ? "the usbPoll loop" : (loop->state == 2 ? bound_names[loop->bound_source] : "not on any path"));
+		}
+	}
+}
+
+static int function_compare(const void *a, const void *b) {
+	const function_t *first = *(const function_t **)a, *second = *(const function_t **)b;
+	return first->wcet < second->wcet ? 1 : (first->wcet > second->wcet ? -1 : 0);
+}
+
+int main(int argc, char **argv) {
+	const char *bounds = NULL, *path = NULL, *symbols_path = NULL;
+	double budget_us = 0;
+	uint32_t margin = 0;
+
+	for (int x = 1; x < argc; x++) {
+		if (!strcmp(argv[x], "-v")) verbose = 1;
+		else if (!strcmp(argv[x], "-b") && x + 1 < argc) budget_us = atof(argv[++x]);
+		else if (!strcmp(argv[x], "-r") && x + 1 < argc) symbols_path = argv[++x];
+		else if (!strcmp(argv[x], "-m") && x + 1 < argc) margin = atoi(argv[++x]);
+		else if (!bounds) bounds = argv[x];
+		else path = argv[x];
+	}
+
+	if (!bounds || !path) {
+		fprintf(stderr, "usage: %s [-v] [-b budget_us] bounds disassembly (- = stdin)\n", argv[0]);
+		fprintf(stderr, "       %s [-v] -r symbols [-m margin] bounds disassembly\n", argv[0]);
+		return 2;
+	}
+
+	if (!read_annotations(bounds)) return 2;
+
+	FILE *file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!file) {
+		perror(path);
+		return 2;
+	}
+
+	uint8_t read = read_disassembly(file);
+	if (file != stdin) fclose(file);
+
+	if (!read) {
+		fprintf(stderr, "%s: no instructions\n", path);
+		return 2;
+	}
+
+	inside = calloc(instruction_count, 1);
+	loop_of = calloc(instruction_count, sizeof(int16_t));
+	distance = calloc(instruction_count, sizeof(uint64_t));
+	previous = calloc(instruction_count, sizeof(uint16_t));
+
+	// every call target is a function (tail calls: jumps to one of them)
+	for (uint16_t x = 0; x < instruction_count; x++) {
+		uint16_t target = index_of(instructions[x].target);
+		if (is_call(&instructions[x]) && target != NONE) call_target[target] = 1;
+	}
+
+	ram = symbols_path != NULL;
+	if (ram) return ram_report(path, bounds, symbols_path, margin);
+
+	// the usbPoll call, and the function it's in (main)
+	uint16_t poll = NONE, poll_entry = NONE, call = NONE;
+
+	for (uint16_t x = 0; x < symbol_count; x++) {
+		if (!strcmp(symbols[x].name, "usbPoll")) poll = index_of(symbols[x].address);
+	}
+
+	for (uint16_t x = 0; x < symbol_count && poll != NONE; x++) {
+		if (!strcmp(symbols[x].name, "main")) poll_entry = index_of(symbols[x].address);
+	}
+
+	if (poll == NONE || poll_entry == NONE) {
+		fprintf(stderr, "%s: no main or usbPoll\n", path);
+		return 2;
+	}
+
+	function_t *main_function = function_for(poll_entry);
+
+	main_function->state = 1;
+	build_function(main_function);
+	analyze_callees(main_function);
+	restore_function(main_function);
+
+	for (uint16_t x = 0; x < main_function->node_count; x++) {
+		uint16_t node = main_function->nodes[x];
+
+		if (is_call(&instructions[node]) && index_of(instructions[node].target) == poll) {
+			if (call != NONE) {
+				fprintf(stderr, "main: more than one usbPoll call\n");
+				return 2;
+			}
+			call = node;
+		}
+	}
+
+	int16_t loop_index = call != NONE ? loop_of[call] : -1;
+	if (loop_index < 0) {
+		fprintf(stderr, "main: the usbPoll call is not in a loop\n");
+		return 2;
+	}
+
+	// from the call to the end of the iteration...
+	loop_t *loop = &main_function->loops[loop_index];
+	uint16_t targets[16], target_count = 0, path_nodes[512], path_count = 0;
+	uint64_t to_end = 0, from_start;
+	uint16_t end = NONE;
+
+	longest_paths(main_function, loop_index, &call, 1);
+
+	for (uint16_t node = call; node <= loop->end; node++) {
+		uint16_t out[2];
+		uint8_t count;
+
+		if (!inside[node] || unit_of(main_function, node, loop_index) != node || distance[node] == UINT64_MAX) continue;
+
+		for (uint16_t from = node, last = unit_loop(main_function, node, loop_index) >= 0 ?
+			main_function->loops[unit_loop(main_function, node, loop_index)].end : node; from <= last; from++) {
+			if (!inside[from]) continue;
+			count = successors(from, out);
+
+			for (uint8_t y = 0; y < count; y++) {
+				if (out[y] == NONE || !in_loop(main_function, out[y], loop_index) || unit_of(main_function, out[y], loop_index) >= node) continue;
+
+				uint64_t after = distance[node] + unit_cost(main_function, node, loop_index);
+				if (end == NONE || after > to_end) {
+					to_end = after;
+					end = node;
+				}
+
+				uint8_t known = 0;
+				for (uint8_t z = 0; z < target_count; z++) known |= targets[z] == out[y];
+				if (!known && target_count < 16) targets[target_count++] = out[y];
+			}
+		}
+	}
+
+	for (uint16_t node = end; node != NONE && path_count < 512; node = previous[node]) path_nodes[path_count++] = node;
+
+	// ...and from the start of the next one back to the call
+	longest_paths(main_function, loop_index, targets, target_count);
+	from_start = distance[call];
+
+	if (end == NONE || from_start == UINT64_MAX) {
+		fprintf(stderr, "main: the usbPoll call doesn't come around again\n");
+		return 2;
+	}
+
+	for (uint16_t node = previous[call]; node != NONE && path_count < 512; node = previous[node]) path_nodes[path_count++] = node;
+
+	uint64_t total = to_end + from_start;
+	double total_us = total * 1e6 / F_CPU;
+
+	printf("%s: usbPoll to usbPoll, worst case %llu cycles, %.1f us", path, (unsigned long long)total, total_us);
+	if (budget_us > 0) printf(" (budget %.0f us)", budget_us);
+	printf("\n\nworst path, the calls and loops on it:\n");
+
+	// (collected backwards: the end of the iteration first)
+	for (int16_t x = path_count - 1; x >= 0; x--) {
+		uint16_t node = path_nodes[x];
+		int16_t inner = unit_loop(main_function, node, loop_index);
+		const instruction_t *instruction = &instructions[node];
+
+		if (inner >= 0) {
+			loop_t *child = &main_function->loops[inner];
+			printf("  %-40s %10llu cycles (loop, %lu x %llu)\n", describe(instruction->address), (unsigned long long)child->cost,
+				(unsigned long)child->bound, (unsigned long long)child->iteration);
+		} else if (is_call(instruction) || is_tail_call(instruction)) {
+			function_t *callee = function_for(index_of(instruction->target));
+			printf("  %-40s %10llu cycles (%s%s)\n", describe(instruction->address), (unsigned long long)unit_cost(main_function, node, loop_index),
+				callee->name, callee->ignored ? ", ignored" : "");
+		}
+	}
+
+	function_t *sorted[FUNCTIONS];
+	uint16_t sorted_count = 0;
+
+	for (uint16_t x = 0; x < function_count; x++) {
+		if (&functions[x] != main_function) sorted[sorted_count++] = &functions[x];
+	}
+	qsort(sorted, sorted_count, sizeof(sorted[0]), function_compare);
+
+	printf("\n%-40s %10s %10s %6s\n", "function (worst case, callees included)", "cycles", "us", "loops");
+	for (uint16_t x = 0; x < sorted_count; x++) {
+		function_t *function = sorted[x];
+
+		printf("%-40s %10llu %10.1f %6u%s\n", function->name, (unsigned long long)function->wcet, function->wcet * 1e6 / F_CPU,
+			function->loop_count, function->ignored ? "  ignored" : (function->annotated ? "  from the bounds file" : ""));
+		if (verbose) print_loops(function, -1);
+	}
+
+	if (verbose) {
+		printf("\nmain\n");
+		print_loops(main_function, loop_index);
+	}
+
+	fflush(stdout);
+
+	for (uint8_t x = 0; x < annotation_count; x++) {
+		if (!annotations[x].used && annotations[x].type != ANNOTATION_STACK) {
+			fprintf(stderr, "%s:%u: not used (inlined? renamed?)\n", bounds, annotations[x].line);
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "%u problems, the worst case above is not a bound\n", errors);
+		return 1;
+	}
+
+	if (budget_us > 0 && total_us > budget_us) {
+		fprintf(stderr, "usbPoll to usbPoll: %.1f us, over the budget (%.0f us)\n", total_us, budget_us);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*
+	Linux host tool for the adapter vendor requests (see VENDOR_RQ_* on main.c).
+
+	It talks to the device through usbfs (/dev/bus/usb), no libusb needed.
+	The feature report (diagnostics) goes through hidraw (/dev/hidrawN)
+	instead: the interface belongs to the HID driver, and a class request
+	over usbfs would need it claimed (EBUSY):
+
+		gcc -Wall -O2 -o nesminictl tools/nesminictl.c
+		./nesminictl timing			poll interval and the measured read timing
+		./nesminictl events			queued button changes (SAMPLER_EVENTS builds)
+		./nesminictl events watch	... again every poll interval, until ctrl-c
+		./nesminictl profile		main loop profile (PROFILER builds)
+		./nesminictl profile reset
+		./nesminictl diagnostics	counters from the feature report (see diagnostics.c)
+		./nesminictl stack			stack high-water mark (see stack.c)
+
+	Needs read/write access to the device nodes (root, or an udev rule).
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+#include <linux/usbdevice_fs.h>
+
+// usbconfig.h: USB_CFG_VENDOR_ID / USB_CFG_DEVICE_ID
+#define NESMINI_VENDOR_ID		0x16C0
+#define NESMINI_PRODUCT_ID		0x0101
+
+// main.c
+#define VENDOR_RQ_GET_EVENTS	1
+#define VENDOR_RQ_GET_TIMING	2
+#define VENDOR_RQ_GET_PROFILE	3
+#define VENDOR_RQ_RESET_PROFILE	4
+#define VENDOR_RQ_GET_STACK		5
+
+#define REQUEST_TYPE_VENDOR_IN	0xC0 // device to host, vendor, device
+
+// feature report: 16 bytes of button layout + diagnostics_t
+#define FEATURE_REPORT_LENGTH	32
+#define FEATURE_DIAGNOSTICS		16
+
+// ticks.c: one Timer1 tick is 1024 cycles at 16.5MHz
+#define TICK_US					(1024.0 * 1000000.0 / 16500000.0)
+
+// profiler.c: one profiler count is 16 cycles
+#define COUNT_US				(16.0 * 1000000.0 / 16500000.0)
+
+static const char *profile_phase_names[] = { "loop", "usbPoll", "controller", "connect", "report", "led" };
+#define PROFILE_PHASES			(sizeof(profile_phase_names) / sizeof(profile_phase_names[0]))
+#define PROFILE_BINS			8
+#define PROFILE_PHASE_LENGTH	18
+
+static uint16_t get16(const uint8_t *data) {
+	return data[0] | (data[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *data) {
+	return get16(data) | ((uint32_t)get16(data + 2) << 16);
+}
+
+// one number from /sys/bus/usb/devices/<device>/<name> (format: "%x" or "%d"), -1 if missing
+static int read_sysfs(const char *device, const char *name, const char *format) {
+	char path[512];
+	int value;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", device, name);
+	if (!(file = fopen(path, "r"))) return -1;
+	if (fscanf(file, format, &value) != 1) value = -1;
+	fclose(file);
+
+	return value;
+}
+
+// opens the first adapter found
+static int open_device() {
+	DIR *devices = opendir("/sys/bus/usb/devices");
+	struct dirent *entry;
+	int fd = -1;
+
+	if (!devices) return -1;
+
+	while (fd < 0 && (entry = readdir(devices))) {
+		char path[64];
+
+		if (read_sysfs(entry->d_name, "idVendor", "%x") != NESMINI_VENDOR_ID) continue;
+		if (read_sysfs(entry->d_name, "idProduct", "%x") != NESMINI_PRODUCT_ID) continue;
+
+		snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d",
+			read_sysfs(entry->d_name, "busnum", "%d"), read_sysfs(entry->d_name, "devnum", "%d"));
+		fd = open(path, O_RDWR);
+		if (fd < 0) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+
+	closedir(devices);
+	return fd;
+}
+
+// opens the hidraw node of the first adapter found (HID_ID=<bus>:<vendor>:<product>
+// in the uevent of the HID device)
+static int open_hidraw() {
+	DIR *devices = opendir("/sys/class/hidraw");
+	struct dirent *entry;
+	int fd = -1;
+
+	if (!devices) return -1;
+
+	while (fd < 0 && (entry = readdir(devices))) {
+		char path[512], line[128];
+		unsigned int bus, vendor, product;
+		int found = 0;
+		FILE *file;
+
+		if (entry->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+		if (!(file = fopen(path, "r"))) continue;
+		while (!found && fgets(line, sizeof(line), file)) {
+			found = sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3 &&
+				vendor == NESMINI_VENDOR_ID && product == NESMINI_PRODUCT_ID;
+		}
+		fclose(file);
+		if (!found) continue;
+
+		snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+		fd = open(path, O_RDWR);
+		if (fd < 0) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+
+	closedir(devices);
+	return fd;
+}
+
+// returns the bytes read, -1 on error (a STALL / empty reply means the
+// firmware was built without that option)
+static int control_request(int fd, uint8_t type, uint8_t request, uint16_t value, uint8_t *data, uint16_t length) {
+	struct usbdevfs_ctrltransfer transfer = {
+		.bRequestType = type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = 0,
+		.wLength = length,
+		.timeout = 1000,
+		.data = data,
+	};
+
+	return ioctl(fd, USBDEVFS_CONTROL, &transfer);
+}
+
+#define vendor_request(fd, request, value, data, length) \
+	control_request(fd, REQUEST_TYPE_VENDOR_IN, request, value, data, length)
+
+// fd: the hidraw node. No report IDs, so the first byte is a 0 going in and
+// coming back, the report starts after it
+static int print_diagnostics(int fd) {
+	uint8_t data[1 + FEATURE_REPORT_LENGTH] = { 0 };
+	int length = ioctl(fd, HIDIOCGFEATURE(sizeof(data)), data);
+	uint8_t *diagnostics = &data[1 + FEATURE_DIAGNOSTICS];
+
+	if (length < (int)sizeof(data)) return -1;
+
+	printf("reset cause:         %02X (%s%s%s%s)\n", diagnostics[0],
+		diagnostics[0] & 0x01 ? "power-on " : "", diagnostics[0] & 0x02 ? "external " : "",
+		diagnostics[0] & 0x04 ? "brown-out " : "", diagnostics[0] & 0x08 ? "watchdog " : "");
+	printf("watchdog resets:     %u\n", diagnostics[1]);
+	printf("i2c nacks:           %u\n", get16(&diagnostics[2]));
+	printf("disconnects:         %u\n", get16(&diagnostics[4]));
+	printf("reconnects:          %u\n", get16(&diagnostics[6]));
+	printf("stale reports:       %u\n", get16(&diagnostics[8]));
+	printf("since enumeration:   %u s\n", get16(&diagnostics[10]));
+	printf("oversampling:        %u\n", diagnostics[12]);
+	printf("samples per report:  %u\n", diagnostics[13]);
+	printf("i2c timeouts:        %u\n", get16(&diagnostics[14]));
+
+	return 0;
+}
+
+static int print_timing(int fd) {
+	uint8_t data[16];
+	int length = vendor_request(fd, VENDOR_RQ_GET_TIMING, 0, data, sizeof(data));
+
+	if (length < 9) return -1;
+
+	printf("poll interval:      %u ms\n", data[0]);
+	printf("host poll period:   %.2f ms\n", get16(&data[1]) * TICK_US / 1000);
+	printf("controller read:    %.2f ms\n", get16(&data[3]) * TICK_US / 1000);
+	printf("headroom:           %.2f ms\n", (int16_t)get16(&data[5]) * TICK_US / 1000);
+	printf("samples per report: %u\n", data[7]);
+	printf("locked to the host: %s\n", data[8] ? "yes" : "no");
+
+	return 0;
+}
+
+static int print_events(int fd) {
+	uint8_t data[1 + 8 * 4];
+	int length = vendor_request(fd, VENDOR_RQ_GET_EVENTS, 0, data, sizeof(data));
+
+	if (length < 1) return -1;
+
+	if (data[0] & 0x80) printf("(some events were lost)\n");
+
+	for (int x = 0; x < (data[0] & 0x7F) && 1 + x * 4 + 4 <= length; x++) {
+		uint8_t *event = &data[1 + x * 4];
+		printf("%8.2f ms  buttons %04X\n", get16(&event[2]) * TICK_US / 1000, get16(&event[0]));
+	}
+
+	return 0;
+}
+
+// a batch every poll interval (from the timing report), so the queue on the
+// adapter (8 events, two intervals at the default oversampling) never fills up
+static int watch_events(int fd) {
+	uint8_t timing[16];
+
+	if (vendor_request(fd, VENDOR_RQ_GET_TIMING, 0, timing, sizeof(timing)) < 9 || !timing[0]) return -1;
+
+	for (;;) {
+		if (print_events(fd) < 0) return -1;
+		fflush(stdout);
+		usleep(timing[0] * 1000);
+	}
+}
+
+static int print_stack(int fd) {
+	uint8_t data[4];
+	int length = vendor_request(fd, VENDOR_RQ_GET_STACK, 0, data, sizeof(data));
+
+	if (length < (int)sizeof(data)) return -1;
+
+	printf("stack used at most: %u bytes\n", get16(&data[0]));
+	printf("stack available:    %u bytes\n", get16(&data[2]));
+	printf("never touched:      %d bytes\n", get16(&data[2]) - get16(&data[0]));
+
+	return 0;
+}
+
+static int print_profile(int fd) {
+	uint8_t data[PROFILE_PHASES * PROFILE_PHASE_LENGTH];
+	int length = vendor_request(fd, VENDOR_RQ_GET_PROFILE, 0, data, sizeof(data));
+
+	if (length < (int)sizeof(data)) return -1;
+
+	printf("%-11s %8s %9s %9s %9s   <4us <16us <64us <256us <1ms <4ms <16ms >=16ms\n",
+		"phase", "count", "min us", "mean us", "max us");
+
+	for (unsigned int x = 0; x < PROFILE_PHASES; x++) {
+		uint8_t *phase = &data[x * PROFILE_PHASE_LENGTH];
+		uint16_t count = get16(&phase[8]);
+
+		printf("%-11s %8u", profile_phase_names[x], count);
+		if (count) {
+			printf(" %9.1f %9.1f %9.1f  ", get16(&phase[0]) * COUNT_US,
+				get32(&phase[4]) * COUNT_US / count, get16(&phase[2]) * COUNT_US);
+		} else {
+			printf(" %9s %9s %9s  ", "-", "-", "-");
+		}
+		for (int y = 0; y < PROFILE_BINS; y++) printf(" %5u", phase[10 + y]);
+		printf("\n");
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int fd, result = -1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s timing | events [watch] | profile [reset] | diagnostics | stack\n", argv[0]);
+		return 2;
+	}
+
+	if ((fd = !strcmp(argv[1], "diagnostics") ? open_hidraw() : open_device()) < 0) {
+		fprintf(stderr, "adapter not found (or no access)\n");
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "timing")) {
+		result = print_timing(fd);
+	} else if (!strcmp(argv[1], "events")) {
+		if (argc > 2 && !strcmp(argv[2], "watch")) result = watch_events(fd);
+		else result = print_events(fd);
+	} else if (!strcmp(argv[1], "diagnostics")) {
+		result = print_diagnostics(fd);
+	} else if (!strcmp(argv[1], "stack")) {
+		result = print_stack(fd);
+	} else if (!strcmp(argv[1], "profile")) {
+		if (argc > 2 && !strcmp(argv[2], "reset")) result = vendor_request(fd, VENDOR_RQ_RESET_PROFILE, 0, NULL, 0) < 0 ? -1 : 0;
+		else result = print_profile(fd);
+	} else {
+		fprintf(stderr, "unknown command: %s\n", argv[1]);
+	}
+
+	if (result < 0) fprintf(stderr, "request failed (is the option enabled on the firmware?)\n");
+
+	close(fd);
+	return result < 0 ? 1 : 0;
+}